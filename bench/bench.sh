@@ -0,0 +1,313 @@
+#!/bin/bash
+# Benchmark ktalk over loopback against a throwaway KDC, and print the
+# results as JSON on stdout.
+#
+#   bench.sh <ktalk> [handshakes] [lines] [pipe MB] [loss %]
+#
+# Needs the MIT krb5 server programs (krb5kdc, kdb5_util, kadmin.local)
+# and kinit, and nc if pipe mode is to be set against it.  Run as root
+# where tc has netem, it also times chat lines with packets dropped on
+# loopback, which is put back as it was.  Nothing else outside a temporary
+# directory is touched.
+
+set -e
+
+KTALK=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+HANDSHAKES=${2:-25}
+LINES=${3:-20000}
+PIPEMB=${4:-64}
+LOSS=${5:-5}
+LATLINES=200
+REALM=KTALK.BENCH
+KDCPORT=$((20000 + RANDOM % 20000))
+PATH=$PATH:/usr/sbin:/usr/local/sbin
+
+for prog in krb5kdc kdb5_util kadmin.local kinit; do
+  if ! command -v $prog >/dev/null; then
+    echo "bench: $prog not found, the MIT krb5 server programs are needed" >&2
+    exit 1
+  fi
+done
+
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/ktalk-bench.XXXXXX")
+KDCPID=
+NETEM=
+cleanup() {
+  [ -n "$KDCPID" ] && kill $KDCPID 2>/dev/null
+  [ -n "$NETEM" ] && tc qdisc del dev lo root 2>/dev/null
+  rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+# a realm of our own, on a port of our own
+cat > "$TMP/krb5.conf" <<EOF
+[libdefaults]
+	default_realm = $REALM
+	dns_lookup_kdc = false
+	dns_lookup_realm = false
+	rdns = false
+[realms]
+	$REALM = {
+		kdc = 127.0.0.1:$KDCPORT
+	}
+EOF
+cat > "$TMP/kdc.conf" <<EOF
+[kdcdefaults]
+	kdc_ports = $KDCPORT
+	kdc_tcp_ports = $KDCPORT
+[realms]
+	$REALM = {
+		database_name = $TMP/principal
+		key_stash_file = $TMP/stash
+		acl_file = $TMP/kadm5.acl
+		max_life = 1d
+	}
+[logging]
+	kdc = FILE:$TMP/kdc.log
+EOF
+export KRB5_CONFIG=$TMP/krb5.conf KRB5_KDC_PROFILE=$TMP/kdc.conf
+export KTALK_BENCH_PORTFILE=$TMP/port
+
+# the server's input stays open and empty, so it only leaves on hangup
+mkfifo "$TMP/idle"
+exec 3<>"$TMP/idle"
+
+kdb5_util create -s -r $REALM -P ktalk-bench >/dev/null 2>&1
+for p in alice bob; do
+  kadmin.local -r $REALM -q "addprinc -randkey $p" >/dev/null 2>&1
+  kadmin.local -r $REALM -q "ktadd -k $TMP/keytab $p" >/dev/null 2>&1
+done
+krb5kdc -n -r $REALM 2>>"$TMP/kdc.log" &
+KDCPID=$!
+
+for try in $(seq 50); do
+  if KRB5CCNAME=FILE:$TMP/cc.alice kinit -k -t "$TMP/keytab" alice 2>/dev/null
+  then
+    break
+  fi
+  sleep 0.1
+done
+KRB5CCNAME=FILE:$TMP/cc.bob kinit -k -t "$TMP/keytab" bob
+
+now() {
+  date +%s%N
+}
+
+# Run bob as the server and alice as the client with $1 as her input.
+# Sets ELAPSED to the nanoseconds from starting the client to the server
+# hearing it hang up, CPU to the seconds of cpu both used, and FIRST to
+# the nanoseconds the client took to send its first line, if it had one.
+run_pair() {
+  local spid start
+
+  rm -f "$KTALK_BENCH_PORTFILE" "$TMP/client.stats"
+  (TIMEFORMAT='%3U %3S'
+   time KRB5CCNAME=FILE:$TMP/cc.bob "$KTALK" -c -N "$KTALK_BENCH_PORTFILE" alice \
+	<"$TMP/idle" >"$TMP/server.out" 2>"$TMP/server.err") 2>"$TMP/server.cpu" &
+  spid=$!
+  while [ ! -s "$KTALK_BENCH_PORTFILE" ]; do
+    sleep 0.01
+  done
+
+  start=$(now)
+  (TIMEFORMAT='%3U %3S'
+   time KRB5CCNAME=FILE:$TMP/cc.alice "$KTALK" -c -S "$TMP/client.stats" \
+	bob 127.0.0.1 $(awk '{ print $4 }' "$KTALK_BENCH_PORTFILE") <"$1" \
+	>"$TMP/client.out" 2>"$TMP/client.err") 2>"$TMP/client.cpu"
+  wait $spid
+  ELAPSED=$(($(now) - start))
+  CPU=$(cat "$TMP/server.cpu" "$TMP/client.cpu" |
+	awk '{ t += $1 + $2 } END { print t }')
+  FIRST=$(sed -n 's/.*"first_msg_us": { "n": 1, "sum": \([0-9]*\).*/\1000/p' \
+	  "$TMP/client.stats")
+}
+
+# Pipe $1 from alice to bob with -P; sets ELAPSED as run_pair() does.
+run_pipe() {
+  local spid start
+
+  rm -f "$KTALK_BENCH_PORTFILE"
+  KRB5CCNAME=FILE:$TMP/cc.bob "$KTALK" -P -N "$KTALK_BENCH_PORTFILE" alice \
+	</dev/null >"$TMP/pipe.out" 2>"$TMP/server.err" &
+  spid=$!
+  while [ ! -s "$KTALK_BENCH_PORTFILE" ]; do
+    sleep 0.01
+  done
+
+  start=$(now)
+  KRB5CCNAME=FILE:$TMP/cc.alice "$KTALK" -P \
+	bob 127.0.0.1 $(awk '{ print $4 }' "$KTALK_BENCH_PORTFILE") <"$1" \
+	>/dev/null 2>"$TMP/client.err"
+  wait $spid
+  ELAPSED=$(($(now) - start))
+}
+
+# Send $LATLINES lines from alice to bob with ktalk options $1, each
+# carrying the time it was sent, and leave in $TMP/lat how many
+# nanoseconds each took to come out at bob's end.
+run_lines() {
+  local spid i
+
+  rm -f "$KTALK_BENCH_PORTFILE"
+  KRB5CCNAME=FILE:$TMP/cc.bob "$KTALK" -c $1 -N "$KTALK_BENCH_PORTFILE" \
+	alice <"$TMP/idle" 2>"$TMP/server.err" |
+    while IFS= read -r line; do
+      echo "$EPOCHREALTIME $line"
+    done >"$TMP/lat.out" &
+  spid=$!
+  while [ ! -s "$KTALK_BENCH_PORTFILE" ]; do
+    sleep 0.01
+  done
+
+  # after the handshake, so it is not counted against the first lines
+  (sleep 1
+   for i in $(seq $LATLINES); do
+     echo "lat $EPOCHREALTIME"
+     sleep 0.02
+   done) | KRB5CCNAME=FILE:$TMP/cc.alice "$KTALK" -c $1 \
+	bob 127.0.0.1 $(awk '{ print $4 }' "$KTALK_BENCH_PORTFILE") \
+	>/dev/null 2>"$TMP/client.err"
+  wait $spid
+  awk '$2 == "lat" { printf "%.0f\n", ($1 - $3) * 1e9 }' "$TMP/lat.out" \
+      >"$TMP/lat"
+}
+
+# p50 and p99 of a list of nanosecond times, in milliseconds
+percentiles() {
+  sort -n | awk '{ v[NR] = $1 }
+    function pct(p,  i) { i = int(p * NR + 0.999999); if (i < 1) i = 1;
+			  return v[i] / 1e6 }
+    END { printf "{ \"p50\": %.3f, \"p99\": %.3f }", pct(0.50), pct(0.99) }'
+}
+
+# handshakes, first with a fresh user to user ticket each time and then
+# with the one ktalk cached, keeping the cpu those took as well
+: >"$TMP/empty"
+: >"$TMP/warm.cpu"
+for i in $(seq $HANDSHAKES); do
+  rm -f "$TMP/cc.alice_ktalk"
+  KRB5CCNAME=FILE:$TMP/cc.alice kinit -k -t "$TMP/keytab" alice
+  run_pair "$TMP/empty"
+  echo $ELAPSED
+done >"$TMP/cold"
+for i in $(seq $HANDSHAKES); do
+  run_pair "$TMP/empty"
+  echo $ELAPSED
+  echo $CPU >>"$TMP/warm.cpu"
+done >"$TMP/warm"
+HANDSHAKE=$(sort -n "$TMP/warm" | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }')
+HANDSHAKE_CPU=$(sort -n "$TMP/warm.cpu" | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }')
+
+# from the client starting to its first line going out
+echo "hello" >"$TMP/hello"
+for i in $(seq $HANDSHAKES); do
+  run_pair "$TMP/hello"
+  echo $FIRST
+done >"$TMP/first"
+
+# many short lines, for the per message cost
+awk -v n=$LINES 'BEGIN { for (i = 0; i < n; i++)
+		   printf "line %08d of the ktalk benchmark, short\n", i }' \
+    >"$TMP/short"
+run_pair "$TMP/short"
+GOT=$(wc -l <"$TMP/server.out")
+if [ $GOT -lt $LINES ]; then
+  echo "bench: server saw $GOT of $LINES lines" >&2
+  exit 1
+fi
+LINE_NS=$((ELAPSED - HANDSHAKE))
+# less what the handshake and starting up cost, as for the time
+LINE_CPU=$(awk -v cpu=$CPU -v hs=$HANDSHAKE_CPU 'BEGIN { print cpu - hs }')
+
+# long lines, for throughput
+awk -v n=$LINES 'BEGIN { s = sprintf("%700s", ""); gsub(/ /, "x", s);
+		   for (i = 0; i < n; i++) print s }' >"$TMP/long"
+BYTES=$(wc -c <"$TMP/long")
+run_pair "$TMP/long"
+BYTE_NS=$((ELAPSED - HANDSHAKE))
+
+# pipe mode, with bytes that neither compress nor look like text
+head -c $((PIPEMB * 1048576)) /dev/urandom >"$TMP/blob"
+PIPE_BYTES=$(wc -c <"$TMP/blob")
+run_pipe "$TMP/blob"
+if ! cmp -s "$TMP/blob" "$TMP/pipe.out"; then
+  echo "bench: pipe mode did not deliver the same bytes" >&2
+  exit 1
+fi
+PIPE_NS=$((ELAPSED - HANDSHAKE))
+
+# and the same through plain nc, for what the encryption costs; at the end
+# of input OpenBSD's shuts its side down with -N, the traditional one -q 0
+NC_BPS=null
+if command -v nc >/dev/null; then
+  NCPORT=$((KDCPORT + 1))
+  if nc -h 2>&1 | grep -q OpenBSD; then
+    NCLISTEN="nc -l 127.0.0.1 $NCPORT"
+    NCSEND="nc -N 127.0.0.1 $NCPORT"
+  else
+    NCLISTEN="nc -l -p $NCPORT"
+    NCSEND="nc -q 0 127.0.0.1 $NCPORT"
+  fi
+  $NCLISTEN </dev/null >"$TMP/nc.out" 2>/dev/null &
+  ncpid=$!
+  for try in $(seq 50); do
+    start=$(now)
+    if $NCSEND <"$TMP/blob" >/dev/null 2>&1; then
+      break
+    fi
+    sleep 0.1
+  done
+  wait $ncpid || true
+  NC_NS=$(($(now) - start))
+  if cmp -s "$TMP/blob" "$TMP/nc.out"; then
+    NC_BPS=$(awk -v b=$PIPE_BYTES -v ns=$NC_NS \
+	     'BEGIN { printf "%.0f", b / (ns / 1e9) }')
+  fi
+fi
+
+# chat lines with packets lost, over TCP alone and then with -u
+LOSSY=null
+export LC_ALL=C			# for the decimal point in $EPOCHREALTIME
+if [ "$(id -u)" = 0 ] && tc qdisc add dev lo root netem loss $LOSS% \
+     2>/dev/null; then
+  NETEM=1
+  run_lines ""
+  TCP_LAT=$(percentiles <"$TMP/lat")
+  TCP_GOT=$(wc -l <"$TMP/lat")
+  run_lines -u
+  UDP_LAT=$(percentiles <"$TMP/lat")
+  UDP_GOT=$(wc -l <"$TMP/lat")
+  tc qdisc del dev lo root
+  NETEM=
+  if [ $TCP_GOT -lt $LATLINES ] || [ $UDP_GOT -lt $LATLINES ]; then
+    echo "bench: lines went missing with $LOSS% loss" >&2
+    exit 1
+  fi
+  LOSSY="{ \"loss_pct\": $LOSS, \"tcp_ms\": $TCP_LAT, \"udp_ms\": $UDP_LAT }"
+fi
+
+awk -v hs=$HANDSHAKES -v lines=$LINES -v line_ns=$LINE_NS -v cpu=$LINE_CPU \
+    -v bytes=$BYTES -v byte_ns=$BYTE_NS \
+    -v pipe_bytes=$PIPE_BYTES -v pipe_ns=$PIPE_NS -v nc_bps=$NC_BPS \
+    -v lossy="$LOSSY" \
+    -v cold="$(percentiles <"$TMP/cold")" \
+    -v warm="$(percentiles <"$TMP/warm")" \
+    -v first="$(percentiles <"$TMP/first")" \
+    -v date="$(date -u +%Y-%m-%dT%H:%M:%SZ)" 'BEGIN {
+  printf "{\n"
+  printf "  \"date\": \"%s\",\n", date
+  printf "  \"handshakes\": %d,\n", hs
+  printf "  \"handshake_ms\": %s,\n", warm
+  printf "  \"handshake_cold_ms\": %s,\n", cold
+  printf "  \"first_msg_ms\": %s,\n", first
+  printf "  \"lines\": %d,\n", lines
+  printf "  \"lines_per_sec\": %.0f,\n", lines / (line_ns / 1e9)
+  printf "  \"bytes\": %d,\n", bytes
+  printf "  \"bytes_per_sec\": %.0f,\n", bytes / (byte_ns / 1e9)
+  printf "  \"cpu_us_per_msg\": %.2f,\n", cpu * 1e6 / lines
+  printf "  \"pipe_bytes\": %d,\n", pipe_bytes
+  printf "  \"pipe_bytes_per_sec\": %.0f,\n", pipe_bytes / (pipe_ns / 1e9)
+  printf "  \"nc_bytes_per_sec\": %s,\n", nc_bps
+  printf "  \"lossy_lines\": %s\n", lossy
+  printf "}\n"
+}'
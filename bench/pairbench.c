@@ -0,0 +1,274 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+ * Both ends of a session in one process, over a socketpair, with no KDC
+ * and no network: a random session key stands in for the handshake.  This
+ * times the framing and sealing code alone, and prints the result as JSON.
+ *
+ *   pairbench [-b krb5|fast|null] [-n frames] [-s size] [-z] [-j workers]
+ *
+ * With -j the frames are file data on the bulk channel, sealed and opened
+ * by that many threads of the pool, or on the main thread with -j 0.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include "ktalk.h"
+
+int debug_flag = 0;
+
+void
+debug(const char *format, ...) {
+  va_list ap;
+
+  if (!debug_flag)
+    return;
+  va_start(ap, format);
+  fputs("DEBUG: ", stderr);
+  vfprintf(stderr, format, ap);
+  fputc('\n', stderr);
+  va_end(ap);
+}
+
+void
+fail(long err, const char *context) {
+  fprintf(stderr, "%s: %s\n", context, error_message(err));
+  exit(1);
+}
+
+void
+bye(const char *message) {
+  puts(message);
+  exit(0);
+}
+
+static void
+usage(const char *whoami) {
+  fprintf(stderr, "usage: %s [-b krb5|fast|null] [-n frames] [-s size] [-z]"
+	  " [-j workers]\n", whoami);
+  exit(1);
+}
+
+/* what the handshake would have left each end with */
+static void
+attach_krb5(krb5_context context, kconn *a, kconn *b, int fast) {
+  krb5_auth_context actx, bctx;
+  krb5_keyblock key, sub;
+  int ret;
+
+  ret = krb5_c_make_random_key(context, ENCTYPE_AES256_CTS_HMAC_SHA1_96,
+			       &key);
+  if (ret)
+    fail(ret, "krb5_c_make_random_key");
+  if (auth_con_setup(context, &actx, a) < 0
+      || auth_con_setup(context, &bctx, b) < 0)
+    fail(errno, "getting socket addresses");
+  ret = krb5_auth_con_setuseruserkey(context, actx, &key);
+  if (!ret)
+    ret = krb5_auth_con_setuseruserkey(context, bctx, &key);
+  if (ret)
+    fail(ret, "krb5_auth_con_setuseruserkey");
+  krb5_free_keyblock_contents(context, &key);
+
+  /* and the subkey from the client's authenticator, for both ways */
+  ret = krb5_c_make_random_key(context, ENCTYPE_AES256_CTS_HMAC_SHA1_96,
+			       &sub);
+  if (ret)
+    fail(ret, "krb5_c_make_random_key");
+  ret = krb5_auth_con_setsendsubkey(context, actx, &sub);
+  if (!ret)
+    ret = krb5_auth_con_setrecvsubkey(context, actx, &sub);
+  if (!ret)
+    ret = krb5_auth_con_setsendsubkey(context, bctx, &sub);
+  if (!ret)
+    ret = krb5_auth_con_setrecvsubkey(context, bctx, &sub);
+  if (ret)
+    fail(ret, "setting the session subkey");
+  krb5_free_keyblock_contents(context, &sub);
+
+  sec_krb5_attach(a, context, actx);
+  sec_krb5_attach(b, context, bctx);
+  if (fast) {
+    sec_krb5_fast(a, 1);
+    sec_krb5_fast(b, 0);
+  }
+}
+
+/* frames the pool has opened for b; with wait, one at least */
+static int
+take_pooled(kconn *b, int wait) {
+  kframe frame;
+  krb5_data msg;
+  int n = 0;
+
+  while (pool_opened(b, &frame, &msg, wait) > 0) {
+    n++;
+    wait = 0;
+  }
+  return n;
+}
+
+/* open every whole frame b has, returning how many there were */
+static int
+drain(kconn *a, kconn *b) {
+  kframe frame;
+  krb5_data msg;
+  int ret, pooled, n = 0;
+
+  pool_flush(a);
+  if (conn_flush(a) < 0)
+    fail(errno, "writing");
+  ret = conn_fill(b);
+  if (ret == 0)
+    bye("connection closed");
+  if (ret < 0 && errno != EINTR && errno != EAGAIN)
+    fail(errno, "reading");
+  while ((ret = conn_frame(b, &frame)) > 0) {
+    while ((pooled = pool_open(b, &frame)) < 0)
+      n += take_pooled(b, 1);
+    if (pooled)
+      continue;
+    ret = open_sealed(b, &frame, &msg);
+    if (ret)
+      fail(ret, "opening message");
+    done_sealed(b, &frame, &msg);
+    n++;
+  }
+  if (ret < 0)
+    fail(errno, "reading");
+  return n + take_pooled(b, 0);
+}
+
+int
+main(int argc, char **argv) {
+  const char *backend = "fast";
+  long frames = 200000, sent = 0, got = 0;
+  size_t size = 64;
+  krb5_context context;
+  kconn a, b;
+  char *data;
+  long long start, ns;
+  int fds[2], opt, ret, zip = 0, bulk = 0;
+  extern char *optarg;
+
+  while ((opt = getopt(argc, argv, "b:dj:n:s:z")) != -1) {
+    switch (opt) {
+    case 'b':
+      backend = optarg;
+      break;
+    case 'd':
+      debug_flag = !debug_flag;
+      break;
+    case 'j':
+      pool_workers = atoi(optarg);
+      bulk = 1;
+      break;
+    case 'n':
+      frames = atol(optarg);
+      break;
+    case 's':
+      size = atol(optarg);
+      break;
+    case 'z':
+      zip = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (frames <= 0 || size == 0 || size > FRAME_MAXLEN / 2)
+    usage(argv[0]);
+  if (bulk && strcmp(backend, "fast")) {
+    fprintf(stderr, "%s: -j needs the fast backend\n", argv[0]);
+    exit(1);
+  }
+
+  ret = krb5_init_context(&context);
+  if (ret)
+    fail(ret, "krb5_init_context");
+
+  pair_open(fds);
+  conn_init(&a, fds[0], &transport_pair);
+  conn_init(&b, fds[1], &transport_pair);
+  /* agreed first, since the fast path starts the pool if there are channels */
+  a.caps = b.caps = CAP_BINARY | (zip ? CAP_ZLIB : 0)
+      | (bulk ? CAP_FAST | CAP_CHAN : 0);
+  conn_agree(&a);
+  conn_agree(&b);
+  if (!strcmp(backend, "krb5") || !strcmp(backend, "fast")) {
+    attach_krb5(context, &a, &b, !strcmp(backend, "fast"));
+#ifdef KTALK_NULL_CIPHER
+  } else if (!strcmp(backend, "null")) {
+    sec_null_attach(&a);
+    sec_null_attach(&b);
+#endif
+  } else {
+    fprintf(stderr, "%s: no backend %s in this build\n", argv[0], backend);
+    exit(1);
+  }
+  if (conn_nonblock(&a) < 0 || conn_nonblock(&b) < 0)
+    fail(errno, "setting up socketpair");
+
+  data = malloc(size);
+  if (!data)
+    fail(errno, "allocating message");
+  memset(data, 'x', size);
+
+  start = now_usec();
+  while (got < frames) {
+    /* send until the queue is full, then let the other end catch up */
+    while (sent < frames) {
+      if (send_sealed(&a, bulk ? FRAME_FILE_DATA : FRAME_DATA, data,
+		      size) < 0) {
+	if (errno != ENOBUFS)
+	  fail(errno, "sending");
+	break;
+      }
+      sent++;
+    }
+    got += drain(&a, &b);
+  }
+  ns = (now_usec() - start) * 1000;
+
+  printf("{ \"backend\": \"%s\", \"zlib\": %s, \"workers\": %d, "
+	 "\"frames\": %ld, \"size\": %lu, \"frames_per_sec\": %.0f, "
+	 "\"bytes_per_sec\": %.0f, \"ns_per_frame\": %.0f }\n", backend,
+	 zip ? "true" : "false", bulk ? pool_workers : 0,
+	 frames, (unsigned long)size, frames / (ns / 1e9),
+	 frames * (double)size / (ns / 1e9), (double)ns / frames);
+
+  free(data);
+  conn_free(&a);
+  conn_free(&b);
+  krb5_free_context(context);
+  return 0;
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
@@ -0,0 +1,233 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+ * User to user tickets are kept in a ccache of their own, matched on the
+ * peer's principal and the TGT they sent us.  Talking to the same person
+ * again while their TGT is good then needs no trip to the KDC.  When the
+ * cache grows past UUCACHE_MAX tickets it is rewritten with only the ones
+ * that have not expired.
+ *
+ * Anyone who could write the cache could plant tickets in it, and anyone
+ * who could read it could use ours, so it is kept only where no one else
+ * can get at it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "ktalk.h"
+
+#define UUCACHE_MAX	32
+#define UUCACHE_SLACK	60	/* reuse a ticket only with this much left */
+
+static int hits = 0, misses = 0;
+
+/*
+ * A directory of our own under $TMPDIR, into dir, which is len long; the
+ * daemon's socket is there too.  Returns -1 with errno set if there is
+ * none, EPERM if someone else could get into it.
+ */
+int
+private_dir(char *dir, size_t len, int create) {
+  const char *tmp;
+  struct stat st;
+
+  tmp = getenv("TMPDIR");
+  if (!tmp || !*tmp)
+    tmp = "/tmp";
+  if (snprintf(dir, len, "%s/ktalk-%lu", tmp, (unsigned long)getuid())
+      >= (int)len) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if (create && mkdir(dir, 0700) < 0 && errno != EEXIST)
+    return -1;
+  if (lstat(dir, &st) < 0)
+    return -1;
+  if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+    errno = EPERM;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Open our cache of user to user tickets, starting it over if need be.
+ * It sits next to a file ccache, so it goes with whichever one is in use;
+ * with any other kind it goes in our private directory.  Either way, a
+ * cache that is there already must be a plain file of ours.
+ */
+static krb5_ccache
+uucache_open(krb5_context context, krb5_ccache ccache, krb5_principal me) {
+  krb5_principal owner;
+  krb5_ccache cache;
+  const char *type;
+  char dir[1024], name[1024];
+  struct stat st;
+  int ret;
+
+  type = krb5_cc_get_type(context, ccache);
+  if (type && !strcmp(type, "FILE")) {
+    snprintf(name, sizeof(name), "FILE:%s_ktalk",
+	     krb5_cc_get_name(context, ccache));
+  } else {
+    if (private_dir(dir, sizeof(dir), 1) < 0) {
+      debug("no user to user ticket cache: %s", strerror(errno));
+      return NULL;
+    }
+    snprintf(name, sizeof(name), "FILE:%s/uucache", dir);
+  }
+  if (lstat(name + 5, &st) == 0
+      && (!S_ISREG(st.st_mode) || st.st_uid != getuid()
+	  || (st.st_mode & 077))) {
+    debug("%s is not private to you, not using it", name + 5);
+    return NULL;
+  }
+  ret = krb5_cc_resolve(context, name, &cache);
+  if (ret) {
+    debug("krb5_cc_resolve %s: %s", name, error_message(ret));
+    return NULL;
+  }
+
+  ret = krb5_cc_get_principal(context, cache, &owner);
+  if (!ret) {
+    if (krb5_principal_compare(context, owner, me)) {
+      krb5_free_principal(context, owner);
+      return cache;
+    }
+    krb5_free_principal(context, owner);
+  }
+  ret = krb5_cc_initialize(context, cache, me);
+  if (ret) {
+    debug("krb5_cc_initialize %s: %s", name, error_message(ret));
+    krb5_cc_close(context, cache);
+    return NULL;
+  }
+  return cache;
+}
+
+/* rewrite the cache with only the tickets that are still good */
+static void
+uucache_prune(krb5_context context, krb5_ccache cache, krb5_principal me) {
+  krb5_creds keep[UUCACHE_MAX], creds;
+  krb5_cc_cursor cursor;
+  krb5_timestamp now;
+  int i, n = 0, total = 0;
+
+  if (krb5_cc_start_seq_get(context, cache, &cursor))
+    return;
+  krb5_timeofday(context, &now);
+  while (!krb5_cc_next_cred(context, cache, &cursor, &creds)) {
+    total++;
+    if (creds.times.endtime > now + UUCACHE_SLACK && n < UUCACHE_MAX)
+      keep[n++] = creds;
+    else
+      krb5_free_cred_contents(context, &creds);
+  }
+  krb5_cc_end_seq_get(context, cache, &cursor);
+
+  if (total >= UUCACHE_MAX && !krb5_cc_initialize(context, cache, me)) {
+    debug("pruned user to user ticket cache from %d to %d", total, n);
+    for (i = 0; i < n; i++)
+      krb5_cc_store_cred(context, cache, &keep[i]);
+  }
+  for (i = 0; i < n; i++)
+    krb5_free_cred_contents(context, &keep[i]);
+}
+
+/*
+ * Get a ticket to talk to peer, whose TGT is in tkt, from the cache or
+ * failing that from the KDC.
+ */
+krb5_creds *
+get_uu_creds(krb5_context context, krb5_ccache ccache, const char *peer,
+	     krb5_data *tkt) {
+  krb5_creds creds, *out_creds;
+  krb5_ccache cache;
+  krb5_timestamp now;
+  long long start;
+  int ret;
+
+  memset(&creds, 0, sizeof(creds));
+  ret = krb5_parse_name(context, peer, &creds.server);
+  if (ret)
+    fail(ret, "krb5_parse_name");
+  ret = krb5_cc_get_principal(context, ccache, &creds.client);
+  if (ret)
+    fail(ret, "krb5_cc_get_principal");
+  creds.second_ticket = *tkt;
+  creds.is_skey = TRUE;
+
+  cache = uucache_open(context, ccache, creds.client);
+  if (cache) {
+    out_creds = malloc(sizeof(*out_creds));
+    if (!out_creds)
+      fail(errno, "allocating credentials");
+    krb5_timeofday(context, &now);
+    creds.times.endtime = now + UUCACHE_SLACK;
+    ret = krb5_cc_retrieve_cred(context, cache,
+				KRB5_TC_MATCH_2ND_TKT | KRB5_TC_MATCH_IS_SKEY
+				| KRB5_TC_MATCH_TIMES, &creds, out_creds);
+    creds.times.endtime = 0;
+    if (!ret) {
+      hits++;
+      debug("user to user ticket from the cache (%d hits, %d misses)",
+	    hits, misses);
+      goto done;
+    }
+    free(out_creds);
+  }
+
+  misses++;
+  start = now_usec();
+  ret = krb5_get_credentials(context, KRB5_GC_USER_USER, ccache, &creds,
+			     &out_creds);
+  stat_time(ST_TGS, start);
+  if (ret)
+    fail(ret, "getting user to user credentials");
+  debug("user to user ticket from the KDC (%d hits, %d misses)", hits, misses);
+  if (cache) {
+    uucache_prune(context, cache, creds.client);
+    ret = krb5_cc_store_cred(context, cache, out_creds);
+    if (ret)
+      debug("krb5_cc_store_cred: %s", error_message(ret));
+  }
+
+done:
+  if (cache)
+    krb5_cc_close(context, cache);
+  /* the TGT belongs to the caller */
+  creds.second_ticket.data = NULL;
+  creds.second_ticket.length = 0;
+  krb5_free_cred_contents(context, &creds);
+  return out_creds;
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
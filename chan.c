@@ -0,0 +1,132 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+
+/*
+ * Logical channels.  When both ends offer "chan", every frame carries the
+ * channel it belongs to in its header: chat and everything to do with it
+ * on one, the files we send on another, and flow control and pings on a
+ * third.  Frames are sealed as they are queued, each channel counting its
+ * own fast path sequence numbers, so the queues can be served most urgent
+ * first (see conn_push()) and a line typed during a transfer goes out
+ * after at most one chunk of the file.
+ *
+ * Bulk data has a window besides: the sender stops once CHAN_WINDOW bytes
+ * of it are out that the receiver has not said it has dealt with, and
+ * the receiver says so with a WINDOW frame every quarter window.  A
+ * receiver that falls behind on a file then holds up only the file, and
+ * the socket buffers never fill with data it is not ready for.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ktalk.h"
+
+/* which channel a frame of this type goes on */
+int
+frame_chan(kconn *c, int type) {
+  if (!(c->caps & CAP_CHAN))
+    return CHAN_CHAT;
+  switch (type) {
+  case FRAME_FILE_BEGIN:
+  case FRAME_FILE_DATA:
+  case FRAME_FILE_END:
+  case FRAME_PIPE:
+  case FRAME_PIPE_END:
+    return CHAN_BULK;
+  case FRAME_WINDOW:
+  case FRAME_PING:
+  case FRAME_PONG:
+    return CHAN_CTL;
+  default:
+    return CHAN_CHAT;
+  }
+}
+
+/*
+ * May another bulk frame be queued: nothing but the one being written is
+ * waiting, and the window is open.  With a pool, as many may be in hand
+ * as it is deep.  Without channels, only a full queue stops it, as it
+ * always has.
+ */
+int
+chan_bulk_room(kconn *c) {
+  if (!(c->caps & CAP_CHAN))
+    return !conn_congested(c);
+  if (c->pool)
+    return pool_room(c);
+  return !c->bulk_waiting && c->bulk_sent - c->bulk_acked < CHAN_WINDOW;
+}
+
+/* an incoming frame has been dealt with; bulk data opens the window */
+int
+chan_consumed(kconn *c, kframe *f) {
+  if (f->chan != CHAN_BULK)
+    return 0;
+  c->bulk_read += f->len;
+  return chan_grant(c);
+}
+
+/*
+ * Tell the sender how much bulk data we have taken, when it is worth it.
+ * Returns -1 with errno set if the connection has failed.
+ */
+int
+chan_grant(kconn *c) {
+  unsigned char buf[8];
+
+  if (c->bulk_read - c->bulk_granted < CHAN_WINDOW / 4)
+    return 0;
+  /* what we have is not out of the way yet, so the sender waits */
+  if (c->bulk_held)
+    return 0;
+  put64(buf, c->bulk_read);
+  if (send_sealed(c, FRAME_WINDOW, (char *)buf, sizeof(buf)) < 0) {
+    if (errno != ENOBUFS)
+      return -1;
+    return 0;			/* the main loop tries again */
+  }
+  c->bulk_granted = c->bulk_read;
+  return 0;
+}
+
+/* the peer has taken this much of our bulk data */
+void
+chan_window(kconn *c, krb5_data *msg) {
+  unsigned long long n;
+
+  if (msg->length < 8)
+    return;
+  n = get64((unsigned char *)msg->data);
+  if (n < c->bulk_acked || n > c->bulk_sent) {
+    debug("ignoring a window of %llu, sent %llu", n, c->bulk_sent);
+    return;
+  }
+  c->bulk_acked = n;
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
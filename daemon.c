@@ -0,0 +1,711 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+
+/*
+ * The daemon (ktalk -D).  One process that stays up keeps the krb5
+ * context, the credentials cache and our TGT, and listens on one port
+ * that people can be told about once.  Each connection to it gets the
+ * server's half of the handshake, as from ktalk <user>, without holding
+ * up any of the others.  Once the peer has authenticated, the session
+ * waits for a front end (ktalk -A <user>) to claim it over a Unix socket
+ * in a directory only we can get into.
+ *
+ * From then on the daemon opens what the peer sends and passes it to the
+ * front end as it is, and seals what the front end sends, so the front
+ * end needs no krb5 of its own.  Each end is read only while the other
+ * has room for what comes of it.  A session that is not doing anything
+ * holds no buffers, so hundreds of them cost little more than their
+ * sockets and auth contexts.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include "ktalk.h"
+
+#define DAEMON_MAX	1024	/* sessions, claimed or not */
+#define DAEMON_AUTH	30	/* seconds a peer has to authenticate */
+
+/* all a front end can be handed; the rest is between us and the peer */
+#define FRONT_CAPS	(CAP_BINARY | CAP_FILE | CAP_LIVE)
+
+/* an incoming frame, once opened, and an outgoing one, once sealed */
+#define FRONT_ROOM	(FRAME_HDRLEN + FRAME_MAXLEN)
+#define PEER_ROOM	(FRAME_HDRLEN + FRAME_MAXLEN + SEAL_SLOP)
+
+typedef struct ksession {
+  kconn peer;			/* the other party, once they connect */
+  kconn front;			/* ktalk -A, once one claims the session */
+  krb5_auth_context auth_context;
+  char *principal;		/* who the peer authenticated as */
+  char *want;			/* who the front end is waiting for */
+  unsigned int front_caps;	/* what the front end understands */
+  long long since;		/* when the peer connected */
+  int joined;			/* the peer's handshake is done */
+  int held;			/* front end's bulk waits on the window */
+  int closing;			/* one end has gone, the other is flushing */
+  int dead;			/* to be dropped at the end of this pass */
+} ksession;
+
+static ksession **sessions = NULL;
+static int nsessions = 0, maxsessions = 0;
+
+static krb5_creds *tgt = NULL;
+static char sockpath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static unsigned short sockport;
+static int starved = 0;		/* out of descriptors, not accepting */
+
+static void session_run(krb5_context context, ksession *s);
+
+/*
+ * Where the daemon's socket is: a directory of our own under $TMPDIR.
+ * Anything that is not ours alone is refused, since whoever could reach
+ * the socket could read and write our conversations.
+ */
+static void
+daemon_path(int create) {
+  char dir[sizeof(sockpath)];
+
+  /* with room left for the socket's name */
+  if (private_dir(dir, sizeof(dir) - 8, create) < 0) {
+    if (errno == ENOENT)
+      bye("no ktalk daemon is running; start one with ktalk -D");
+    if (errno == EPERM) {
+      fprintf(stderr, "%s is not private to you, not using it\n", dir);
+      exit(1);
+    }
+    fail(errno, dir);
+  }
+  snprintf(sockpath, sizeof(sockpath), "%s/daemon", dir);
+}
+
+static void
+unix_address(struct sockaddr_un *sun) {
+  memset(sun, 0, sizeof(*sun));
+  sun->sun_family = AF_UNIX;
+  strncpy(sun->sun_path, sockpath, sizeof(sun->sun_path) - 1);
+}
+
+static void
+unlink_socket(void) {
+  unlink(sockpath);
+}
+
+static int
+unix_listen(void) {
+  struct sockaddr_un sun;
+  int fd;
+
+  daemon_path(1);
+  unix_address(&sun);
+
+  /* a socket left by a daemon that died answers no one */
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    fail(errno, "creating socket");
+  if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0) {
+    fprintf(stderr, "a ktalk daemon is already running\n");
+    exit(1);
+  }
+  close(fd);
+  unlink(sockpath);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    fail(errno, "creating socket");
+  if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+    fail(errno, "binding daemon socket");
+  atexit(unlink_socket);
+  if (listen(fd, SOMAXCONN) < 0)
+    fail(errno, "listening on daemon socket");
+  return fd;
+}
+
+/* our TGT, read from the cache again once the one we have runs out */
+static krb5_creds *
+current_tgt(krb5_context context, krb5_ccache ccache) {
+  if (tgt && tgt->times.endtime > time(NULL))
+    return tgt;
+  if (tgt)
+    krb5_free_creds(context, tgt);
+  tgt = get_tgt_creds(context, ccache);
+  if (tgt->times.endtime <= time(NULL))
+    notice("your tickets have expired; nobody can connect until you kinit");
+  return tgt;
+}
+
+static ksession *
+session_new(void) {
+  ksession *s;
+
+  if (nsessions == maxsessions) {
+    maxsessions = maxsessions ? maxsessions * 2 : 16;
+    sessions = realloc(sessions, maxsessions * sizeof(*sessions));
+    if (!sessions)
+      fail(errno, "allocating session table");
+  }
+  s = calloc(1, sizeof(*s));
+  if (!s)
+    fail(errno, "allocating session");
+  conn_init(&s->peer, -1, &transport_tcp);
+  conn_init(&s->front, -1, &transport_unix);
+  s->since = now_usec();
+  sessions[nsessions++] = s;
+  return s;
+}
+
+static void
+end_close(kconn *c) {
+  if (c->fd >= 0) {
+    ev_set(c->fd, 0, NULL);
+    close(c->fd);
+  }
+  conn_free(c);
+  c->fd = -1;
+}
+
+static void
+session_free(krb5_context context, ksession *s) {
+  end_close(&s->peer);
+  end_close(&s->front);
+  if (s->auth_context)
+    krb5_auth_con_free(context, s->auth_context);
+  free(s->principal);
+  free(s->want);
+  free(s);
+}
+
+/* one end has gone; the other gets what is queued for it, then goes too */
+static void
+session_hangup(ksession *s, kconn *c) {
+  kconn *other = c == &s->peer ? &s->front : &s->peer;
+
+  if (c->fd < 0)
+    return;
+  end_close(c);
+  if (other->fd < 0 || !s->joined) {
+    s->dead = 1;
+    return;
+  }
+  if (!s->closing && s->principal)
+    notice("session with %s is over", s->principal);
+  s->closing = 1;
+}
+
+/*
+ * Hand the front end waiting in f the session with the peer in s.  The
+ * front end learns who it is talking to, what the peer can do, and which
+ * of that it can be sent.
+ */
+static void
+session_claim(ksession *s, ksession *f) {
+  char buf[1024];
+  size_t n;
+
+  s->front = f->front;
+  s->front_caps = f->front_caps;
+  s->want = f->want;
+  f->want = NULL;
+  conn_init(&f->front, -1, &transport_unix);
+  f->dead = 1;
+
+  n = strlen(s->principal) + 1;
+  if (n > sizeof(buf) / 2) {
+    s->dead = 1;
+    return;
+  }
+  memcpy(buf, s->principal, n);
+  caps_format(s->peer.caps, buf + n, sizeof(buf) - n);
+  n += strlen(buf + n);
+  s->front.caps = s->peer.caps & s->front_caps & FRONT_CAPS;
+  if (conn_send_ascii(&s->front, buf, n, s->front.caps) < 0) {
+    s->dead = 1;
+    return;
+  }
+  conn_agree(&s->front);
+  notice("%s handed to a front end", s->principal);
+}
+
+/* both names are as krb5_unparse_name() gave them, and case matters */
+static int
+wanted(ksession *f, ksession *s) {
+  return !strcmp(f->want, s->principal);
+}
+
+/* a session with a peer and no front end, or a front end and no peer */
+static int
+unclaimed(ksession *s) {
+  return !s->dead && !s->closing && s->joined && s->front.fd < 0;
+}
+
+static int
+waiting(ksession *f) {
+  return !f->dead && !f->joined && f->want;
+}
+
+/* accept() failed; running out of descriptors stops us until some close */
+static void
+accept_failed(const char *what) {
+  if (errno == EMFILE || errno == ENFILE) {
+    notice("%s: %s", what, strerror(errno));
+    starved = 1;
+  } else if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED) {
+    notice("%s: %s", what, strerror(errno));
+  }
+}
+
+static void
+peer_accept(krb5_context context, krb5_ccache ccache, int sock) {
+  krb5_creds *creds;
+  ksession *s;
+  int fd, ret;
+
+  fd = accept(sock, NULL, NULL);
+  if (fd < 0) {
+    accept_failed("accepting connection");
+    return;
+  }
+  if (nsessions >= DAEMON_MAX) {
+    notice("too many sessions, turned away a connection");
+    close(fd);
+    return;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  s = session_new();
+  conn_init(&s->peer, fd, &transport_tcp);
+  if (conn_nonblock(&s->peer) < 0 || set_nodelay(fd) < 0) {
+    s->dead = 1;
+    return;
+  }
+  ev_set(fd, EV_READ, s);
+
+  creds = current_tgt(context, ccache);
+  if (auth_con_setup(context, &s->auth_context, &s->peer) < 0) {
+    s->dead = 1;
+    return;
+  }
+  ret = krb5_auth_con_setuseruserkey(context, s->auth_context,
+				     &creds->keyblock);
+  if (ret)
+    fail(ret, "krb5_auth_con_setuseruserkey");
+  sec_krb5_attach(&s->peer, context, s->auth_context);
+
+  /* the ticket is small enough to go out without waiting */
+  if (conn_send_ascii(&s->peer, creds->ticket.data, creds->ticket.length,
+		      local_caps & ~CAP_ROOM) < 0)
+    s->dead = 1;
+}
+
+static void
+peer_join(krb5_context context, ksession *s, kframe *frame) {
+  int i, ret;
+
+  s->peer.caps = frame->caps & local_caps;
+  ret = read_apreq(context, &s->auth_context, frame, &s->principal);
+  if (ret) {
+    notice("turned away a connection: %s", error_message(ret));
+    s->principal = NULL;
+    s->dead = 1;
+    return;
+  }
+  conn_agree(&s->peer);
+  if (s->peer.caps & CAP_FAST)
+    sec_krb5_fast(&s->peer, 0);
+  s->joined = 1;
+
+  for (i = 0; i < nsessions; i++) {
+    if (waiting(sessions[i]) && wanted(sessions[i], s)) {
+      session_claim(s, sessions[i]);
+      return;
+    }
+  }
+  notice("%s is waiting for ktalk -A %s", s->principal, s->principal);
+}
+
+/* open what the peer sent and pass it on, while the front end has room */
+static void
+peer_relay(krb5_context context, ksession *s) {
+  krb5_data msg;
+  kframe frame;
+  int ret = 0;
+
+  while (!s->dead && s->peer.fd >= 0
+	 && (!s->joined || (s->front.fd >= 0
+			    && !conn_full(&s->front, FRONT_ROOM)))
+	 && (ret = conn_frame(&s->peer, &frame)) > 0) {
+    if (!s->joined) {
+      peer_join(context, s, &frame);
+      continue;
+    }
+    ret = open_sealed(&s->peer, &frame, &msg);
+    if (ret) {
+      notice("dropping %s: %s", s->principal, error_message(ret));
+      s->dead = 1;
+      return;
+    }
+    if (frame.type == FRAME_WINDOW)
+      chan_window(&s->peer, &msg);
+    else if (frame.type == FRAME_PING || frame.type == FRAME_PONG) {
+      /* we hold the session, so we answer for it */
+      if (ping_receive(&s->peer, frame.type, &msg) < 0)
+	s->dead = 1;
+    } else if (conn_send(&s->front, frame.type, 0, msg.data, msg.length) < 0)
+      s->dead = 1;
+    done_sealed(&s->peer, &frame, &msg);
+    if (chan_consumed(&s->peer, &frame) < 0)
+      s->dead = 1;
+  }
+  if (ret < 0)
+    s->dead = 1;
+}
+
+/* a front end has said who it is waiting for */
+static void
+front_request(krb5_context context, ksession *f, kframe *frame) {
+  krb5_principal princ;
+  char name[256], port[16];
+  int i;
+
+  if (frame->len == 0 || frame->len >= sizeof(name)) {
+    f->dead = 1;
+    return;
+  }
+  memcpy(name, frame->data, frame->len);
+  name[frame->len] = '\0';
+  if (krb5_parse_name(context, name, &princ)) {
+    f->dead = 1;
+    return;
+  }
+  if (krb5_unparse_name(context, princ, &f->want))
+    f->want = NULL;
+  krb5_free_principal(context, princ);
+  if (!f->want) {
+    f->dead = 1;
+    return;
+  }
+  f->front_caps = frame->caps;
+
+  /* the front end tells them where to connect */
+  snprintf(port, sizeof(port), "%u", (unsigned)sockport);
+  if (conn_send_ascii(&f->front, port, strlen(port), 0) < 0) {
+    f->dead = 1;
+    return;
+  }
+  for (i = 0; i < nsessions; i++) {
+    if (unclaimed(sessions[i]) && wanted(f, sessions[i])) {
+      session_claim(sessions[i], f);
+      session_run(context, sessions[i]);
+      return;
+    }
+  }
+}
+
+/* pass on what the front end sent, sealed, while the peer has room */
+static void
+front_relay(krb5_context context, ksession *s) {
+  kframe frame;
+  int ret = 0;
+
+  s->held = 0;
+  while (!s->dead && s->front.fd >= 0
+	 && (!s->want || (s->joined && !s->closing
+			  && !conn_full(&s->peer, PEER_ROOM)))
+	 && (ret = conn_frame(&s->front, &frame)) > 0) {
+    if (!s->want) {
+      front_request(context, s, &frame);
+      continue;
+    }
+    /* file data waits for the peer's window, and so does what follows */
+    if (frame.type == FRAME_FILE_DATA && !chan_bulk_room(&s->peer)) {
+      conn_unframe(&s->front, &frame);
+      s->held = 1;
+      return;
+    }
+    if (send_sealed(&s->peer, frame.type, frame.data, frame.len) < 0)
+      s->dead = 1;
+  }
+  if (ret < 0)
+    s->dead = 1;
+}
+
+/* what to wait for on each end */
+static void
+session_watch(ksession *s) {
+  int ev;
+
+  if (s->peer.fd >= 0) {
+    if (!s->joined)
+      ev = EV_READ;
+    else if (s->front.fd >= 0)
+      ev = conn_full(&s->front, FRONT_ROOM) ? 0 : EV_READ;
+    else
+      /* unclaimed: only to see them go, until they say something */
+      ev = s->closing || conn_buffered(&s->peer) ? 0 : EV_READ;
+    if (conn_pending(&s->peer))
+      ev |= EV_WRITE;
+    ev_set(s->peer.fd, ev, s);
+  }
+  if (s->front.fd >= 0) {
+    if (s->peer.fd < 0)
+      ev = s->closing ? 0 : EV_READ;
+    else
+      ev = s->held || conn_full(&s->peer, PEER_ROOM) ? 0 : EV_READ;
+    if (conn_pending(&s->front))
+      ev |= EV_WRITE;
+    ev_set(s->front.fd, ev, s);
+  }
+}
+
+/* take whatever either end has buffered as far as it can go */
+static void
+session_run(krb5_context context, ksession *s) {
+  kconn *left;
+
+  peer_relay(context, s);
+  front_relay(context, s);
+  if (s->closing) {
+    left = s->peer.fd >= 0 ? &s->peer : &s->front;
+    if (!conn_pending(left))
+      s->dead = 1;
+  }
+  if (s->dead)
+    return;
+  conn_shrink(&s->peer);
+  conn_shrink(&s->front);
+  session_watch(s);
+}
+
+static void
+session_event(krb5_context context, ksession *s, int fd, int events) {
+  kconn *c = fd == s->peer.fd ? &s->peer : &s->front;
+  int ret, gone = 0;
+
+  if ((events & EV_WRITE) && conn_flush(c) < 0)
+    gone = 1;
+  if (!gone && (events & EV_READ)) {
+    ret = conn_fill(c);
+    if (ret == 0 || (ret < 0 && errno != EINTR && errno != EAGAIN))
+      gone = 1;
+  }
+  /* whatever came before the end is passed on first */
+  session_run(context, s);
+  if (gone && !s->dead) {
+    session_hangup(s, c);
+    if (!s->dead)
+      session_run(context, s);
+  }
+}
+
+static void
+front_accept(int sock) {
+  ksession *f;
+  int fd;
+
+  fd = accept(sock, NULL, NULL);
+  if (fd < 0) {
+    accept_failed("accepting front end");
+    return;
+  }
+  if (nsessions >= DAEMON_MAX) {
+    close(fd);
+    return;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  f = session_new();
+  conn_init(&f->front, fd, &transport_unix);
+  if (conn_nonblock(&f->front) < 0) {
+    f->dead = 1;
+    return;
+  }
+  ev_set(fd, EV_READ, f);
+}
+
+/* drop dead sessions, and peers that have taken too long to authenticate */
+static int
+reap_sessions(krb5_context context) {
+  long long now = now_usec();
+  ksession *s;
+  int i, authing = 0;
+
+  for (i = nsessions - 1; i >= 0; i--) {
+    s = sessions[i];
+    if (!s->dead && !s->joined && s->peer.fd >= 0) {
+      if (now - s->since < DAEMON_AUTH * 1000000LL) {
+	authing++;
+	continue;
+      }
+      debug("a connection did not authenticate in time");
+      s->dead = 1;
+    }
+    if (!s->dead)
+      continue;
+    sessions[i] = sessions[--nsessions];
+    session_free(context, s);
+    starved = 0;
+  }
+  return authing;
+}
+
+/* as many descriptors as we are allowed, two for each session */
+static void
+raise_fd_limit(void) {
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == rl.rlim_max)
+    return;
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+void
+daemon_run(krb5_context context, krb5_ccache ccache, unsigned short port) {
+  kev evs[64];
+  ksession *s;
+  int tcpsock, unixsock, i, n, authing = 0;
+
+  /* threads for every session would be more than they are worth */
+  pool_workers = 0;
+  raise_fd_limit();
+  current_tgt(context, ccache);
+
+  sockport = port;
+  tcpsock = tcp_bind(&sockport, 0);
+  unixsock = unix_listen();
+  set_nonblock(tcpsock);
+  set_nonblock(unixsock);
+  fcntl(tcpsock, F_SETFD, FD_CLOEXEC);
+  fcntl(unixsock, F_SETFD, FD_CLOEXEC);
+  printf("ktalk daemon on port %u; front ends find it at %s\n", sockport,
+	 sockpath);
+  fflush(stdout);
+
+  ev_init();
+  for (;;) {
+    ev_set(tcpsock, nsessions < DAEMON_MAX && !starved ? EV_READ : 0, NULL);
+    ev_set(unixsock, nsessions < DAEMON_MAX && !starved ? EV_READ : 0, NULL);
+
+    n = ev_wait(evs, 64, authing ? 1000 : -1);
+    if (n < 0) {
+      if (errno != EINTR)
+	fail(errno, "waiting for data");
+      n = 0;
+    }
+    for (i = 0; i < n; i++) {
+      s = evs[i].data;
+      if (s) {
+	if (!s->dead)
+	  session_event(context, s, evs[i].fd, evs[i].events);
+      } else if (evs[i].fd == tcpsock) {
+	peer_accept(context, ccache, tcpsock);
+      } else if (evs[i].fd == unixsock) {
+	front_accept(unixsock);
+      }
+    }
+    authing = reap_sessions(context);
+    stat_poll();
+  }
+}
+
+/*
+ * The front end's side: ask the daemon for a session with user, tell user
+ * where to connect, and wait until they have.  conn is then ready for
+ * run_session(), and what the peer offered the daemon is returned.
+ */
+unsigned int
+daemon_attach(kconn *conn, const char *user, const knotifier *nf,
+	      const char *nfarg, char *startupmsg) {
+  struct sockaddr_un sun;
+  struct pollfd pfd;
+  kframe frame;
+  char buf[1024];
+  int fd, ret, port;
+
+  daemon_path(0);
+  unix_address(&sun);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    fail(errno, "creating socket");
+  if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+    if (errno == ENOENT || errno == ECONNREFUSED)
+      bye("no ktalk daemon is running; start one with ktalk -D");
+    fail(errno, "connecting to the daemon");
+  }
+  conn_init(conn, fd, &transport_unix);
+
+  /* the daemon compresses, if it was started with -z */
+  local_caps &= ~CAP_ZLIB;
+  if (conn_send_ascii(conn, user, strlen(user), local_caps) < 0)
+    fail(errno, "asking the daemon for a session");
+  ret = conn_readframe(conn, &frame);
+  if (ret <= 0 || frame.len >= 16)
+    bye("the daemon went away");
+  memcpy(buf, frame.data, frame.len);
+  buf[frame.len] = '\0';
+  port = atoi(buf);
+
+  notify_start(nf, (char **)&user, 1, port, nfarg);
+  printf("waiting for connection on port %i .... \n", port);
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  for (;;) {
+    ret = poll(&pfd, 1, notify_pending() ? 200 : -1);
+    if (ret < 0 && errno != EINTR)
+      fail(errno, "waiting for connection");
+    if (notify_finished() > 0)
+      printf("could not tell %s where to connect; they can use: %s\n", user,
+	     notify_command());
+    if (ret > 0)
+      break;
+  }
+
+  /* who they are, and what they offered the daemon */
+  ret = conn_readframe(conn, &frame);
+  if (ret <= 0 || frame.len >= sizeof(buf)
+      || !memchr(frame.data, '\0', frame.len))
+    bye("the daemon went away");
+  memcpy(buf, frame.data, frame.len);
+  buf[frame.len] = '\0';
+  conn->caps = frame.caps;
+  strcat(startupmsg, "Foreign party authenticates as ");
+  strncat(startupmsg, buf, 256);
+  strcat(startupmsg, "\n\n");
+
+  sec_local_attach(conn);
+  conn_agree(conn);
+  return caps_parse(buf + strlen(buf) + 1);
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
@@ -0,0 +1,537 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+ * Datagrams (-u).  On a link that drops packets, one lost TCP segment
+ * holds up every line after it until it has been sent again.  When both
+ * ends ask for "dgram", chat lines go as UDP datagrams where they can, and
+ * everything else stays on the TCP connection, which is still the session.
+ *
+ * After the handshake each end binds a UDP socket beside its TCP one and
+ * sends its port in a DGRAM_PORT frame.  Both then send HELLOs until one
+ * is answered; until then, and if none ever is, lines go over TCP as they
+ * always have.  A datagram is
+ *
+ *   | type (1) | sequence (8) | krb5 header | data | padding | krb5 trailer |
+ *
+ * sealed under the fast path keys, type and sequence number included; see
+ * fast.c.  Sequence numbers only go up.  Rather than wanting them in order,
+ * the receiver remembers which of the last DGRAM_HISTORY it has taken, so
+ * each line is shown once, as soon as it comes, and replays are dropped.
+ *
+ * Every HELLO and LINE is answered with an ACK naming it, along with the
+ * highest sequence number taken and a bitmap of the DGRAM_WINDOW below it,
+ * so one ACK that gets through covers the ones that did not.  Each line
+ * is sent again on its own timer, backing off from twice the round trip,
+ * until it is acknowledged.  After DGRAM_TRIES it goes over TCP instead,
+ * still sealed as a datagram, so the receiver takes it only once.  With
+ * nothing acknowledged for DGRAM_DEAD, every line goes over TCP, and now
+ * and then a HELLO goes to see if UDP has come back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "ktalk.h"
+
+#define DGRAM_LINEMAX	1200	/* longer lines go over TCP */
+#define DGRAM_BUFSIZE	1400	/* the most a sealed line comes to */
+#define DGRAM_WINDOW	64	/* lines in flight, and what an ACK spans */
+#define DGRAM_HISTORY	1024	/* sequence numbers the receiver remembers */
+#define DGRAM_TRIES	5	/* sends of a line before it goes over TCP */
+#define DGRAM_RTO_INIT	250	/* ms, before there is a round trip time */
+#define DGRAM_RTO_MIN	40
+#define DGRAM_RTO_MAX	1000
+#define DGRAM_DEAD	3000	/* ms with nothing acknowledged */
+#define DGRAM_PROBE	250	/* ms between HELLOs, before any answer */
+#define DGRAM_REPROBE	5000	/* and after giving up on UDP */
+
+#define DG_HELLO	1
+#define DG_LINE		2
+#define DG_ACK		3
+
+#define DG_OFF		0	/* not agreed, or no socket */
+#define DG_WAITING	1	/* for the other party's port */
+#define DG_PROBING	2	/* no HELLO answered yet */
+#define DG_UP		3
+#define DG_DOWN		4	/* gave up; lines go over TCP */
+
+typedef struct kdgram {
+  long long seq;
+  long long first, sent;	/* when first and last sent */
+  int tries;
+  size_t len;
+  char buf[DGRAM_BUFSIZE];
+} kdgram;
+
+static int state = DG_OFF;
+static int sock = -1;
+static krb5_context context;
+static kfast *fast;
+
+static long long sendseq = 0;	/* the last one used */
+static kdgram out[DGRAM_WINDOW];	/* lines not acknowledged, oldest first */
+static int nout = 0;
+static long long hello_seq = 0, hello_sent = 0;
+static long long since;		/* the last ACK, or the start of probing */
+static long long srtt = -1;
+
+static long long rhigh = 0;	/* the highest sequence number taken */
+static unsigned char seen[DGRAM_HISTORY / 8];
+
+static void
+set_port(struct sockaddr_storage *addr, unsigned short port) {
+  if (addr->ss_family == AF_INET6)
+    ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+  else
+    ((struct sockaddr_in *)addr)->sin_port = htons(port);
+}
+
+static unsigned short
+get_port(struct sockaddr_storage *addr) {
+  if (addr->ss_family == AF_INET6)
+    return ntohs(((struct sockaddr_in6 *)addr)->sin6_port);
+  return ntohs(((struct sockaddr_in *)addr)->sin_port);
+}
+
+static int
+was_seen(long long seq) {
+  int i = seq % DGRAM_HISTORY;
+
+  return seen[i / 8] >> (i % 8) & 1;
+}
+
+static void
+mark(long long seq, int on) {
+  int i = seq % DGRAM_HISTORY;
+
+  if (on)
+    seen[i / 8] |= 1 << (i % 8);
+  else
+    seen[i / 8] &= ~(1 << (i % 8));
+}
+
+/*
+ * Take seq if it is new: 1 if it was, 0 if it has been taken already,
+ * and -1 if it is too old to say.
+ */
+static int
+take_seq(long long seq) {
+  long long s;
+
+  if (seq <= 0)
+    return 0;
+  if (seq > rhigh) {
+    if (seq - rhigh >= DGRAM_HISTORY)
+      memset(seen, 0, sizeof(seen));
+    else
+      for (s = rhigh + 1; s < seq; s++)
+	mark(s, 0);
+    rhigh = seq;
+    mark(seq, 1);
+    return 1;
+  }
+  if (rhigh - seq >= DGRAM_HISTORY)
+    return -1;
+  if (was_seen(seq))
+    return 0;
+  mark(seq, 1);
+  return 1;
+}
+
+/* microseconds to wait for an ACK before a datagram's next try */
+static long long
+rto(int tries) {
+  long long ms = srtt < 0 ? DGRAM_RTO_INIT : 2 * srtt / 1000;
+
+  if (ms < DGRAM_RTO_MIN)
+    ms = DGRAM_RTO_MIN;
+  if (ms > DGRAM_RTO_MAX)
+    ms = DGRAM_RTO_MAX;
+  return (ms * 1000) << (tries - 1);
+}
+
+static void
+put_out(const char *buf, size_t len) {
+  ssize_t n;
+
+  do
+    n = send(sock, buf, len, 0);
+  while (n < 0 && errno == EINTR);
+  /* a lost datagram is nothing new; the timers see to it */
+  if (n < 0)
+    debug("sending datagram: %s", strerror(errno));
+  else
+    stat_add(ST_WRITE, n);
+}
+
+static void
+send_hello(void) {
+  char buf[DGRAM_BUFSIZE];
+  size_t n;
+
+  hello_seq = ++sendseq;
+  hello_sent = now_usec();
+  n = fast_dgram_seal(context, fast, DG_HELLO, hello_seq, "", 0, buf,
+		      sizeof(buf));
+  put_out(buf, n);
+}
+
+/* acknowledge seq, and whatever else has come in lately */
+static void
+send_ack(long long seq) {
+  unsigned char body[24];
+  unsigned long long bits = 0;
+  char buf[DGRAM_BUFSIZE];
+  size_t n;
+  int i;
+
+  for (i = 0; i < DGRAM_WINDOW && i < rhigh; i++)
+    if (was_seen(rhigh - i))
+      bits |= 1ULL << i;
+  put64(body, seq);
+  put64(body + 8, rhigh);
+  put64(body + 16, bits);
+  /* an ACK tells nothing that is not so, so it needs no number of its own */
+  n = fast_dgram_seal(context, fast, DG_ACK, 0, (char *)body, sizeof(body),
+		      buf, sizeof(buf));
+  put_out(buf, n);
+}
+
+/* send out[i] over TCP instead, and forget it; -1 if it must wait */
+static int
+to_tcp(kconn *c, int i) {
+  if (send_sealed(c, FRAME_DGRAM, out[i].buf, out[i].len) < 0) {
+    if (errno != ENOBUFS)
+      fail(errno, "sending to party");
+    return -1;
+  }
+  debug("line %lld goes over TCP", out[i].seq);
+  nout--;
+  memmove(&out[i], &out[i + 1], (nout - i) * sizeof(out[0]));
+  return 0;
+}
+
+/* everything in flight goes over TCP, and so does what comes after */
+static void
+give_up(kconn *c, const char *why) {
+  while (nout && to_tcp(c, 0) == 0)
+    ;
+  state = DG_DOWN;
+  notice("%s", why);
+}
+
+static void
+sample(long long rtt) {
+  srtt = srtt < 0 ? rtt : (7 * srtt + rtt) / 8;
+}
+
+static void
+take_ack(krb5_data *msg) {
+  unsigned char *p = (unsigned char *)msg->data;
+  unsigned long long bits;
+  long long seq, high, now;
+  int i, j;
+
+  if (msg->length < 24)
+    return;
+  seq = get64(p);
+  high = get64(p + 8);
+  bits = get64(p + 16);
+  now = now_usec();
+
+  if (hello_seq && seq == hello_seq) {
+    sample(now - hello_sent);
+    hello_seq = 0;
+  }
+  for (i = j = 0; i < nout; i++) {
+    if (out[i].seq == seq || (out[i].seq <= high
+			      && high - out[i].seq < DGRAM_WINDOW
+			      && (bits >> (high - out[i].seq) & 1))) {
+      /* a line sent more than once cannot say which send this answers */
+      if (out[i].seq == seq && out[i].tries == 1)
+	sample(now - out[i].sent);
+      stat_time(ST_LINE_ACK, out[i].first);
+      continue;
+    }
+    if (i != j)
+      out[j] = out[i];
+    j++;
+  }
+  nout = j;
+  since = now;
+
+  if (state == DG_DOWN)
+    notice("UDP is getting through again, so chat lines go by it");
+  else if (state == DG_PROBING)
+    debug("UDP is getting through, round trip %lld us", srtt);
+  state = DG_UP;
+}
+
+/* a datagram, off the UDP socket or carried over TCP */
+static void
+take(char *buf, size_t len, int carried) {
+  krb5_error_code ret;
+  krb5_data msg;
+  long long seq;
+  int type, fresh;
+
+  ret = fast_dgram_open(context, fast, buf, len, &type, &seq, &msg);
+  if (ret) {
+    debug("dropping datagram: %s", error_message(ret));
+    return;
+  }
+  switch (type) {
+  case DG_ACK:
+    if (!carried)
+      take_ack(&msg);
+    break;
+  case DG_HELLO:
+  case DG_LINE:
+    fresh = take_seq(seq);
+    /* only TCP can have kept one back long enough to be too old to say */
+    if (type == DG_LINE && (fresh > 0 || (fresh < 0 && carried)))
+      receive_line(&msg);
+    if (!carried)
+      send_ack(seq);
+    break;
+  default:
+    debug("ignoring datagram of unknown type %d", type);
+  }
+}
+
+/* once the handshake is done: make a socket and tell the other party */
+void
+dgram_start(kconn *c) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  unsigned char port[2] = { 0, 0 };
+
+  if (!(c->caps & CAP_DGRAM) || !(fast = sec_krb5_kfast(c, &context)))
+    return;
+  if (getsockname(c->fd, (struct sockaddr *)&addr, &len) < 0
+      || (sock = socket(addr.ss_family, SOCK_DGRAM, 0)) < 0)
+    goto failed;
+  set_port(&addr, 0);
+  if (bind(sock, (struct sockaddr *)&addr, len) < 0
+      || getsockname(sock, (struct sockaddr *)&addr, &len) < 0
+      || set_nonblock(sock) < 0)
+    goto failed;
+  port[0] = get_port(&addr) >> 8;
+  port[1] = get_port(&addr) & 0xff;
+  state = DG_WAITING;
+  debug("datagrams on port %d", get_port(&addr));
+  goto tell;
+
+ failed:
+  notice("no UDP socket (%s), so chat stays on TCP", strerror(errno));
+  if (sock >= 0)
+    close(sock);
+  sock = -1;
+ tell:
+  /* port 0 says there will be no datagrams from here */
+  if (send_sealed(c, FRAME_DGRAM_PORT, (char *)port, sizeof(port)) < 0)
+    fail(errno, "sending to party");
+}
+
+/* the socket to wait on, or -1 */
+int
+dgram_fd(void) {
+  return sock;
+}
+
+/* lines sent as datagrams and not yet acknowledged */
+int
+dgram_pending(void) {
+  return nout;
+}
+
+/* the other party's port has come */
+void
+dgram_port(kconn *c, krb5_data *msg) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  unsigned short port;
+
+  if (state != DG_WAITING || msg->length < 2)
+    return;
+  port = (unsigned char)msg->data[0] << 8 | (unsigned char)msg->data[1];
+  if (!port) {
+    debug("the other party has no UDP socket");
+    state = DG_OFF;
+    return;
+  }
+  if (getpeername(c->fd, (struct sockaddr *)&addr, &len) < 0)
+    fail(errno, "getpeername");
+  set_port(&addr, port);
+  /* connected, so only the other party is heard and refusals come back */
+  if (connect(sock, (struct sockaddr *)&addr, len) < 0) {
+    notice("no UDP to the other party (%s), so chat stays on TCP",
+	   strerror(errno));
+    state = DG_OFF;
+    return;
+  }
+  state = DG_PROBING;
+  since = now_usec();
+  send_hello();
+}
+
+/*
+ * Send a line as a datagram if UDP is working.  Returns 1 if it went, or
+ * 0 if it is to go over TCP.
+ */
+int
+dgram_send_line(kconn *c, const char *data, size_t len) {
+  kdgram *d;
+
+  if (state != DG_UP || len > DGRAM_LINEMAX)
+    return 0;
+  /* keep what is in flight within what an ACK and the receiver can span */
+  while (nout && sendseq + 1 - out[0].seq >= DGRAM_WINDOW)
+    if (to_tcp(c, 0) < 0)
+      return 0;
+  if (nout == DGRAM_WINDOW)
+    return 0;
+
+  d = &out[nout];
+  d->len = fast_dgram_seal(context, fast, DG_LINE, sendseq + 1, data, len,
+			   d->buf, sizeof(d->buf));
+  if (!d->len)
+    return 0;
+  d->seq = ++sendseq;
+  d->first = d->sent = now_usec();
+  d->tries = 1;
+  nout++;
+  put_out(d->buf, d->len);
+  return 1;
+}
+
+/* the socket is readable */
+void
+dgram_receive(kconn *c) {
+  char buf[DGRAM_BUFSIZE + 1];
+  ssize_t n;
+
+  for (;;) {
+    n = recv(sock, buf, sizeof(buf), 0);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      /* a refusal is the other end's port being shut; the timers see */
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+	debug("receiving datagram: %s", strerror(errno));
+      return;
+    }
+    stat_add(ST_READ, n);
+    take(buf, n, 0);
+  }
+}
+
+/* a line that came over TCP after all */
+void
+dgram_carried(kconn *c, krb5_data *msg) {
+  if (fast)
+    take(msg->data, msg->length, 1);
+}
+
+/* milliseconds until dgram_tick() has something to do, or -1 */
+int
+dgram_timeout(void) {
+  long long next = -1, t, left;
+  int i;
+
+  for (i = 0; i < nout; i++) {
+    t = out[i].sent + rto(out[i].tries);
+    if (next < 0 || t < next)
+      next = t;
+  }
+  if (state == DG_PROBING) {
+    t = hello_sent + DGRAM_PROBE * 1000LL;
+    if (next < 0 || t < next)
+      next = t;
+  } else if (state == DG_DOWN) {
+    t = hello_sent + DGRAM_REPROBE * 1000LL;
+    if (next < 0 || t < next)
+      next = t;
+  }
+  if (next < 0)
+    return -1;
+  left = next - now_usec();
+  return left > 0 ? (int)((left + 999) / 1000) : 0;
+}
+
+/* send again what is due, and see whether UDP is still getting through */
+void
+dgram_tick(kconn *c) {
+  long long now;
+  int i;
+
+  if (state < DG_PROBING)
+    return;
+  now = now_usec();
+  for (i = 0; i < nout;) {
+    if (now < out[i].sent + rto(out[i].tries)) {
+      i++;
+    } else if (out[i].tries >= DGRAM_TRIES) {
+      /* nothing at all acknowledged since it first went is no bad luck */
+      if (since < out[i].first) {
+	give_up(c, "UDP has stopped getting through, so chat is back on TCP");
+	return;
+      }
+      if (to_tcp(c, i) < 0)
+	break;
+    } else {
+      out[i].tries++;
+      out[i].sent = now;
+      put_out(out[i].buf, out[i].len);
+      i++;
+    }
+  }
+
+  switch (state) {
+  case DG_PROBING:
+    if (now - since >= DGRAM_DEAD * 1000LL)
+      give_up(c, "UDP is not getting through, so chat stays on TCP");
+    else if (now - hello_sent >= DGRAM_PROBE * 1000LL)
+      send_hello();
+    break;
+  case DG_UP:
+    if (nout && now - since >= DGRAM_DEAD * 1000LL
+	&& now - out[0].first >= DGRAM_DEAD * 1000LL)
+      give_up(c, "UDP has stopped getting through, so chat is back on TCP");
+    break;
+  case DG_DOWN:
+    if (now - hello_sent >= DGRAM_REPROBE * 1000LL)
+      send_hello();
+    break;
+  }
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
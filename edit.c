@@ -0,0 +1,344 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+ * The message being typed, in the send window.  It is kept in a gap
+ * buffer, so typing and rubbing out at the cursor cost the same however
+ * long the message is, and it can be as long and have as many lines as
+ * you like.
+ *
+ * What has been sent stays above it in the window, as it always has.  The
+ * message starts on row orow; if it outgrows the window the old lines
+ * scroll away, and then the message itself scrolls, starting at offset
+ * top.  Each change notes the first offset it touched, and ed_draw()
+ * repaints from the row holding that offset down, so the work for a key
+ * is bounded by the size of the window, not of the message.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ktalk.h"
+
+#define NO_DAMAGE	((size_t)-1)
+
+static char *gb = NULL;
+static size_t gbsize = 0, gap_start = 0, gap_end = 0;
+
+static int orow = 0;		/* window row the message starts on */
+static int cur_y = 0;		/* window row of the cursor, as last drawn */
+static size_t top = 0;		/* first offset shown, once orow is 0 */
+static size_t damage = 0;	/* first offset that needs drawing again */
+static int full = 1;		/* or everything */
+
+#define GAPLEN		(gap_end - gap_start)
+#define LEN		(gbsize - GAPLEN)
+#define AT(i)		((i) < gap_start ? gb[i] : gb[(i) + GAPLEN])
+
+static void
+touch(size_t off) {
+  if (off < damage)
+    damage = off;
+}
+
+static void
+grow(size_t need) {
+  size_t want, after = gbsize - gap_end;
+
+  want = gbsize ? gbsize : 256;
+  while (want - LEN < need)
+    want *= 2;
+  gb = realloc(gb, want);
+  if (!gb)
+    fail(errno, "allocating message buffer");
+  memmove(gb + want - after, gb + gap_end, after);
+  gap_end = want - after;
+  gbsize = want;
+}
+
+size_t
+ed_len(void) {
+  return LEN;
+}
+
+size_t
+ed_cursor(void) {
+  return gap_start;
+}
+
+/* put the cursor at pos, carrying text across the gap */
+void
+ed_move(size_t pos) {
+  size_t k;
+
+  if (pos > LEN)
+    pos = LEN;
+  if (pos < gap_start) {
+    k = gap_start - pos;
+    memmove(gb + gap_end - k, gb + pos, k);
+    gap_start -= k;
+    gap_end -= k;
+  } else if (pos > gap_start) {
+    k = pos - gap_start;
+    memmove(gb + gap_start, gb + gap_end, k);
+    gap_start += k;
+    gap_end += k;
+  }
+}
+
+void
+ed_insert(int c) {
+  if (!GAPLEN)
+    grow(1);
+  touch(gap_start);
+  gb[gap_start++] = c;
+}
+
+/* rub out the character before the cursor; 0 if there was none */
+int
+ed_backspace(void) {
+  if (!gap_start)
+    return 0;
+  gap_start--;
+  touch(gap_start);
+  return 1;
+}
+
+/* delete the character under the cursor */
+void
+ed_delete(void) {
+  if (gap_end == gbsize)
+    return;
+  gap_end++;
+  touch(gap_start);
+}
+
+/* rub out the word before the cursor; returns how many characters went */
+int
+ed_kill_word(void) {
+  int n = 0;
+
+  while (gap_start && gb[gap_start - 1] == ' ')
+    n += ed_backspace();
+  while (gap_start && gb[gap_start - 1] != ' ' && gb[gap_start - 1] != '\n')
+    n += ed_backspace();
+  return n;
+}
+
+/* from the cursor to the end of its line */
+void
+ed_kill_line(void) {
+  if (gap_end < gbsize && gb[gap_end] == '\n') {
+    ed_delete();
+    return;
+  }
+  while (gap_end < gbsize && gb[gap_end] != '\n')
+    ed_delete();
+}
+
+void
+ed_clear(void) {
+  gap_start = 0;
+  gap_end = gbsize;
+  top = 0;
+  touch(0);
+}
+
+/* the start of the line holding pos, or the end of it */
+size_t
+ed_line_start(size_t pos) {
+  while (pos > 0 && AT(pos - 1) != '\n')
+    pos--;
+  return pos;
+}
+
+size_t
+ed_line_end(size_t pos) {
+  while (pos < LEN && AT(pos) != '\n')
+    pos++;
+  return pos;
+}
+
+/*
+ * Where the screen row starting at s ends: the characters to draw are s
+ * up to *end, and the next row starts at the return value, which is past
+ * the end of the text for the last row.
+ */
+static size_t
+next_row(size_t s, size_t *end) {
+  size_t k, width = getmaxx(sendwin);
+
+  for (k = 0; k < width; k++) {
+    if (s + k == LEN) {
+      *end = LEN;
+      return LEN + 1;
+    }
+    if (AT(s + k) == '\n') {
+      *end = s + k;
+      return s + k + 1;
+    }
+  }
+  *end = s + width;
+  return s + width;
+}
+
+/* the start of the screen row holding pos */
+static size_t
+row_start(size_t pos) {
+  size_t s, nx, end;
+
+  s = ed_line_start(pos);
+  while ((nx = next_row(s, &end)) <= pos)
+    s = nx;
+  return s;
+}
+
+/* move up or down a screen row, keeping the column where there is one */
+void
+ed_updown(int dir) {
+  size_t s, nx, end, col;
+
+  s = row_start(gap_start);
+  col = gap_start - s;
+  if (dir < 0) {
+    if (s == 0)
+      return;
+    s = row_start(s - 1);
+  } else {
+    nx = next_row(s, &end);
+    if (nx > LEN)
+      return;
+    s = nx;
+  }
+  next_row(s, &end);
+  ed_move(s + col < end ? s + col : end);
+}
+
+/* the screen has been cleared under us; start over at the top */
+void
+ed_reset(void) {
+  orow = 0;
+  full = 1;
+}
+
+/* bring the send window up to date with the message */
+void
+ed_draw(void) {
+  int h, row, crow = 0, ccol = 0, redraw, k, n;
+  size_t s, nx, end, c = gap_start, i;
+
+  h = getmaxy(sendwin);
+  if (orow >= h)
+    orow = h - 1;
+
+  /* keep the cursor on the screen, scrolling what was sent first */
+  if (c < top) {
+    top = row_start(c);
+    full = 1;
+  }
+  for (s = top, row = orow; (nx = next_row(s, &end)) <= c; row++)
+    s = nx;
+  if (row >= h) {
+    k = row - h + 1;
+    full = 1;
+    n = k < orow ? k : orow;
+    if (n) {
+      scrollok(sendwin, TRUE);
+      wscrl(sendwin, n);
+      orow -= n;
+      k -= n;
+    }
+    while (k-- > 0)
+      top = next_row(top, &end);
+  }
+
+  /* the bottom right corner must not scroll the window */
+  scrollok(sendwin, FALSE);
+  redraw = full;
+  for (s = top, row = orow; row < h; row++) {
+    nx = next_row(s, &end);
+    if (!redraw && damage < nx)
+      redraw = 1;
+    if (redraw) {
+      wmove(sendwin, row, 0);
+      for (i = s; i < end; i++)
+	waddch(sendwin, (unsigned char)AT(i));
+      if (end - s < (size_t)getmaxx(sendwin))
+	wclrtoeol(sendwin);
+    }
+    if (s <= c && c < nx) {
+      crow = row;
+      ccol = c - s;
+    }
+    if (nx > LEN)
+      break;
+    s = nx;
+  }
+  if (redraw && row + 1 < h) {
+    wmove(sendwin, row + 1, 0);
+    wclrtobot(sendwin);
+  }
+
+  scrollok(sendwin, TRUE);
+  cur_y = crow;
+  wmove(sendwin, crow, ccol);
+  wnoutrefresh(sendwin);
+  damage = NO_DAMAGE;
+  full = 0;
+}
+
+/* the whole message, in one piece, until the buffer changes again */
+char *
+ed_text(size_t *len) {
+  ed_move(LEN);
+  *len = LEN;
+  return gb;
+}
+
+/*
+ * The message has gone: leave it on the screen, with the next one
+ * starting on the row below it.
+ */
+void
+ed_commit(void) {
+  ed_move(LEN);
+  if (!LEN || gb[LEN - 1] != '\n')
+    ed_insert('\n');
+  ed_draw();
+  orow = cur_y;
+  gap_start = 0;
+  gap_end = gbsize;
+  top = 0;
+  damage = NO_DAMAGE;
+  /* a big paste need not hold on to its memory */
+  if (gbsize > 65536) {
+    free(gb);
+    gb = NULL;
+    gbsize = gap_start = gap_end = 0;
+  }
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
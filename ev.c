@@ -0,0 +1,275 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+ * The event loop's view of the descriptors it waits on.  This is epoll
+ * where we have it and poll() elsewhere; callers just say which of
+ * EV_READ and EV_WRITE they want for each fd, and an event set of 0 stops
+ * watching it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netinet/tcp.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#include "ktalk.h"
+
+static int *wanted = NULL;	/* events each fd is registered for */
+static void **evdata = NULL;
+static int nslots = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+static int epfd = -1;
+static int nalways = 0;		/* plain files, which epoll will not take */
+static char *always = NULL;
+#else
+static struct pollfd *pfds = NULL;
+static int npfds = 0;
+#endif
+
+void
+ev_init(void) {
+#ifdef HAVE_SYS_EPOLL_H
+  epfd = epoll_create(16);
+  if (epfd < 0)
+    fail(errno, "epoll_create");
+  fcntl(epfd, F_SETFD, FD_CLOEXEC);
+#endif
+}
+
+static void
+ev_grow(int fd) {
+  int n = nslots ? nslots : 16;
+
+  while (n <= fd)
+    n *= 2;
+  wanted = realloc(wanted, n * sizeof(*wanted));
+  evdata = realloc(evdata, n * sizeof(*evdata));
+  if (!wanted || !evdata)
+    fail(errno, "allocating event table");
+  memset(wanted + nslots, 0, (n - nslots) * sizeof(*wanted));
+  memset(evdata + nslots, 0, (n - nslots) * sizeof(*evdata));
+#ifdef HAVE_SYS_EPOLL_H
+  always = realloc(always, n);
+  if (!always)
+    fail(errno, "allocating event table");
+  memset(always + nslots, 0, n - nslots);
+#endif
+  nslots = n;
+}
+
+void
+ev_set(int fd, int events, void *data) {
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ee;
+  int op;
+#else
+  int i;
+#endif
+
+  if (fd >= nslots)
+    ev_grow(fd);
+  evdata[fd] = data;
+  if (wanted[fd] == events)
+    return;
+
+#ifdef HAVE_SYS_EPOLL_H
+  memset(&ee, 0, sizeof(ee));
+  ee.data.fd = fd;
+  if (events & EV_READ)
+    ee.events |= EPOLLIN;
+  if (events & EV_WRITE)
+    ee.events |= EPOLLOUT;
+  if (!events)
+    op = EPOLL_CTL_DEL;
+  else if (!wanted[fd])
+    op = EPOLL_CTL_ADD;
+  else
+    op = EPOLL_CTL_MOD;
+  if (always[fd]) {
+    /* a plain file is always ready */
+    if (!events) {
+      always[fd] = 0;
+      nalways--;
+    }
+  } else if (epoll_ctl(epfd, op, fd, &ee) < 0) {
+    if (op == EPOLL_CTL_ADD && errno == EPERM) {
+      always[fd] = 1;
+      nalways++;
+    } else if (op != EPOLL_CTL_DEL) {
+      fail(errno, "epoll_ctl");
+    }
+  }
+#else
+  for (i = 0; i < npfds && pfds[i].fd != fd; i++)
+    ;
+  if (!events) {
+    if (i < npfds)
+      pfds[i] = pfds[--npfds];
+  } else {
+    if (i == npfds) {
+      pfds = realloc(pfds, (npfds + 1) * sizeof(*pfds));
+      if (!pfds)
+	fail(errno, "allocating event table");
+      pfds[npfds++].fd = fd;
+    }
+    pfds[i].events = 0;
+    if (events & EV_READ)
+      pfds[i].events |= POLLIN;
+    if (events & EV_WRITE)
+      pfds[i].events |= POLLOUT;
+  }
+#endif
+  wanted[fd] = events;
+}
+
+/*
+ * Wait up to timeout milliseconds (forever if negative) for something to
+ * happen.  Errors and hangups are reported as whatever the fd was waiting
+ * for, so the read or write that follows finds out what went wrong.
+ */
+int
+ev_wait(kev *evs, int maxevs, int timeout) {
+  int i, n, got, fd;
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ees[64];
+
+  if (maxevs > 64)
+    maxevs = 64;
+  n = epoll_wait(epfd, ees, maxevs > nalways ? maxevs - nalways : 1,
+		 nalways ? 0 : timeout);
+  TRACE(TR_WAIT, n, timeout, 0);
+  if (n < 0)
+    return n;
+  for (i = 0; i < n; i++) {
+    fd = ees[i].data.fd;
+    got = 0;
+    if (ees[i].events & EPOLLIN)
+      got |= EV_READ;
+    if (ees[i].events & EPOLLOUT)
+      got |= EV_WRITE;
+    if (ees[i].events & (EPOLLERR | EPOLLHUP))
+      got |= wanted[fd];
+    evs[i].fd = fd;
+    evs[i].events = got & wanted[fd];
+    evs[i].data = evdata[fd];
+  }
+  for (fd = 0; nalways && fd < nslots && n < maxevs; fd++) {
+    if (always[fd]) {
+      evs[n].fd = fd;
+      evs[n].events = wanted[fd];
+      evs[n].data = evdata[fd];
+      n++;
+    }
+  }
+  return n;
+#else
+  n = poll(pfds, npfds, timeout);
+  TRACE(TR_WAIT, n, timeout, 0);
+  if (n <= 0)
+    return n;
+  for (i = 0, n = 0; i < npfds && n < maxevs; i++) {
+    if (!pfds[i].revents)
+      continue;
+    fd = pfds[i].fd;
+    got = 0;
+    if (pfds[i].revents & POLLIN)
+      got |= EV_READ;
+    if (pfds[i].revents & POLLOUT)
+      got |= EV_WRITE;
+    if (pfds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+      got |= wanted[fd];
+    evs[n].fd = fd;
+    evs[n].events = got & wanted[fd];
+    evs[n].data = evdata[fd];
+    n++;
+  }
+  return n;
+#endif
+}
+
+int
+set_nonblock(int fd) {
+  int flags;
+
+  flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0)
+    return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* we gather keystrokes ourselves, so Nagle would only add delay */
+int
+set_nodelay(int fd) {
+  int on = 1;
+
+  return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+/*
+ * Have the socket poll writable only while fewer than bytes of what it
+ * holds are still unsent, so what we have not handed it yet can still be
+ * put in a better order.  Where there is no such option there is just
+ * the socket buffer.
+ */
+int
+set_lowat(int fd, int bytes) {
+#ifdef TCP_NOTSENT_LOWAT
+  return setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes,
+		    sizeof(bytes));
+#else
+  return 0;
+#endif
+}
+
+/* the shorter of two ev_wait() timeouts, where -1 is forever */
+int
+ev_sooner(int a, int b) {
+  if (a < 0)
+    return b;
+  if (b < 0)
+    return a;
+  return a < b ? a : b;
+}
+
+/* microseconds on a clock that never steps, for timers and latency */
+long long
+now_usec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
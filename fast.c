@@ -0,0 +1,341 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+ * The session fast path.  When both ends offer "fast", frames are sealed
+ * with krb5_k_encrypt_iov under a key for each direction, derived from
+ * the subkey in the client's authenticator, rather than with krb5_mk_priv.
+ * The client makes a new subkey for every session, so even when the user
+ * to user ticket comes from the cache, no two sessions have the same keys
+ * and a frame recorded from one will not open in another.  Sealing is done
+ * in place in one buffer that is kept around, and opening in place in the
+ * read buffer, so there is nothing to allocate, free or ASN.1 encode per
+ * frame.
+ *
+ * A fast frame has FRAME_F_FAST in its header flags, and its body is
+ *
+ *   | sequence (8) | krb5 header | data | padding | krb5 trailer |
+ *
+ * with the frame type and sequence number under the checksum too.  Each
+ * direction of each channel counts from 0, with the channel in the top
+ * byte of the sequence number, and frames on a channel must arrive in
+ * order.  Since every frame carries its whole sequence number, bulk
+ * frames can be sealed and opened on other threads; see pool.c.
+ *
+ * Datagrams (see dgram.c) are sealed the same way under the same keys, but
+ * with a key usage of their own, so neither can pass for the other.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ktalk.h"
+
+#define FAST_SEQLEN	8
+
+struct kfast {
+  krb5_key sendkey, recvkey;
+  krb5_keyblock *sendkb, *recvkb;	/* for keys of the pool's own */
+  krb5_enctype enctype;
+  unsigned int hdrlen, trllen;
+  long long sendseq[CHAN_COUNT], recvseq[CHAN_COUNT];
+  char *sealbuf;		/* reused for every frame sent */
+  size_t sealbufsize;
+};
+
+static krb5_keyblock *
+derive_key(krb5_context context, krb5_keyblock *session, const char *dir) {
+  krb5_keyblock *kb;
+  int ret;
+
+  ret = krb5_c_fx_cf2_simple(context, session, "ktalk fast", session, dir,
+			     &kb);
+  if (ret)
+    fail(ret, "krb5_c_fx_cf2_simple");
+  return kb;
+}
+
+/* a key object for one direction, for use with context alone */
+krb5_key
+fast_key(krb5_context context, kfast *f, int send) {
+  krb5_key key;
+  int ret;
+
+  ret = krb5_k_create_key(context, send ? f->sendkb : f->recvkb, &key);
+  if (ret)
+    fail(ret, "krb5_k_create_key");
+  return key;
+}
+
+/*
+ * Set up the fast path; initiator is the side that sent the AP-REQ.
+ * NULL if it came without a subkey, as only the ticket's key would be
+ * left, and that is the same every session.
+ */
+kfast *
+fast_start(krb5_context context, krb5_auth_context auth_context,
+	   int initiator) {
+  krb5_keyblock *session = NULL;
+  kfast *f;
+  int ret;
+
+  if (initiator)
+    ret = krb5_auth_con_getsendsubkey(context, auth_context, &session);
+  else
+    ret = krb5_auth_con_getrecvsubkey(context, auth_context, &session);
+  if (ret)
+    fail(ret, "getting the session subkey");
+  if (!session)
+    return NULL;
+  f = calloc(1, sizeof(*f));
+  if (!f)
+    fail(errno, "allocating fast path");
+  f->enctype = session->enctype;
+  ret = krb5_c_crypto_length(context, f->enctype, KRB5_CRYPTO_TYPE_HEADER,
+			     &f->hdrlen);
+  if (!ret)
+    ret = krb5_c_crypto_length(context, f->enctype,
+			       KRB5_CRYPTO_TYPE_TRAILER, &f->trllen);
+  if (ret)
+    fail(ret, "krb5_c_crypto_length");
+
+  f->sendkb = derive_key(context, session,
+			 initiator ? "client to server" : "server to client");
+  f->recvkb = derive_key(context, session,
+			 initiator ? "server to client" : "client to server");
+  f->sendkey = fast_key(context, f, 1);
+  f->recvkey = fast_key(context, f, 0);
+  krb5_free_keyblock(context, session);
+  debug("fast path on, enctype %d, %u+%u bytes of overhead", f->enctype,
+	f->hdrlen, f->trllen);
+  return f;
+}
+
+void
+fast_free(krb5_context context, kfast *f) {
+  krb5_k_free_key(context, f->sendkey);
+  krb5_k_free_key(context, f->recvkey);
+  krb5_free_keyblock(context, f->sendkb);
+  krb5_free_keyblock(context, f->recvkb);
+  free(f->sealbuf);
+  free(f);
+}
+
+static void
+seal_body(krb5_context context, krb5_key key, krb5_keyusage usage, kfast *f,
+	  int type, long long seq, char *body, size_t len,
+	  unsigned int padlen) {
+  krb5_crypto_iov iov[5];
+  unsigned char aad[1 + FAST_SEQLEN];
+  char *p;
+  int ret;
+
+  p = body;
+  put64((unsigned char *)p, seq);
+  p += FAST_SEQLEN;
+  aad[0] = type;
+  put64(aad + 1, seq);
+
+  iov[0].flags = KRB5_CRYPTO_TYPE_HEADER;
+  iov[0].data.data = p;
+  iov[0].data.length = f->hdrlen;
+  iov[1].flags = KRB5_CRYPTO_TYPE_SIGN_ONLY;
+  iov[1].data.data = (char *)aad;
+  iov[1].data.length = sizeof(aad);
+  iov[2].flags = KRB5_CRYPTO_TYPE_DATA;
+  iov[2].data.data = p + f->hdrlen;
+  iov[2].data.length = len;
+  iov[3].flags = KRB5_CRYPTO_TYPE_PADDING;
+  iov[3].data.data = p + f->hdrlen + len;
+  iov[3].data.length = padlen;
+  iov[4].flags = KRB5_CRYPTO_TYPE_TRAILER;
+  iov[4].data.data = p + f->hdrlen + len + padlen;
+  iov[4].data.length = f->trllen;
+
+  ret = krb5_k_encrypt_iov(context, key, usage, NULL, iov, 5);
+  if (ret)
+    fail(ret, "krb5_k_encrypt_iov");
+}
+
+/*
+ * Seal a frame body in place.  The len bytes of data must already be at
+ * FAST_SEQLEN + hdrlen into body, and there must be room after them for
+ * padlen and the trailer.  Only the key and f's lengths are used, so this
+ * can run on any thread with a context and key of its own.
+ */
+void
+fast_seal_body(krb5_context context, krb5_key key, kfast *f, int type,
+	       long long seq, char *body, size_t len, unsigned int padlen) {
+  seal_body(context, key, KU_FAST, f, type, seq, body, len, padlen);
+}
+
+int
+fast_send(krb5_context context, kfast *f, kconn *conn, int type,
+	  const char *data, size_t len) {
+  unsigned int padlen;
+  long long seq;
+  size_t need, off = FAST_SEQLEN + f->hdrlen;
+  int ret, chan;
+
+  ret = krb5_c_padding_length(context, f->enctype, len, &padlen);
+  if (ret)
+    fail(ret, "krb5_c_padding_length");
+  need = off + len + padlen + f->trllen;
+
+  /* refuse before sealing, so a dropped frame never uses up a number */
+  if (conn_full(conn, FRAME_HDRLEN + need)) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  chan = frame_chan(conn, type);
+  seq = (long long)chan << 56 | f->sendseq[chan];
+
+  /* bulk data is sealed by the pool, and sent when it is done */
+  if (conn->pool && chan == CHAN_BULK) {
+    ret = pool_seal(conn, type, seq, data, len, off, padlen, need);
+    if (ret >= 0)
+      f->sendseq[chan]++;
+    return ret;
+  }
+
+  if (need > f->sealbufsize) {
+    f->sealbuf = realloc(f->sealbuf, need);
+    if (!f->sealbuf)
+      fail(errno, "allocating seal buffer");
+    f->sealbufsize = need;
+  }
+  memcpy(f->sealbuf + off, data, len);
+  fast_seal_body(context, f->sendkey, f, type, seq, f->sealbuf, len, padlen);
+  f->sendseq[chan]++;
+  return conn_send(conn, type, FRAME_F_FAST, f->sealbuf, need);
+}
+
+/*
+ * The next sequence number for frame's channel, if frame has it.  The
+ * number is used up whether or not the frame then opens.
+ */
+krb5_error_code
+fast_claim(kfast *f, kframe *frame, long long *seq) {
+  if (frame->len < FAST_SEQLEN)
+    return KRB5_BAD_MSIZE;
+  *seq = (long long)frame->chan << 56 | f->recvseq[frame->chan];
+  if (get64((unsigned char *)frame->data) != *seq)
+    return KRB5KRB_AP_ERR_BADORDER;
+  f->recvseq[frame->chan]++;
+  return 0;
+}
+
+static krb5_error_code
+open_body(krb5_context context, krb5_key key, krb5_keyusage usage, int type,
+	  long long seq, char *body, size_t len, krb5_data *msg) {
+  krb5_crypto_iov iov[3];
+  unsigned char aad[1 + FAST_SEQLEN];
+  krb5_error_code ret;
+
+  aad[0] = type;
+  put64(aad + 1, seq);
+
+  iov[0].flags = KRB5_CRYPTO_TYPE_STREAM;
+  iov[0].data.data = body + FAST_SEQLEN;
+  iov[0].data.length = len - FAST_SEQLEN;
+  iov[1].flags = KRB5_CRYPTO_TYPE_SIGN_ONLY;
+  iov[1].data.data = (char *)aad;
+  iov[1].data.length = sizeof(aad);
+  iov[2].flags = KRB5_CRYPTO_TYPE_DATA;
+  iov[2].data.data = NULL;
+  iov[2].data.length = 0;
+
+  ret = krb5_k_decrypt_iov(context, key, usage, NULL, iov, 3);
+  if (ret)
+    return ret;
+  *msg = iov[2].data;
+  return 0;
+}
+
+/* open a claimed frame body in place; like fast_seal_body(), on any thread */
+krb5_error_code
+fast_open_body(krb5_context context, krb5_key key, int type, long long seq,
+	       char *body, size_t len, krb5_data *msg) {
+  return open_body(context, key, KU_FAST, type, seq, body, len, msg);
+}
+
+/*
+ * Open a fast frame in place.  msg is left pointing into the frame, so
+ * it is only good as long as the frame is and must not be freed.
+ */
+krb5_error_code
+fast_open(krb5_context context, kfast *f, kframe *frame, krb5_data *msg) {
+  krb5_error_code ret;
+  long long seq;
+
+  ret = fast_claim(f, frame, &seq);
+  if (ret)
+    return ret;
+  return fast_open_body(context, f->recvkey, frame->type, seq, frame->data,
+			frame->len, msg);
+}
+
+/*
+ * Seal len bytes of data as a datagram of type with sequence number seq,
+ * into buf, which is bufsize long.  A datagram is the type and then a
+ * frame body.  Returns its length, or 0 if it would not fit.
+ */
+size_t
+fast_dgram_seal(krb5_context context, kfast *f, int type, long long seq,
+		const char *data, size_t len, char *buf, size_t bufsize) {
+  unsigned int padlen;
+  size_t need, off = 1 + FAST_SEQLEN + f->hdrlen;
+  int ret;
+
+  ret = krb5_c_padding_length(context, f->enctype, len, &padlen);
+  if (ret)
+    fail(ret, "krb5_c_padding_length");
+  need = off + len + padlen + f->trllen;
+  if (need > bufsize)
+    return 0;
+  buf[0] = type;
+  memcpy(buf + off, data, len);
+  seal_body(context, f->sendkey, KU_DGRAM, f, type, seq, buf + 1, len,
+	    padlen);
+  return need;
+}
+
+/*
+ * Open a datagram in place, setting its type and sequence number.  Like
+ * fast_open(), msg points into buf.
+ */
+krb5_error_code
+fast_dgram_open(krb5_context context, kfast *f, char *buf, size_t len,
+		int *type, long long *seq, krb5_data *msg) {
+  if (len < 1 + FAST_SEQLEN)
+    return KRB5_BAD_MSIZE;
+  *type = (unsigned char)buf[0];
+  *seq = get64((unsigned char *)buf + 1);
+  return open_body(context, f->recvkey, KU_DGRAM, *type, *seq, buf + 1,
+		   len - 1, msg);
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
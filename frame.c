@@ -0,0 +1,623 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include "ktalk.h"
+
+unsigned int local_caps = CAP_BINARY | CAP_FILE | CAP_ROOM | CAP_LIVE
+    | CAP_FAST | CAP_CHAN | CAP_PING;
+
+/* the order the output queues are served in */
+static const int chan_order[CHAN_COUNT] = { CHAN_CTL, CHAN_CHAT, CHAN_BULK };
+
+static const struct {
+  const char *name;
+  unsigned int cap;
+} captab[] = {
+  { "bin", CAP_BINARY },
+  { "file", CAP_FILE },
+  { "room", CAP_ROOM },
+  { "live", CAP_LIVE },
+  { "fast", CAP_FAST },
+  { "zlib", CAP_ZLIB },
+  { "chan", CAP_CHAN },
+  { "ping", CAP_PING },
+  { "pipe", CAP_PIPE },
+  { "dgram", CAP_DGRAM },
+  { NULL, 0 }
+};
+
+void
+conn_init(kconn *c, int fd, const ktransport *transport) {
+  c->fd = fd;
+  c->transport = transport;
+  c->framing = FRAMING_ASCII;
+  c->caps = 0;
+  c->rbuf = NULL;		/* allocated by conn_fill() */
+  c->rbufsize = c->rstart = c->rend = 0;
+  memset(c->wq, 0, sizeof(c->wq));
+  c->wchan = CHAN_CHAT;
+  c->wleft = 0;
+  c->bulk_waiting = 0;
+  c->bulk_sent = c->bulk_acked = c->bulk_read = c->bulk_granted = 0;
+  c->bulk_held = 0;
+  c->nonblock = 0;
+  c->sec = NULL;
+  c->secstate = NULL;
+  c->zip = NULL;
+  c->pool = NULL;
+}
+
+void
+conn_free(kconn *c) {
+  int i;
+
+  /* the pool's threads use the fast path's keys, so they go first */
+  if (c->pool)
+    pool_free(c->pool);
+  c->pool = NULL;
+  if (c->sec)
+    c->sec->release(c);
+  c->sec = NULL;
+  c->secstate = NULL;
+#ifdef HAVE_LIBZ
+  if (c->zip)
+    zip_free(c->zip);
+#endif
+  c->zip = NULL;
+  free(c->rbuf);
+  c->rbuf = NULL;
+  c->rstart = c->rend = c->rbufsize = 0;
+  for (i = 0; i < CHAN_COUNT; i++)
+    free(c->wq[i].buf);
+  memset(c->wq, 0, sizeof(c->wq));
+  c->wleft = 0;
+  c->bulk_waiting = 0;
+}
+
+/* from here on writes never block; what the socket won't take is queued */
+int
+conn_nonblock(kconn *c) {
+  if (set_nonblock(c->fd) < 0)
+    return -1;
+  c->nonblock = 1;
+  return 0;
+}
+
+size_t
+conn_pending(kconn *c) {
+  size_t n = 0;
+  int i;
+
+  for (i = 0; i < CHAN_COUNT; i++)
+    n += c->wq[i].end - c->wq[i].start;
+  return n;
+}
+
+/* input read but not yet taken as frames */
+size_t
+conn_buffered(kconn *c) {
+  return c->rend - c->rstart;
+}
+
+/*
+ * Give back the buffers of a connection with nothing in them, for one
+ * that may sit idle for a long time.  They come back when needed.
+ */
+void
+conn_shrink(kconn *c) {
+  kqueue *q;
+  int i;
+
+  if (c->rstart == c->rend) {
+    free(c->rbuf);
+    c->rbuf = NULL;
+    c->rbufsize = c->rstart = c->rend = 0;
+  }
+  for (i = 0; i < CHAN_COUNT; i++) {
+    q = &c->wq[i];
+    if (q->start == q->end) {
+      free(q->buf);
+      memset(q, 0, sizeof(*q));
+    }
+  }
+}
+
+/* too much is queued to start on more bulk data */
+int
+conn_congested(kconn *c) {
+  return conn_pending(c) > CONN_WBUF_HIGH;
+}
+
+/*
+ * Would queueing len more bytes go past the limit, counting what the pool
+ * is sealing, which has room kept for it.
+ */
+int
+conn_full(kconn *c, size_t len) {
+  return conn_pending(c) + pool_reserved(c->pool) + len > CONN_WBUF_MAX;
+}
+
+/*
+ * Choose what to write next: the oldest frame on the most urgent channel
+ * that has one.  Without channels there is only the one queue, and no
+ * frames in it need telling apart.  Returns 0 if there is nothing to
+ * start, or only bulk data and bulk is not set.
+ */
+static int
+next_frame(kconn *c, int bulk) {
+  kqueue *q;
+  int i;
+
+  for (i = 0; i < CHAN_COUNT; i++) {
+    q = &c->wq[chan_order[i]];
+    if (q->start == q->end || (chan_order[i] == CHAN_BULK && !bulk))
+      continue;
+    c->wchan = chan_order[i];
+    if (c->wchan == CHAN_BULK)
+      c->bulk_waiting--;
+    if (c->caps & CAP_CHAN)
+      c->wleft = FRAME_HDRLEN + get32((unsigned char *)q->buf + q->start);
+    else
+      c->wleft = q->end - q->start;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Write queued frames until the socket will take no more.  A frame, once
+ * started, is finished before any other, and at most one bulk frame is
+ * started, and only if bulk is set; then chat only ever waits behind one
+ * bulk frame of ours and what the socket's low water mark lets it hold.
+ */
+static int
+conn_push(kconn *c, int bulk) {
+  kqueue *q;
+  ssize_t n;
+
+  for (;;) {
+    if (!c->wleft) {
+      if (!next_frame(c, bulk))
+	return 0;
+      if (c->wchan == CHAN_BULK)
+	bulk = 0;
+    }
+    q = &c->wq[c->wchan];
+    n = write(c->fd, q->buf + q->start, c->wleft);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    if (n <= 0)
+      return -1;
+    stat_add(ST_WRITE, n);
+    TRACE(TR_WRITE, c->fd, n, 0);
+    q->start += n;
+    c->wleft -= n;
+    if (q->start == q->end)
+      q->start = q->end = 0;
+  }
+}
+
+/* the socket has room: write what is queued, and the next bulk frame */
+int
+conn_flush(kconn *c) {
+  return conn_push(c, 1);
+}
+
+static void
+conn_queue(kqueue *q, const char *data, size_t len) {
+  size_t want;
+
+  if (q->end + len > q->size && q->start > 0) {
+    memmove(q->buf, q->buf + q->start, q->end - q->start);
+    q->end -= q->start;
+    q->start = 0;
+  }
+  if (q->end + len > q->size) {
+    want = q->size ? q->size : 4096;
+    while (want < q->end + len)
+      want *= 2;
+    q->buf = realloc(q->buf, want);
+    if (!q->buf)
+      fail(errno, "allocating write buffer");
+    q->size = want;
+  }
+  memcpy(q->buf + q->end, data, len);
+  q->end += len;
+}
+
+/*
+ * Send iov as a frame on chan, or as much of it as the socket takes right
+ * now, and queue the rest for conn_push().  With nothing else waiting, a
+ * frame that is not bulk goes straight to the socket.  Blocking
+ * connections (during the handshake) just write it all.
+ */
+static int
+conn_writev(kconn *c, int chan, struct iovec *iov, int iovcnt) {
+  ssize_t n = 0;
+  size_t total = 0;
+  int i;
+
+  if (!c->nonblock)
+    return netwritev(c->fd, iov, iovcnt);
+
+  for (i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+  if (conn_full(c, total)) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  if (chan != CHAN_BULK && !conn_pending(c)) {
+    do
+      n = writev(c->fd, iov, iovcnt);
+    while (n < 0 && errno == EINTR);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+	return -1;
+      n = 0;
+    } else {
+      stat_add(ST_WRITE, n);
+      TRACE(TR_WRITE, c->fd, n, 0);
+    }
+    if ((size_t)n < total) {
+      c->wchan = chan;
+      c->wleft = total - n;
+    }
+  }
+  for (i = 0; i < iovcnt; i++) {
+    if ((size_t)n >= iov[i].iov_len) {
+      n -= iov[i].iov_len;
+      continue;
+    }
+    conn_queue(&c->wq[chan], (char *)iov[i].iov_base + n,
+	       iov[i].iov_len - n);
+    n = 0;
+  }
+  if (chan == CHAN_BULK)
+    c->bulk_waiting++;
+  else if (conn_push(c, 0) < 0)
+    return -1;
+  return total;
+}
+
+/*
+ * Pull whatever the socket has into the read buffer with a single read().
+ * The buffer starts small and grows, up to the largest frame, whenever a
+ * frame will not fit in it.  Returns the number of bytes read, 0 on end
+ * of file, or -1 with errno set.
+ */
+int
+conn_fill(kconn *c) {
+  size_t want;
+  int ret;
+
+  /* slide a partial frame down so there is room behind it */
+  if (c->rstart == c->rend) {
+    c->rstart = c->rend = 0;
+  } else if (c->rstart > 0) {
+    memmove(c->rbuf, c->rbuf + c->rstart, c->rend - c->rstart);
+    c->rend -= c->rstart;
+    c->rstart = 0;
+  }
+
+  if (c->rend == c->rbufsize) {
+    if (c->rbufsize == FRAME_HDRLEN + FRAME_MAXLEN) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+    want = c->rbufsize ? c->rbufsize * 2 : CONN_RBUF_MIN;
+    if (want > FRAME_HDRLEN + FRAME_MAXLEN)
+      want = FRAME_HDRLEN + FRAME_MAXLEN;
+    c->rbuf = realloc(c->rbuf, want);
+    if (!c->rbuf)
+      fail(errno, "allocating read buffer");
+    c->rbufsize = want;
+  }
+
+  ret = read(c->fd, c->rbuf + c->rend, c->rbufsize - c->rend);
+  if (ret > 0) {
+    c->rend += ret;
+    stat_add(ST_READ, ret);
+    TRACE(TR_READ, c->fd, ret, 0);
+  }
+  return ret;
+}
+
+/*
+ * Take the next complete frame out of the read buffer.  The frame data is
+ * left in place and is only good until the next conn_fill().  Returns 1 if
+ * a frame was found, 0 if more input is needed, -1 on a malformed frame.
+ */
+int
+conn_frame(kconn *c, kframe *f) {
+  char *p = c->rbuf + c->rstart;
+  size_t avail = c->rend - c->rstart;
+  size_t hdrlen, len;
+
+  if (!avail)
+    return 0;
+  if (c->framing == FRAMING_BINARY) {
+    unsigned char *h = (unsigned char *)p;
+
+    if (avail < FRAME_HDRLEN)
+      return 0;
+    len = get32(h);
+    if (len > FRAME_MAXLEN) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+    f->type = h[4];
+    f->flags = h[5];
+    f->chan = c->caps & CAP_CHAN ? h[6] : CHAN_CHAT;
+    f->caps = 0;
+    if (f->chan >= CHAN_COUNT) {
+      errno = EPROTO;
+      return -1;
+    }
+    hdrlen = FRAME_HDRLEN;
+  } else {
+    char *nul, *end;
+    long l;
+
+    nul = memchr(p, '\0', avail < ASCII_LENMAX ? avail : ASCII_LENMAX);
+    if (!nul) {
+      if (avail >= ASCII_LENMAX) {
+	errno = EPROTO;
+	return -1;
+      }
+      return 0;
+    }
+    l = strtol(p, &end, 10);
+    if (end == p || l < 0 || l > ASCII_MAXLEN) {
+      errno = EPROTO;
+      return -1;
+    }
+    len = l;
+    f->type = FRAME_DATA;
+    f->flags = 0;
+    f->chan = CHAN_CHAT;
+    f->caps = caps_parse(end);
+    hdrlen = nul - p + 1;
+  }
+
+  if (avail < hdrlen + len)
+    return 0;
+
+  f->data = p + hdrlen;
+  f->len = len;
+  c->rstart += hdrlen + len;
+  return 1;
+}
+
+/* put back the binary frame conn_frame() just took, to be taken again */
+void
+conn_unframe(kconn *c, kframe *f) {
+  c->rstart = f->data - c->rbuf - FRAME_HDRLEN;
+}
+
+/*
+ * Block until a whole frame is available; used during the handshake.
+ * Returns 1 for a frame, 0 if the peer closed the connection, -1 on error.
+ */
+int
+conn_readframe(kconn *c, kframe *f) {
+  int ret;
+
+  while ((ret = conn_frame(c, f)) == 0) {
+    ret = conn_fill(c);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return ret;
+  }
+  return ret;
+}
+
+/* once caps are agreed: everything past the framing needs binary frames */
+void
+conn_agree(kconn *c) {
+  if (c->caps & CAP_BINARY)
+    c->framing = FRAMING_BINARY;
+  else
+    c->caps = 0;
+  debug("using %s framing", c->framing == FRAMING_BINARY ? "binary" : "ascii");
+  /* frames passing each other need the fast path's sequence numbers */
+  if (!(c->caps & CAP_FAST))
+    c->caps &= ~CAP_CHAN;
+  /* and pings their own sequence numbers, so chat's are left alone */
+  if (!(c->caps & CAP_CHAN))
+    c->caps &= ~CAP_PING;
+  /* datagrams are sealed under the fast path keys */
+  if (!(c->caps & CAP_FAST))
+    c->caps &= ~CAP_DGRAM;
+  if (c->caps & CAP_CHAN) {
+    set_lowat(c->fd, CHAN_LOWAT);
+    debug("using channels");
+  }
+#ifdef HAVE_LIBZ
+  if (c->caps & CAP_ZLIB) {
+    c->zip = zip_start();
+    debug("compressing with zlib");
+  }
+#endif
+}
+
+int
+conn_send(kconn *c, int type, int flags, const char *data, size_t len) {
+  unsigned char hdr[FRAME_HDRLEN];
+  struct iovec iov[2];
+  int chan, ret;
+
+  if (c->framing == FRAMING_ASCII) {
+    if (type != FRAME_DATA) {
+      errno = EPROTO;
+      return -1;
+    }
+    return conn_send_ascii(c, data, len, 0);
+  }
+
+  if (len > FRAME_MAXLEN) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  chan = frame_chan(c, type);
+  put32(hdr, len);
+  hdr[4] = type;
+  hdr[5] = flags;
+  hdr[6] = chan;
+  hdr[7] = 0;
+
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = (char *)data;
+  iov[1].iov_len = len;
+  ret = conn_writev(c, chan, iov, 2);
+  if (ret >= 0 && chan == CHAN_BULK)
+    c->bulk_sent += len;
+  return ret;
+}
+
+/* send a frame with the old ascii length prefix, advertising caps if any */
+int
+conn_send_ascii(kconn *c, const char *data, size_t len, unsigned int caps) {
+  char prefix[ASCII_LENMAX];
+  struct iovec iov[2];
+  size_t n;
+
+  snprintf(prefix, sizeof(prefix), "%lu", (unsigned long)len);
+  if (caps) {
+    n = strlen(prefix);
+    prefix[n++] = ' ';
+    caps_format(caps, prefix + n, sizeof(prefix) - n);
+  }
+
+  iov[0].iov_base = prefix;
+  iov[0].iov_len = strlen(prefix) + 1;
+  iov[1].iov_base = (char *)data;
+  iov[1].iov_len = len;
+  return conn_writev(c, CHAN_CHAT, iov, 2);
+}
+
+void
+put32(unsigned char *p, krb5_ui_4 v) {
+  p[0] = (v >> 24) & 0xff;
+  p[1] = (v >> 16) & 0xff;
+  p[2] = (v >> 8) & 0xff;
+  p[3] = v & 0xff;
+}
+
+krb5_ui_4
+get32(const unsigned char *p) {
+  return ((krb5_ui_4)p[0] << 24) | ((krb5_ui_4)p[1] << 16) |
+      ((krb5_ui_4)p[2] << 8) | p[3];
+}
+
+void
+put64(unsigned char *p, long long v) {
+  put32(p, (krb5_ui_4)((unsigned long long)v >> 32));
+  put32(p + 4, (krb5_ui_4)v);
+}
+
+long long
+get64(const unsigned char *p) {
+  return (long long)(((unsigned long long)get32(p) << 32) | get32(p + 4));
+}
+
+int
+netwritev(int fd, struct iovec *iov, int iovcnt) {
+  ssize_t nwritten;
+  int sent = 0;
+
+  while (iovcnt > 0) {
+    nwritten = writev(fd, iov, iovcnt);
+    if (nwritten < 0 && errno == EINTR)
+      continue;
+    if (nwritten <= 0)
+      return (nwritten);
+    stat_add(ST_WRITE, nwritten);
+    TRACE(TR_WRITE, fd, nwritten, 0);
+
+    sent += nwritten;
+    while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+      nwritten -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + nwritten;
+      iov->iov_len -= nwritten;
+    }
+  }
+  return sent;
+}
+
+void
+caps_format(unsigned int caps, char *buf, size_t buflen) {
+  size_t n = 0;
+  int i;
+
+  if (buflen)
+    buf[0] = '\0';
+  for (i = 0; captab[i].name; i++) {
+    if (!(caps & captab[i].cap))
+      continue;
+    if (n + strlen(captab[i].name) + 2 > buflen)
+      break;
+    if (n)
+      buf[n++] = ' ';
+    strcpy(&buf[n], captab[i].name);
+    n += strlen(captab[i].name);
+  }
+}
+
+/* names we do not know are skipped, so newer peers can offer more */
+unsigned int
+caps_parse(const char *s) {
+  unsigned int caps = 0;
+  size_t len;
+  int i;
+
+  for (;;) {
+    s += strspn(s, " ");
+    len = strcspn(s, " ");
+    if (len == 0)
+      break;
+    for (i = 0; captab[i].name; i++) {
+      if (strlen(captab[i].name) == len && !strncmp(s, captab[i].name, len))
+	caps |= captab[i].cap;
+    }
+    s += len;
+  }
+  return caps;
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
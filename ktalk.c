@@ -24,57 +24,49 @@ OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include <string.h>
 #include <stdarg.h>
 #include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <arpa/nameser.h>
-#include <netdb.h>
 #include <krb5.h>
 #include <errno.h>
-#include <zephyr/zephyr.h>
 #include <signal.h>
 #include <curses.h>
-#include <sys/wait.h>
+#include <pthread.h>
+#include "ktalk.h"
 
-typedef enum { MODE_SERVER, MODE_CLIENT } ktalk_mode;
-
-int server_open(const char *user, struct sockaddr_in *faddr, char *execstr);
-int client_open(const char *user, const char *host, unsigned short port,
-		struct sockaddr_in *faddr);
-
-int netread(int fd, char *ptr, int nbytes);
-int netwrite(int fd, char *ptr, int nbytes);
-int netreadlen(int fd);
-int netreaddata(int fd, char **ptr);
-int netwritedata(int fd, char *ptr, int nbytes);
-void send_connect_message(const char *recip, int port, char *estr);
 void kill_and_die(int);
 void window_change(int);
-void auth_con_setup(krb5_context context, krb5_auth_context * auth_context,
-		    krb5_address * local_address,
-		    krb5_address * foreign_address);
-void debug_remoteseq(krb5_context context, krb5_auth_context auth_context,
-		     const char *whence);
-void debug_localseq(krb5_context context, krb5_auth_context auth_context,
-		    const char *whence);
-void sockaddr_to_krb5_address(krb5_address * k5, struct sockaddr *sock);
-void fail(long err, const char *context);
-void bye(const char *message);
+static krb5_context kerberos_setup(krb5_ccache *ccache, char **me);
+static void *prepare(void *arg);
+static void first_message(void);
+static void run_session(krb5_context context, kconn *conn, char *sendfile);
+static void take_input(kconn *conn, int *input_done);
+void receive_frame(krb5_context context, kconn *conn, kframe *frame);
+static void receive_pooled(kconn *conn, int wait);
 void clear_windows(WINDOW *win1, WINDOW *win2);
 
+/* flush a partial line at this length so its sealed frame fits any peer */
+#define LINE_FLUSHLEN 768
+/* file chunks queued per pass through the loop */
+#define XFER_BATCH 4
+
 int sockfd, curs_start, use_curses, debug_flag;
 int need_resize = 0;
+int show_timings = 0;
+WINDOW *sendwin = NULL, *receivewin = NULL, *sepwin = NULL;
+char statusfields[STATUS_SLOTS][256];
+char writebuff[1024], filebuff[256];
+int writebufflen = 0, filebufflen = -1, line_ready = 0;
+static int input_held = 0;	/* the piece in writebuff did not go */
+static long long started;	/* when we were run, until the first message */
 
 inline void
 debug(const char *format, ...) {
   va_list ap;
   char fmtbuf[1024];
 
+  if (!debug_flag)
+    return;
   va_start(ap, format);
-  if (debug_flag) {
-    snprintf(fmtbuf, sizeof(fmtbuf), "DEBUG: %s\n", format);
-    vfprintf(stderr, fmtbuf, ap);
-  }
+  snprintf(fmtbuf, sizeof(fmtbuf), "DEBUG: %s\n", format);
+  vfprintf(stderr, fmtbuf, ap);
   va_end(ap);
 }
 
@@ -91,41 +83,144 @@ send_height(void) {
 void
 usage(const char *whoami) {
   fprintf(stderr,
-	  "usage: %s [-e messager] <user>\n       %s <user> <host> <port>\n",
-	  whoami, whoami);
+	  "usage: %s [-e messager | -N file | -n] [-f file] [-r dir] [-k ms]\n"
+	  "          [-p secs] [-R hz] [-s kb] [-u] [-z] [-l dir [-K keytab]]\n"
+	  "          [-v] [-S file] <user>\n"
+	  "       %s [-e messager | -N file | -n] [-p secs] [-z] [-v] [-S file]\n"
+	  "          -P <user>\n"
+	  "       %s [-e messager | -N file | -n] [-R hz] [-s kb]\n"
+	  "          [-l dir [-K keytab]] [-v] [-S file] -m <user> ...\n"
+	  "       %s [-f file] [-r dir] [-k ms] [-p secs] [-R hz] [-s kb]\n"
+	  "          [-t secs] [-u] [-z] [-l dir [-K keytab]] [-v] [-S file]\n"
+	  "          <user> <host> <port>\n"
+	  "       %s [-p secs] [-t secs] [-z] [-v] [-S file]\n"
+	  "          -P <user> <host> <port>\n"
+	  "       %s [-z] [-v] [-S file] -D [port]\n"
+	  "       %s [-e messager | -N file | -n] [-f file] [-r dir] [-k ms]\n"
+	  "          [-R hz] [-s kb] [-l dir [-K keytab]] [-v] [-S file] -A <user>\n"
+	  "       %s [-K keytab] -T transcript\n",
+	  whoami, whoami, whoami, whoami, whoami, whoami, whoami, whoami);
   exit(1);
 }
 
 int
 main(int argc, char **argv) {
   ktalk_mode mode;
-  int ret, writebufflen;
-  char *execstr = NULL;
+  int room = 0, run_daemon = 0, attach = 0, udp = 0;
+  unsigned int peer_caps;
+  char *nfarg = NULL, *sendfile = NULL;
+  char *logdir = NULL, *keytab = NULL, *dumpfile = NULL;
   krb5_context context;
-  krb5_ccache ccache;
-  char *my_principal_string;
-  krb5_address local_address, foreign_address;
-  struct sockaddr_in faddr, laddr;
-  size_t laddrlen;
-  WINDOW *sendwin = NULL, *receivewin = NULL, *sepwin = NULL;
-  fd_set fdset;
+  krb5_ccache ccache = NULL;
+  char *my_principal_string = NULL;
+  kprep prep;
+  pthread_t preparer;
+  const knotifier *notifier = &notify_zephyr;
   struct sigaction sigact;
-  char writebuff[1024], startupmsg[2048];
-  krb5_principal my_principal;
-  krb5_auth_context auth_context;
-  int opt;
+  char startupmsg[2048];
+  kconn conn;
+  int servsock = -1, opt;
   extern char *optarg;
   extern int optind;
 
+  started = now_usec();
   use_curses = 1;
   debug_flag = 0;
   curs_start = 0;
   strcpy(startupmsg, "");
 
-  while ((opt = getopt(argc, argv, "dce:")) != -1) {
+  while ((opt = getopt(argc, argv, "AdcDe:f:k:K:l:mnN:p:Pr:R:s:S:t:T:uvX:z")) != -1) {
     switch (opt) {
     case 'e':
-      execstr = optarg;
+      notifier = &notify_exec;
+      nfarg = optarg;
+      break;
+    case 'N':
+      notifier = &notify_file;
+      nfarg = optarg;
+      break;
+    case 'n':
+      notifier = &notify_none;
+      break;
+    case 'f':
+      sendfile = optarg;
+      break;
+    case 'r':
+      recv_dir = optarg;
+      break;
+    case 'k':
+      live_mode = 1;
+      live_window = atoi(optarg);
+      if (live_window < 0)
+	usage(argv[0]);
+      break;
+    case 'R':
+      render_rate = atoi(optarg);
+      if (render_rate < 0)
+	usage(argv[0]);
+      break;
+    case 's':
+      scroll_kbytes = atoi(optarg);
+      if (scroll_kbytes < 0)
+	usage(argv[0]);
+      break;
+    case 'p':
+      ping_secs = atoi(optarg);
+      if (ping_secs < 0)
+	usage(argv[0]);
+      break;
+    case 't':
+      connect_timeout = atoi(optarg);
+      if (connect_timeout <= 0)
+	usage(argv[0]);
+      break;
+    case 'm':
+      room = 1;
+      break;
+    case 'D':
+      run_daemon = 1;
+      break;
+    case 'A':
+      attach = 1;
+      break;
+    case 'P':
+      pipe_mode = 1;
+      break;
+    case 'u':
+      udp = 1;
+      break;
+    case 'l':
+      logdir = optarg;
+      break;
+    case 'K':
+      keytab = optarg;
+      break;
+    case 'T':
+      dumpfile = optarg;
+      break;
+    case 'S':
+      stat_file = optarg;
+      break;
+    case 'v':
+      show_timings = 1;
+      break;
+    case 'X':
+#ifdef KTALK_TRACE
+      trace_start(optarg);
+#else
+      fprintf(stderr, "%s: built without --enable-trace, -X is not available\n",
+	      argv[0]);
+      exit(1);
+#endif
+      break;
+    case 'z':
+#ifdef HAVE_LIBZ
+      local_caps |= CAP_ZLIB;
+#else
+      fprintf(stderr, "%s: built without zlib, -z is not available\n",
+	      argv[0]);
+      exit(1);
+#endif
       break;
     case 'd':
       debug_flag = !debug_flag;
@@ -138,7 +233,16 @@ main(int argc, char **argv) {
     }
   }
 
+  if (dumpfile) {
+    log_dump(dumpfile, keytab);
+    exit(0);
+  }
+
   switch (argc - optind) {
+  case 0:
+    if (!run_daemon)
+      usage(argv[0]);
+    break;
   case 1:
     mode = MODE_SERVER;
     break;
@@ -146,7 +250,34 @@ main(int argc, char **argv) {
     mode = MODE_CLIENT;
     break;
   default:
-    usage(argv[0]);
+    if (!room)
+      usage(argv[0]);
+  }
+  if (room)
+    mode = MODE_ROOM;
+  if (attach) {
+    if (mode != MODE_SERVER)
+      usage(argv[0]);
+    mode = MODE_ATTACH;
+  }
+  if (run_daemon) {
+    if (argc - optind > 1 || room || attach)
+      usage(argv[0]);
+    mode = MODE_DAEMON;
+  }
+  if (udp) {
+    /* the daemon and rooms keep to TCP */
+    if (mode != MODE_SERVER && mode != MODE_CLIENT)
+      usage(argv[0]);
+    local_caps |= CAP_DGRAM;
+  }
+  if (pipe_mode) {
+    /* stdin and stdout are the data, so there is no screen and no typing */
+    if ((mode != MODE_SERVER && mode != MODE_CLIENT) || sendfile || logdir)
+      usage(argv[0]);
+    use_curses = 0;
+    live_mode = 0;
+    pipe_setup();
   }
 
   sigemptyset(&sigact.sa_mask);
@@ -155,685 +286,830 @@ main(int argc, char **argv) {
   sigaction(SIGINT, &sigact, NULL);
   sigact.sa_handler = window_change;
   sigaction(SIGWINCH, &sigact, NULL);
+  sigact.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sigact, NULL);
 
   /* kerberos set up for both client and server */
   putenv("KRB5_KTNAME=/dev/null");	/* kerberos V can kiss my pasty white ass */
-  ret = krb5_init_context(&context);
-  if (ret)
-    fail(ret, "krb5_init_context");
-  ret = krb5_cc_default(context, &ccache);
-  if (ret)
-    fail(ret, "krb5_cc_default");
-  ret = krb5_cc_get_principal(context, ccache, &my_principal);
-  if (ret)
-    fail(ret, "krb5_cc_get_principal");
-  ret = krb5_unparse_name(context, my_principal, &my_principal_string);
-  if (ret)
-    fail(ret, "krb5_unparse_name");
-  debug("you are %s", my_principal_string);
-
-  if (mode == MODE_SERVER) {
-    sockfd = server_open(argv[optind], &faddr, execstr);
-  } else if (mode == MODE_CLIENT) {
-    sockfd =
-	client_open(argv[optind], argv[optind + 1], atoi(argv[optind + 2]),
-		    &faddr);
+  stat_init();
+  if (mode == MODE_ATTACH) {
+    /* the daemon has the tickets, and seals and opens for us */
+    context = NULL;
+    peer_caps = daemon_attach(&conn, argv[optind], notifier, nfarg,
+			      startupmsg);
+    sockfd = conn.fd;
+    puts("connection established.");
+  } else if (mode == MODE_SERVER || mode == MODE_CLIENT) {
+    /*
+     * Get the krb5 side ready while the connection is being made.  The
+     * notifier is forked first: a child that does not exec must not start
+     * with some lock held by a thread it does not have.
+     */
+    if (mode == MODE_SERVER)
+      servsock = tcp_listen(&argv[optind], 1, notifier, nfarg);
+    memset(&prep, 0, sizeof(prep));
+    prep.server = mode == MODE_SERVER;
+    errno = pthread_create(&preparer, NULL, prepare, &prep);
+    if (errno)
+      fail(errno, "starting kerberos setup");
+  } else {
+    context = kerberos_setup(&ccache, &my_principal_string);
   }
-  puts("connection established.");
-
-  /* get our local address */
-  laddrlen = sizeof(laddr);
-  ret = getsockname(sockfd, (struct sockaddr *)&laddr, &laddrlen);
-  if (ret != 0)
-    perror("getsockname");
-  sockaddr_to_krb5_address(&local_address, (struct sockaddr *)&laddr);
-
-  /* get the foreign address */
-  sockaddr_to_krb5_address(&foreign_address, (struct sockaddr *)&faddr);
-
-  if (mode == MODE_SERVER) {
-    krb5_creds in_creds, *out_creds;
-    krb5_ticket *inticket = NULL;
-    krb5_data msg;
-    krb5_principal clprinc;
-    char *fprincipal, *clprincstr;
-
-    /* get the krbtgt/REALM@REALM from the cache into out_creds */
-    memset(&in_creds, 0, sizeof(in_creds));
-    ret = krb5_cc_get_principal(context, ccache, &in_creds.client);
-    if (ret)
-      fail(ret, "krb5_cc_get_principal");
-
-    ret = krb5_build_principal_ext(context, &in_creds.server,
-				   krb5_princ_realm(context,
-						    in_creds.client)->length,
-				   krb5_princ_realm(context,
-						    in_creds.client)->data,
-				   6, "krbtgt",
-				   krb5_princ_realm(context,
-						    in_creds.client)->length,
-				   krb5_princ_realm(context,
-						    in_creds.client)->data,
-				   0);
-    if (ret)
-      fail(ret, "krb5_build_principal_ext");
-
-    ret = krb5_get_credentials(context, KRB5_GC_CACHED, ccache,
-			       &in_creds, &out_creds);
-    if (ret)
-      fail(ret, "krb5_get_credentials");
-
-    /* send over the user_user ticket */
-    ret =
-	netwritedata(sockfd, out_creds->ticket.data, out_creds->ticket.length);
-    if (ret < 0)
-      fail(errno, "sending user-user ticket");
-
-    /* initialize the auth_context */
-    auth_con_setup(context, &auth_context, &local_address, &foreign_address);
-    ret =
-	krb5_auth_con_setuseruserkey(context, auth_context,
-				     &out_creds->keyblock);
-    if (ret)
-      fail(ret, "krb5_auth_con_setuseruserkey");
-
-    /* read the mk_req data sent by the client */
-    ret = netreaddata(sockfd, &msg.data);
-    debug("read message, length was %i", ret);
-    if (ret < 0)
-      fail(errno, "reading ticket from client");
-    msg.length = ret;
-    ret =
-	krb5_rd_req(context, &auth_context, &msg, NULL, NULL, NULL, &inticket);
-    debug("read message with rd_req, return was %i", ret);
-    if (ret)
-      fail(ret, "krb5_rd_req");
-    free(msg.data);
-
-    ret = krb5_unparse_name(context, inticket->enc_part2->client, &fprincipal);
-    if (ret)
-      fail(ret, "krb5_unparse_name");
-    strcat(startupmsg, "Foreign party authenticates as ");
-    strcat(startupmsg, fprincipal);
-    strcat(startupmsg, "\n\n");
-
-    /* this is a little wrong, the argv[1] may have @ATHENA.MIT.EDU *//***** need to fix *****/
-    ret = krb5_parse_name(context, argv[optind], &clprinc);
-    if (ret)
-      fail(ret, "krb5_parse_name");
-    ret = krb5_unparse_name(context, clprinc, &clprincstr);
-    if (ret)
-      fail(ret, "krb5_unparse_name");
-    if (strcasecmp(fprincipal, clprincstr)) {
-      strcat(startupmsg,
-	     "WARNING! This is not the principal you specified on the\n");
-      strcat(startupmsg,
-	     "command line.  An encrypted session will be established anyway\n");
-      strcat(startupmsg,
-	     "make sure you really want to talk to this person.\n\n");
-    }
-    free(fprincipal);
-    free(clprincstr);
-  } else if (mode == MODE_CLIENT) {
-    krb5_data tkt_data, out_ticket;
-    krb5_creds *new_creds, creds;
-
-    auth_con_setup(context, &auth_context, &local_address, &foreign_address);
-
-    /* read the ticket sent by the server */
-    ret = netreaddata(sockfd, &tkt_data.data);
-    debug("got the ticket, length was %i", ret);
-    if (ret < 0)
-      fail(errno, "reading ticket from server");
-    tkt_data.length = ret;
-
-    memset(&creds, 0, sizeof(creds));
-
-    /* parse the foreign principal into creds.server */
-    ret = krb5_parse_name(context, argv[optind], &creds.server);
-    if (ret)
-      fail(ret, "krb5_parse_name");
-    /* insert our own principal in creds.client */
-    ret = krb5_cc_get_principal(context, ccache, &creds.client);
-    if (ret)
-      fail(ret, "krb5_cc_get_principal");
-
-    /* get user_user ticket */
-    creds.second_ticket = tkt_data;
-
-    ret =
-	krb5_get_credentials(context, KRB5_GC_USER_USER, ccache, &creds,
-			     &new_creds);
-    if (ret)
-      fail(ret, "getting user to user credentials");
-    debug("Got the user_user ticket!");
-
-    /* do the mk_req and send the ticket to the server */
-    ret =
-	krb5_mk_req_extended(context, &auth_context,
-			     AP_OPTS_USE_SESSION_KEY | AP_OPTS_MUTUAL_REQUIRED,
-			     NULL, new_creds, &out_ticket);
-    if (ret)
-      fail(ret, "krb5_mk_req_extended");
-
-    ret = netwritedata(sockfd, out_ticket.data, out_ticket.length);
-    if (ret < 0)
-      fail(errno, "sending ticket to server");
-    debug("sent mk req message, return was %i", ret);
-
-    free(tkt_data.data);
+
+  if (mode == MODE_DAEMON) {
+    use_curses = 0;
+    daemon_run(context, ccache, optind < argc ? atoi(argv[optind]) :
+	       DAEMON_PORT);	/* does not return */
   }
 
-  /* setup screen */
-  if (use_curses) {
-    initscr();
-    cbreak();
-    noecho();
-    intrflush(stdscr, FALSE);
-    keypad(stdscr, TRUE);
-    nodelay(stdscr, 1);
-    clear();
-    refresh();
-    curs_start = 1;
+  if (mode == MODE_ROOM) {
+    live_mode = 0;
+    if (logdir)
+      log_open(logdir, "room", keytab);
+    room_host(context, ccache, &argv[optind], argc - optind, notifier,
+	      nfarg, my_principal_string);	/* does not return */
+  }
 
-    writebufflen = 0;
+  if (mode != MODE_ATTACH) {
+    if (mode == MODE_SERVER)
+      sockfd = tcp_accept(servsock, argv[optind]);
+    else
+      sockfd = tcp_connect(argv[optind + 1], atoi(argv[optind + 2]));
+    puts("connection established.");
+    conn_init(&conn, sockfd, &transport_tcp);
+    if (set_nodelay(sockfd) < 0)
+      perror("setsockopt");
+    pthread_join(preparer, NULL);
+    context = prep.context;
+
+    /* the server's first frame needs nothing more, so it goes out now */
+    if (mode == MODE_SERVER)
+      sec_krb5_server(&conn, &prep, argv[optind], startupmsg);
+    else
+      sec_krb5_client(&conn, &prep, argv[optind]);
+    peer_caps = conn.caps;
+  }
+  stat_time(ST_READY, started);
+  debug("frames sealed by %s over %s", conn.sec->name, conn.transport->name);
 
-    /* setup send / receive windows and the seperator */
-    receivewin = newwin(receive_height(), COLS, 0, 0);
-    sepwin = newwin(1, COLS, receive_height(), 0);
-    sendwin = newwin(send_height(), COLS, receive_height() + 1, 0);
+  if (live_mode && (!(conn.caps & CAP_LIVE) || !use_curses)) {
+    live_mode = 0;
+    strcat(startupmsg, "Live typing needs the full screen and a ktalk on the\n");
+    strcat(startupmsg, "other end that knows it, sending whole lines instead.\n\n");
+  }
 
-    nodelay(sendwin, 1);
-    idlok(sendwin, 1);
-    scrollok(sendwin, 1);
-    idlok(receivewin, 1);
-    scrollok(receivewin, 1);
+  if (peer_caps & CAP_ZLIB) {
+    strcat(startupmsg, "Compression is on.  How well a message compresses shows in its\n");
+    strcat(startupmsg, "length on the wire, which can give away secrets sent alongside\n");
+    strcat(startupmsg, "text someone else chose; leave -z off for those.\n\n");
+  } else if (local_caps & CAP_ZLIB) {
+    strcat(startupmsg, "The other party did not ask for compression, so there is none.\n\n");
+  }
 
-    whline(sepwin, ACS_HLINE, COLS);
-    wnoutrefresh(sepwin);
+  if (logdir) {
+    log_open(logdir, argv[optind], keytab);
+    log_record(LOG_NOTICE, startupmsg, strlen(startupmsg));
+  }
 
-    clear_windows(receivewin, sendwin);
+  setup_screen(startupmsg);
+  run_session(context, &conn, sendfile);
+  return 0;
+}
 
-    wstandout(receivewin);
-    waddstr(receivewin, startupmsg);
-    wstandend(receivewin);
+/* our krb5 context, credentials cache and principal */
+static krb5_context
+kerberos_setup(krb5_ccache *ccache, char **me) {
+  krb5_context context;
+  krb5_principal my_principal;
+  long long start;
+  int ret;
 
-    doupdate();
-  }
+  start = now_usec();
+  ret = krb5_init_context(&context);
+  if (ret)
+    fail(ret, "krb5_init_context");
+  ret = krb5_cc_default(context, ccache);
+  if (ret)
+    fail(ret, "krb5_cc_default");
+  ret = krb5_cc_get_principal(context, *ccache, &my_principal);
+  if (ret)
+    fail(ret, "krb5_cc_get_principal");
+  stat_time(ST_INIT, start);
+  ret = krb5_unparse_name(context, my_principal, me);
+  if (ret)
+    fail(ret, "krb5_unparse_name");
+  krb5_free_principal(context, my_principal);
+  debug("you are %s", *me);
+  return context;
+}
 
-  for (;;) {
-    FD_ZERO(&fdset);
-    FD_SET(sockfd, &fdset);
-    FD_SET(fileno(stdin), &fdset);
-    ret = select(sockfd + 1, &fdset, NULL, NULL, NULL);
-    if (ret < 0) {
-      if (errno == EINTR) {
-	if (need_resize && use_curses) {
-	  need_resize = 0;
+/* everything for the handshake that can be done before the peer is there */
+static void *
+prepare(void *arg) {
+  kprep *p = arg;
 
-	  endwin();
-	  refresh();
+  p->context = kerberos_setup(&p->ccache, &p->me);
+  sec_krb5_prepare(p);
+  return NULL;
+}
 
-	  wresize(receivewin, receive_height(), COLS);
+/* how long from starting until the first message went by either way */
+static void
+first_message(void) {
+  if (started) {
+    stat_time(ST_FIRST, started);
+    started = 0;
+  }
+}
 
-	  mvwin(sepwin, receive_height(), 0);
-	  wresize(sepwin, 1, COLS);
-	  werase(sepwin);
-	  mvwhline(sepwin, 0, 0, ACS_HLINE, COLS);
+/* the conversation itself, once the handshake is done */
+static void
+run_session(krb5_context context, kconn *conn, char *sendfile) {
+  kframe frame;
+  int ret, input_done = 0;
+
+  if (pipe_mode)
+    pipe_start(conn);
+  dgram_start(conn);
+  if (sendfile)
+    xfer_start(conn, sendfile);
+
+  /* the peer may have sent chat along with the handshake */
+  while ((ret = conn_frame(conn, &frame)) > 0)
+    receive_frame(context, conn, &frame);
+  if (ret < 0)
+    fail(errno, "reading chat data from network");
+  render_flush(1);
+  if (use_curses)
+    doupdate();
 
-	  mvwin(sendwin, receive_height() + 1, 0);
-	  wresize(sendwin, send_height(), COLS);
+  if (conn_nonblock(conn) < 0)
+    fail(errno, "setting up socket");
+  ping_start(conn);
+  ev_init();
+  ev_set(fileno(stdin), EV_READ, NULL);
+  if (conn->pool)
+    ev_set(pool_fd(conn->pool), EV_READ, NULL);
+  if (dgram_fd() >= 0)
+    ev_set(dgram_fd(), EV_READ, NULL);
 
-	  clear_windows(receivewin, sendwin);
-	  waddstr(sendwin, writebuff);
+  for (;;) {
+    kev evs[8];
+    int i, n, typed = 0, drew;
 
-	  wnoutrefresh(sepwin);
-	}
-      } else {
+    ev_set(conn->fd, conn_pending(conn) ? EV_READ | EV_WRITE : EV_READ, NULL);
+    if (pipe_mode) {
+      ev_set(fileno(stdin), pipe_wants_input(conn) ? EV_READ : 0, NULL);
+      pipe_watch();
+    }
+    /*
+     * With a batch of keys or a piece of a message that could not go, the
+     * rest wait unread.
+     */
+    if (!pipe_mode && !input_done)
+      ev_set(fileno(stdin), input_held || (live_mode && live_full()) ? 0 :
+	     EV_READ, NULL);
+    /* with a file to send and room to queue it there is no waiting */
+    n = ev_wait(evs, 8, xfer_sending() && chan_bulk_room(conn)
+		&& !conn_congested(conn) ? 0 :
+		ev_sooner(ev_sooner(live_timeout(), render_timeout()),
+			  ev_sooner(ping_timeout(), dgram_timeout())));
+    if (n < 0) {
+      if (errno != EINTR)
 	fail(errno, "waiting for data");
-      }
-    } else if (FD_ISSET(sockfd, &fdset)) {
-      /* decrypt and print the incomming message */
-      krb5_data msg, encmsg;
-      ret = netreaddata(sockfd, &encmsg.data);
-      debug("received message %d bytes", ret);
-      if (ret < 0)
-	fail(errno, "reading chat data from network");
-      encmsg.length = ret;
-      debug_remoteseq(context, auth_context, "before");
-      ret = krb5_rd_priv(context, auth_context, &encmsg, &msg, NULL);
-      debug_remoteseq(context, auth_context, "after");
-
-      if (ret)
-	fail(ret, "krb5_rd_priv");
-
-      if (use_curses) {
-	waddstr(receivewin, msg.data);
-	wnoutrefresh(receivewin);
-      } else {
-	printf("%s", msg.data);
-      }
-      krb5_free_data_contents(context, &msg);
-      free(encmsg.data);
-    } else if (FD_ISSET(fileno(stdin), &fdset)) {
-      if (!use_curses) {
-	/* read from the line */
-	if (fgets(writebuff, 1024, stdin) == NULL)
-	  fail(errno, "reading from user");
-	writebufflen = strlen(writebuff);
-      } else if (use_curses) {
-	/* read from the sending window */
-	int j, x, y;
-
-	while ((j = wgetch(sendwin)) != ERR) {
-	  if (j == 'U' - '@') {	/* ^U */
-	    wstandout(sendwin);
-	    waddstr(sendwin, "^U");
-	    wstandend(sendwin);
-	    waddch(sendwin, '\n');
-	    writebuff[0] = 0;
-	    writebufflen = 0;
-	  } else if (j == 'R' - '@') {	/* ^R */
-	    clearok(stdscr, TRUE);
-	    wnoutrefresh(stdscr);
-	    getyx(sendwin, y, x);
-	    wmove(sendwin, y, x);
-	  } else if (j == 'L' - '@') {	/* ^L */
-	    writebuff[0] = 0;
-	    writebufflen = 0;
-	    clear_windows(receivewin, sendwin);
-	  } else if (j == 8 || j == 127) {
-	    if (writebufflen) {
-	      getyx(sendwin, y, x);
-	      if (x == 0) {	/* we wrapped */
-		if (y == 0) {
-		  /* we are trying to backspace off the top of the window */
-		  /* so we reprint the line */
-		  waddstr(sendwin, writebuff);
-		  getyx(sendwin, y, x);
-		}
-		if (y > 0) {
-		  y -= 1;
-		  x = COLS;
-		}
-	      }
-	      wmove(sendwin, y, x - 1);
-	      waddch(sendwin, ' ');
-	      wmove(sendwin, y, x - 1);
-	      writebufflen--;
-	      writebuff[writebufflen] = 0;
-	    }
-	  } else if ((j < 128 && j > 32) || j == 10 || j == 13) {
-	    if (writebufflen == sizeof(writebuff)) {
-	      beep();
-	    } else {
-	      writebuff[writebufflen] = j;
-	      writebufflen++;
-	      waddch(sendwin, j);
-	    }
-	    writebuff[writebufflen] = 0;
+      if (need_resize && use_curses)
+	resize_windows();
+      n = 0;
+    }
+    for (i = 0; i < n; i++) {
+      if (evs[i].fd == conn->fd) {
+	if ((evs[i].events & EV_WRITE) && conn_flush(conn) < 0)
+	  fail(errno, "sending data to party");
+	if (!(evs[i].events & EV_READ))
+	  continue;
+	/* read what has arrived and handle every whole frame in it */
+	ret = conn_fill(conn);
+	if (ret == 0 && pipe_mode) {
+	  if (!pipe_done()) {
+	    fprintf(stderr, "connection closed before the end of the data\n");
+	    exit(1);
 	  }
-	  wnoutrefresh(sendwin);
+	  pipe_finish(conn);
 	}
-      }
-      if (writebufflen && (writebuff[writebufflen - 1] == '\n'
-			   || writebuff[writebufflen - 1] == '\r')) {
-	krb5_data msg, encmsg;
-
-	/* we have a whole line now, send it off */
-	msg.data = writebuff;
-	msg.length = writebufflen + 1;
-	writebufflen = 0;
-	debug_localseq(context, auth_context, "before");
-	ret = krb5_mk_priv(context, auth_context, &msg, &encmsg, NULL);
-	if (ret)
-	  fail(ret, "krb5_mk_priv");
-	debug_localseq(context, auth_context, "after");
-	ret = netwritedata(sockfd, encmsg.data, encmsg.length);
+	if (ret == 0)
+	  bye("connection closed");
+	if (ret < 0 && errno != EINTR && errno != EAGAIN)
+	  fail(errno, "reading chat data from network");
+	if (ret > 0)
+	  ping_heard();
+	while ((ret = conn_frame(conn, &frame)) > 0)
+	  receive_frame(context, conn, &frame);
 	if (ret < 0)
-	  fail(errno, "sending chat data to party");
-	free(encmsg.data);
+	  fail(errno, "reading chat data from network");
+      } else if (evs[i].fd == dgram_fd()) {
+	dgram_receive(conn);
+      } else if (pipe_mode && evs[i].fd == pipe_fd()) {
+	pipe_flush(conn);
+      } else if (evs[i].fd == fileno(stdin)) {
+	if (pipe_mode) {
+	  pipe_send_next(conn);
+	  continue;
+	}
+	typed = 1;
+	take_input(conn, &input_done);
       }
     }
-    if (use_curses)
-      doupdate();
-  }
-}
+    /* what was held for want of room goes once there is some */
+    if (input_held && !conn_congested(conn)) {
+      typed = 1;
+      take_input(conn, &input_done);
+    }
 
-int
-netread(int fd, char *ptr, int nbytes) {
-  int nleft, nread;
-
-  nleft = nbytes;
-  while (nleft > 0) {
-    nread = read(fd, ptr, nleft);
-    debug("read returned %d", nread);
-    if (nread < 0)
-      return nread;
-    else if (nread == 0)
-      break;
-    nleft -= nread;
-    ptr += nread;
+    /* keep a file moving while the bulk channel has room for it */
+    for (i = 0; i < XFER_BATCH && xfer_sending() && chan_bulk_room(conn)
+	   && !conn_congested(conn); i++)
+      xfer_send_next(conn);
+    pool_flush(conn);
+    receive_pooled(conn, 0);
+    if (chan_grant(conn) < 0)
+      fail(errno, "sending to party");
+    ping_tick(conn);
+    dgram_tick(conn);
+    show_backlog(conn);
+    show_zip(conn);
+    show_stats();
+    /* piped input has run out and everything has been sent */
+    if (input_done && !xfer_sending() && !conn_pending(conn)
+	&& !pool_jobs(conn->pool) && !dgram_pending())
+      bye("end of input");
+    /* in pipe mode, when both ways have ended and everything has gone */
+    if (pipe_mode && pipe_done() && !conn_pending(conn)
+	&& !pool_jobs(conn->pool))
+      pipe_finish(conn);
+
+    /* our own typing goes out first, the peer's text when a frame is due */
+    if (use_curses && typed)
+      paint();
+    drew = render_flush(0);
+    if (use_curses && (drew || !typed))
+      paint();
+    /* after the screen, so our own echo never waits on the network */
+    live_flush(conn, 0);
   }
-  return (nbytes - nleft);
 }
 
-int
-netwrite(int fd, char *ptr, int nbytes) {
-  int nleft, nwritten;
-
-  nleft = nbytes;
-  while (nleft > 0) {
-    nwritten = write(fd, ptr, nleft);
-    if (nwritten <= 0)
-      return (nwritten);
+/* send what the user has typed, until there is no more or no room */
+static void
+take_input(kconn *conn, int *input_done) {
+  char *text;
+  int ret, len;
 
-    nleft -= nwritten;
-    ptr += nwritten;
+  while ((ret = get_input(&text, &len)) != INPUT_NONE) {
+    if (ret == INPUT_EOF) {
+      ev_set(fileno(stdin), 0, NULL);
+      *input_done = 1;
+      break;
+    } else if (ret == INPUT_FILE) {
+      xfer_start(conn, text);
+    } else if (ret == INPUT_EDIT) {
+      /* if the batch is still stuck, the rest of the keys wait */
+      live_flush(conn, 1);
+      if (live_full())
+	break;
+    } else if (send_chat(conn, text, len) < 0) {
+      /* this piece is handed out again, and the rest wait behind it */
+      input_held = 1;
+      break;
+    }
   }
-  return (nbytes - nleft);
 }
 
-int
-netreadlen(int fd) {
-  char *ptr;
+/* decrypt and handle an incoming frame */
+void
+receive_frame(krb5_context context, kconn *conn, kframe *frame) {
+  krb5_data msg;
   int ret;
-  int off = 0;
 
-  ptr = malloc(1024);
+  if (frame->type == FRAME_ROOM) {
+    room_receive(context, frame);
+    return;
+  }
+  if (frame->type > FRAME_DGRAM) {
+    debug("ignoring frame of unknown type %d", frame->type);
+    return;
+  }
 
-  do {
-    ret = netread(fd, &ptr[off], 1);
-    if (ret < 0) {
-      free(ptr);
-      return -1;
-    }
-    if (ret == 0)
-      return 0;
-    if (ptr[off] == '\0')
-      break;
-    off++;
-  } while (off < 1024);
+  /* file data is opened on the pool's threads, and handled in order */
+  while ((ret = pool_open(conn, frame)) < 0)
+    receive_pooled(conn, 1);
+  if (ret)
+    return;
 
-  ret = atoi(ptr);
-  free(ptr);
-  return (ret);
+  ret = open_sealed(conn, frame, &msg);
+  if (ret)
+    fail(ret, "opening message");
+
+  if (frame->type == FRAME_ROOM_KEY) {
+    room_setkey(context, &msg);
+  } else if (frame->type == FRAME_EDIT || frame->type == FRAME_EDIT_ACK) {
+    live_receive(frame->type, &msg);
+  } else if (frame->type == FRAME_WINDOW) {
+    chan_window(conn, &msg);
+  } else if (frame->type == FRAME_PING || frame->type == FRAME_PONG) {
+    if (ping_receive(conn, frame->type, &msg) < 0)
+      fail(errno, "sending to party");
+  } else if (frame->type == FRAME_PIPE || frame->type == FRAME_PIPE_END) {
+    pipe_receive(conn, frame->type, &msg);
+  } else if (frame->type == FRAME_DGRAM_PORT) {
+    dgram_port(conn, &msg);
+  } else if (frame->type == FRAME_DGRAM) {
+    dgram_carried(conn, &msg);
+  } else if (frame->type != FRAME_DATA) {
+    xfer_receive(conn, frame->type, &msg);
+  } else {
+    receive_line(&msg);
+  }
+  done_sealed(conn, frame, &msg);
+  if (chan_consumed(conn, frame) < 0)
+    fail(errno, "sending to party");
 }
 
-int
-netwritedata(int fd, char *ptr, int nbytes) {
-  char len[1024];
-  int ret, sent = 0;
-
-  sprintf(len, "%i", nbytes);
-  ret = netwrite(fd, len, strlen(len) + 1);
-  if (ret < 0)
-    return ret;
-  sent += ret;
-
-  ret = netwrite(fd, ptr, nbytes);
-  if (ret < 0)
-    return ret;
-  sent += ret;
+/* handle what the pool has opened, in order; with wait, one at least */
+static void
+receive_pooled(kconn *conn, int wait) {
+  kframe frame;
+  krb5_data msg;
+
+  while (pool_opened(conn, &frame, &msg, wait) > 0) {
+    if (frame.type == FRAME_PIPE || frame.type == FRAME_PIPE_END)
+      pipe_receive(conn, frame.type, &msg);
+    else
+      xfer_receive(conn, frame.type, &msg);
+    if (chan_consumed(conn, &frame) < 0)
+      fail(errno, "sending to party");
+    wait = 0;
+  }
+}
 
-  return sent;
+/* a line of chat from the other party, however it came */
+void
+receive_line(krb5_data *msg) {
+  first_message();
+  render_text(msg->data, strnlen(msg->data, msg->length));
 }
 
+/*
+ * Send a line of chat; older peers expect the terminating NUL on the wire.
+ * Returns -1 if there is no room for it yet, and 0 once it has gone.
+ */
 int
-netreaddata(int fd, char **p) {
-  int i, ret;
-  char *ptr;
-
-  i = netreadlen(fd);
-  if (i == 0)
-    bye("connection closed");
-  if (i < 0 || i > 1024)
+send_chat(kconn *conn, char *buff, int len) {
+  buff[len] = '\0';
+  if (!dgram_send_line(conn, buff, len + 1)
+      && send_sealed(conn, FRAME_DATA, buff, len + 1) < 0) {
+    if (errno != ENOBUFS)
+      fail(errno, "sending chat data to party");
     return -1;
-
-  ptr = malloc(i);
-  ret = netread(fd, ptr, i);
-  if (ret <= 0) {
-    bye("connection closed");
   }
+  first_message();
+  log_record(LOG_SENT, buff, len);
+  return 0;
+}
 
-  *p = ptr;
+void
+kill_and_die(int sig) {
+  bye("exiting due to interrupt");
+}
 
-  return i;
+void
+window_change(int sig) {
+  need_resize = 1;
 }
 
 void
-send_connect_message(const char *recip, int port, char *execstr) {
-  char hostname[NS_MAXDNAME + 1];
-  ZNotice_t notice;
-  char *list[2];
-  char msg[2048];
-  char *sender, *foo;
-  int ret;
+fail(long err, const char *context) {
+  if (curs_start)
+    endwin();
+  fprintf(stderr, "%s: %s\n", context, error_message(err));
+  exit(1);
+}
 
-  gethostname(hostname, NS_MAXDNAME);
-  if (strcasecmp(&hostname[strlen(hostname) - 8], ".mit.edu") == 0)
-    hostname[strlen(hostname) - 8] = '\0';
+void
+bye(const char *message) {
+  if (curs_start)
+    endwin();
+  puts(message);
+  exit(0);
+}
 
-  ZInitialize();
+/*
+ * Without curses, take lines from stdin ourselves rather than through
+ * stdio, so nothing sits in a FILE buffer where the event loop cannot see
+ * it.  Each round of calls reads at most once, so it never blocks.
+ */
+static int
+get_line_input(char **text, int *len) {
+  static char inbuf[4096];
+  static int inlen = 0, tried = 0, eof = 0;
+  char *nl;
+  int n;
 
-  sender = strdup(ZGetSender());
-  foo = strstr(sender, "@ATHENA.MIT.EDU");
-  if (foo)
-    *foo = '\0';
+  for (;;) {
+    nl = memchr(inbuf, '\n', inlen);
+    n = nl ? nl - inbuf + 1 : inlen;
+    if (n > LINE_FLUSHLEN)
+      n = LINE_FLUSHLEN;
+    if (nl || n == LINE_FLUSHLEN || (eof && n)) {
+      memcpy(writebuff, inbuf, n);
+      writebuff[n] = 0;
+      writebufflen = n;
+      memmove(inbuf, inbuf + n, inlen - n);
+      inlen -= n;
+      line_ready = 1;
+      *text = writebuff;
+      *len = writebufflen;
+      return INPUT_LINE;
+    }
+    if (eof)
+      return INPUT_EOF;
+    if (tried) {
+      tried = 0;
+      return INPUT_NONE;
+    }
+    tried = 1;
+    n = read(fileno(stdin), inbuf + inlen, sizeof(inbuf) - inlen);
+    if (n == 0)
+      eof = 1;
+    else if (n > 0)
+      inlen += n;
+    else if (errno == EINTR || errno == EAGAIN)
+      return INPUT_NONE;
+    else
+      fail(errno, "reading from user");
+  }
+}
 
-  if (execstr) {
-    ret = fork();
-    if (ret < 0) {
-      fprintf(stderr, "could not fork to send connection message\n");
-    } else if (ret > 0) {
-      wait3(NULL, WNOHANG, NULL);
-      return;
-    } else {			/* ret == 0; child */
-      foo = malloc(10);
-      sprintf(foo, "%i", port);
-      ret = execlp(execstr, execstr, sender, hostname, foo, NULL);
-      if (ret) {
-	fprintf(stderr, "could not exec %s to send connection message\n",
-		execstr);
-	exit(1);
-      }
-    /*NOTREACHED*/}
+/* the message being sent, handed out a piece at a time */
+static char *msg = NULL;
+static size_t msglen = 0, msgpos = 0;
+
+static int
+next_piece(char **text, int *len) {
+  size_t n;
+
+  n = msglen - msgpos;
+  if (n > LINE_FLUSHLEN)
+    n = LINE_FLUSHLEN;
+  memcpy(writebuff, msg + msgpos, n);
+  writebuff[n] = 0;
+  writebufflen = n;
+  msgpos += n;
+  line_ready = 1;
+  *text = writebuff;
+  *len = writebufflen;
+  return INPUT_LINE;
+}
+
+/* keys that move about in, or cut up, the message being typed */
+static void
+edit_key(int j) {
+  size_t c = ed_cursor();
+
+  switch (j) {
+  case 8:
+  case 127:
+    ed_backspace();
+    break;
+  case 'D' - '@':
+  case KEY_DC:
+    ed_delete();
+    break;
+  case 'W' - '@':
+    ed_kill_word();
+    break;
+  case 'K' - '@':
+    ed_kill_line();
+    break;
+  case 'U' - '@':
+    ed_clear();
+    break;
+  case 'O' - '@':		/* a new line without sending */
+    ed_insert('\n');
+    break;
+  case 'A' - '@':
+  case KEY_HOME:
+    ed_move(ed_line_start(c));
+    break;
+  case 'E' - '@':
+  case KEY_END:
+    ed_move(ed_line_end(c));
+    break;
+  case KEY_LEFT:
+    if (c > 0)
+      ed_move(c - 1);
+    break;
+  case KEY_RIGHT:
+    ed_move(c + 1);
+    break;
+  case KEY_UP:
+    ed_updown(-1);
+    break;
+  case KEY_DOWN:
+    ed_updown(1);
+    break;
   }
+}
 
-  snprintf(msg, 2048,
-	   "This user is requesting a krb5 user to user encrypted communication channel.\n"
-	   "To open the channel type:\n"
-	   "\n   add ktools\n"
-	   "   ktalk %s %s %i\n"
-	   "\nat the Athena%% prompt.\n", sender, hostname, port);
+/*
+ * Read what the user has typed.  Returns INPUT_LINE with a line (or a long
+ * piece of one) to send, INPUT_FILE with the name of a file to send,
+ * INPUT_EDIT when live keystrokes should go out before reading more,
+ * INPUT_EOF at the end of input without curses, or INPUT_NONE once there
+ * is nothing more to read.  What is handed back stays good until the
+ * next call.
+ */
+int
+get_input(char **text, int *len) {
+  char prompt[sizeof(filebuff) + 16];
+  int j, full = 0;
+
+  /* the last line handed out did not go, so it is handed out again */
+  if (input_held) {
+    input_held = 0;
+    *text = writebuff;
+    *len = writebufflen;
+    return INPUT_LINE;
+  }
 
-  free(sender);
+  /* otherwise it has been sent by now */
+  if (line_ready) {
+    line_ready = 0;
+    writebufflen = 0;
+    writebuff[0] = 0;
+  }
 
-  memset(&notice, 0, sizeof(notice));
-  notice.z_kind = ACKED;
-  notice.z_class = "message";
-  notice.z_class_inst = "personal";
-  notice.z_recipient = (char *)recip;
-  notice.z_default_format =
-      "Class $class, Instance $instance:\nTo: @bold($recipient) at $time $date\nFrom: @bold{$1 <$sender>}\n\n$2";
-  notice.z_sender = ZGetSender();
-  notice.z_opcode = "";
+  if (!use_curses)
+    return get_line_input(text, len);
 
-  list[0] = "Advertise here";
-  list[1] = msg;
+  /* a long message goes out a piece at a time, then makes way */
+  if (msg) {
+    if (msgpos < msglen)
+      return next_piece(text, len);
+    msg = NULL;
+    ed_commit();
+  }
 
-  ZSendList(&notice, list, 2, ZAUTH);
-  ZFreeNotice(&notice);
+  /* read from the sending window; live keys wait while a batch is stuck */
+  while (!(live_mode && live_full()) && (j = wgetch(sendwin)) != ERR) {
+    TRACE(TR_KEY, j, 0, 0);
+    if (filebufflen < 0 && scroll_key(j))
+      continue;
+    if (j == KEY_BACKSPACE)
+      j = 127;
+    if (filebufflen >= 0) {
+      /* reading the name of a file to send */
+      if (j == 10 || j == 13) {
+	filebufflen = -1;
+	set_status(STATUS_PROMPT, NULL);
+	*text = filebuff;
+	*len = strlen(filebuff);
+	ed_draw();
+	return INPUT_FILE;
+      } else if (j == 'G' - '@' || j == 27) {
+	filebufflen = -1;
+	set_status(STATUS_PROMPT, NULL);
+	continue;
+      } else if (j == 8 || j == 127) {
+	if (filebufflen)
+	  filebufflen--;
+      } else if (j >= 32 && j < 127 && filebufflen < sizeof(filebuff) - 1) {
+	filebuff[filebufflen++] = j;
+      }
+      filebuff[filebufflen] = 0;
+      snprintf(prompt, sizeof(prompt), "send file: %s", filebuff);
+      set_status(STATUS_PROMPT, prompt);
+    } else if (j == 'F' - '@') {	/* ^F */
+      filebufflen = 0;
+      filebuff[0] = 0;
+      set_status(STATUS_PROMPT, "send file: ");
+    } else if (j == 'R' - '@') {	/* ^R */
+      clearok(stdscr, TRUE);
+      wnoutrefresh(stdscr);
+    } else if (j == 'L' - '@') {	/* ^L */
+      ed_clear();
+      clear_windows(receivewin, sendwin);
+      ed_reset();
+    } else if (j == 10 || j == 13) {
+      ed_move(ed_len());
+      ed_insert('\n');
+      msg = ed_text(&msglen);
+      scroll_add(SCROLL_SENT, msg, msglen);
+      if (live_mode) {
+	log_record(LOG_SENT, msg, msglen);
+	/* the keys have gone out already, so just start a new line */
+	full = live_key(j);
+	msg = NULL;
+	ed_commit();
+      } else {
+	msgpos = 0;
+	ed_draw();
+	return next_piece(text, len);
+      }
+    } else if (live_mode) {
+      /* the other side only knows typing and rubbing out at the end */
+      if (j == 'U' - '@') {
+	ed_clear();
+	full = live_key(j);
+      } else if (j == 8 || j == 127) {
+	ed_move(ed_len());
+	if (ed_backspace())
+	  full = live_key(j);
+      } else if (j >= 32 && j < 127) {
+	ed_move(ed_len());
+	ed_insert(j);
+	full = live_key(j);
+      }
+    } else if (j >= 32 && j < 127) {
+      ed_insert(j);
+    } else {
+      edit_key(j);
+    }
+    if (full)
+      break;
+  }
+  ed_draw();
+  return full || (live_mode && live_full()) ? INPUT_EDIT : INPUT_NONE;
 }
 
 void
-kill_and_die(int sig) {
-  bye("exiting due to interrupt");
+setup_screen(const char *startupmsg) {
+  if (!use_curses)
+    return;
+
+  initscr();
+  cbreak();
+  noecho();
+  intrflush(stdscr, FALSE);
+  keypad(stdscr, TRUE);
+  nodelay(stdscr, 1);
+  clear();
+  refresh();
+  curs_start = 1;
+
+  writebufflen = 0;
+
+  /* setup send / receive windows and the seperator */
+  receivewin = newwin(receive_height(), COLS, 0, 0);
+  sepwin = newwin(1, COLS, receive_height(), 0);
+  sendwin = newwin(send_height(), COLS, receive_height() + 1, 0);
+
+  nodelay(sendwin, 1);
+  keypad(sendwin, TRUE);
+  idlok(sendwin, 1);
+  scrollok(sendwin, 1);
+  idlok(receivewin, 1);
+  scrollok(receivewin, 1);
+
+  whline(sepwin, ACS_HLINE, COLS);
+  wnoutrefresh(sepwin);
+
+  clear_windows(receivewin, sendwin);
+
+  wstandout(receivewin);
+  waddstr(receivewin, startupmsg);
+  wstandend(receivewin);
+
+  scroll_init();
+  scroll_add(SCROLL_NOTICE, startupmsg, strlen(startupmsg));
+  doupdate();
 }
 
 void
-window_change(int sig) {
-  need_resize = 1;
-}
+resize_windows(void) {
+  need_resize = 0;
 
-void
-auth_con_setup(krb5_context context, krb5_auth_context * auth_context,
-	       krb5_address * local_address, krb5_address * foreign_address) {
-  int ret;
+  endwin();
+  refresh();
 
-  /* initialize the auth_context */
-  ret = krb5_auth_con_init(context, auth_context);
-  if (ret)
-    fail(ret, "krb5_auth-con_init");
+  wresize(receivewin, receive_height(), COLS);
 
-  ret =
-      krb5_auth_con_setflags(context, *auth_context,
-			     KRB5_AUTH_CONTEXT_DO_SEQUENCE);
-  if (ret)
-    fail(ret, "krb5_auth_con_setflags");
+  mvwin(sepwin, receive_height(), 0);
+  wresize(sepwin, 1, COLS);
 
-  ret =
-      krb5_auth_con_setaddrs(context, *auth_context, local_address,
-			     foreign_address);
-  if (ret)
-    fail(ret, "krb5_auth_con_setaddrs");
-}
+  mvwin(sendwin, receive_height() + 1, 0);
+  wresize(sendwin, send_height(), COLS);
 
-void
-debug_remoteseq(krb5_context context, krb5_auth_context auth_context,
-		const char *whence) {
-  krb5_int32 seqnumber;
-  int ret;
+  clear_windows(receivewin, sendwin);
+  ed_reset();
+  ed_draw();
+  scroll_repaint();
 
-  if (debug_flag) {
-    ret = krb5_auth_con_getremoteseqnumber(context, auth_context, &seqnumber);
-    if (ret)
-      fail(ret, "krb5_auth_con_getremoteseqnumber");
-    debug("%s remote seq is %i", whence, seqnumber);
-  }
+  draw_status();
 }
 
+/* tell the user something, in standout in the receive window */
 void
-debug_localseq(krb5_context context, krb5_auth_context auth_context,
-	       const char *whence) {
-  krb5_int32 seqnumber;
-  int ret;
+notice(const char *format, ...) {
+  va_list ap;
+  char buf[1024];
+
+  va_start(ap, format);
+  vsnprintf(buf, sizeof(buf), format, ap);
+  va_end(ap);
+  log_record(LOG_NOTICE, buf, strlen(buf));
 
-  if (debug_flag) {
-    ret = krb5_auth_con_getlocalseqnumber(context, auth_context, &seqnumber);
-    if (ret)
-      fail(ret, "krb5_auth_con_getlocalseqnumber");
-    debug("%s local seq is %i", whence, seqnumber);
+  if (curs_start) {
+    render_sync();
+    scroll_add(SCROLL_NOTICE, buf, strlen(buf));
+    scroll_add(SCROLL_NOTICE, "\n", 1);
+    if (scroll_active())
+      return;
+    wstandout(receivewin);
+    waddstr(receivewin, buf);
+    wstandend(receivewin);
+    waddch(receivewin, '\n');
+    wnoutrefresh(receivewin);
+  } else {
+    fprintf(stderr, "%s\n", buf);
   }
 }
 
+/* set one part of the seperator line; NULL clears it */
 void
-sockaddr_to_krb5_address(krb5_address * k5, struct sockaddr *sock) {
-  switch (sock->sa_family) {
-  case AF_INET:
-    {
-      struct sockaddr_in *sin = (struct sockaddr_in *)sock;
-
-      k5->addrtype = ADDRTYPE_INET;
-      k5->length = sizeof(sin->sin_addr);
-      k5->contents = malloc(k5->length);
-      memcpy(k5->contents, &sin->sin_addr, k5->length);
-    }
-    break;
-  default:
-    fprintf(stderr, "can't copy address");	/* XXX */
-    break;
-  }
+set_status(int slot, const char *text) {
+  if (!text)
+    text = "";
+  if (!strcmp(statusfields[slot], text))
+    return;
+  snprintf(statusfields[slot], sizeof(statusfields[slot]), "%s", text);
+  draw_status();
 }
 
-int
-server_open(const char *user, struct sockaddr_in *faddr, char *execstr) {
-  int ret, servsock;
-  unsigned short port = 2050;
-  struct sockaddr_in laddr;
-  size_t faddrlen;
-  int fd;
-
-  /* start listening on the first port we can find */
-  port = 2050;
-  servsock = socket(AF_INET, SOCK_STREAM, 0);
-  if (servsock < 0)
-    fail(errno, "creating socket");
-
-  memset(&laddr, 0, sizeof(laddr));
-  laddr.sin_family = AF_INET;
-  laddr.sin_addr.s_addr = htonl(INADDR_ANY);
-  laddr.sin_port = htons(port);
-
-  while ((ret = bind(servsock, (struct sockaddr *)&laddr, sizeof(laddr))) != 0) {
-    if (errno == EADDRINUSE) {
-      port++;
-      laddr.sin_port = htons(port);
-    } else {
-      fail(errno, "binding address");
-    }
+void
+draw_status(void) {
+  char buf[1024];
+  int i;
+
+  if (!curs_start)
+    return;
+  buf[0] = '\0';
+  for (i = 0; i < STATUS_SLOTS; i++) {
+    if (!statusfields[i][0])
+      continue;
+    if (buf[0])
+      strncat(buf, " | ", sizeof(buf) - strlen(buf) - 1);
+    strncat(buf, statusfields[i], sizeof(buf) - strlen(buf) - 1);
   }
-
-  ret = listen(servsock, 5);
-  if (ret < 0)
-    fail(errno, "listening for connection");
-
-  send_connect_message(user, port, execstr);
-
-  printf("waiting for connection on port %i .... \n", port);
-  memset(faddr, 0, sizeof(faddr));
-  faddrlen = sizeof(*faddr);
-  fd = accept(servsock, (struct sockaddr *)faddr, &faddrlen);
-  if (fd < 0)
-    fail(errno, "accepting connection");
-
-  close(servsock);
-
-  return fd;
+  werase(sepwin);
+  mvwhline(sepwin, 0, 0, ACS_HLINE, COLS);
+  if (buf[0])
+    mvwprintw(sepwin, 0, 2, " %.*s ", COLS > 6 ? COLS - 6 : 0, buf);
+  wnoutrefresh(sepwin);
 }
 
-int
-client_open(const char *user, const char *host, unsigned short port,
-	    struct sockaddr_in *faddr) {
-  int fd, ret;
-  extern int h_errno;
-  struct hostent *fhent;
-
-  fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (fd < 0)
-    fail(errno, "creating socket");
-
-  fhent = gethostbyname(host);
-  if (!fhent) {
-    fprintf(stderr, "%s: %s\n", host, hstrerror(h_errno));
-    exit(1);
+/* let the user know when output is backing up behind a slow peer */
+void
+show_backlog(kconn *conn) {
+  char buf[64];
+
+  if (conn_congested(conn)) {
+    snprintf(buf, sizeof(buf), "waiting for the network, %luK queued",
+	     (unsigned long)(conn_pending(conn) / 1024));
+    set_status(STATUS_NET, buf);
+  } else {
+    set_status(STATUS_NET, NULL);
   }
-  memset(faddr, 0, sizeof(faddr));
-  memcpy(&faddr->sin_addr, fhent->h_addr, sizeof(struct in_addr));
-  faddr->sin_family = AF_INET;
-  faddr->sin_port = htons(port);
+}
 
-  ret = connect(fd, (struct sockaddr *)faddr, sizeof(*faddr));
-  if (ret != 0)
-    fail(errno, "connecting");
+/* what compression has saved so far, and what it has cost */
+void
+show_zip(kconn *conn) {
+#ifdef HAVE_LIBZ
+  char buf[64];
 
-  return fd;
+  if (conn->zip && zip_stats(conn->zip, buf, sizeof(buf)))
+    set_status(STATUS_ZIP, buf);
+#endif
 }
 
+/* timings in the separator line, with -v */
 void
-fail(long err, const char *context) {
-  if (curs_start)
-    endwin();
-  fprintf(stderr, "%s: %s\n", context, error_message(err));
-  exit(1);
+show_stats(void) {
+  char buf[128];
+
+  stat_poll();
+  if (show_timings && stat_summary(buf, sizeof(buf)))
+    set_status(STATUS_STATS, buf);
 }
 
+/* put the screen right, timing the terminal */
 void
-bye(const char *message) {
-  if (curs_start)
-    endwin();
-  puts(message);
-  exit(0);
+paint(void) {
+  long long start = now_usec();
+
+  doupdate();
+  stat_time(ST_PAINT, start);
+  TRACE(TR_PAINT, 0, now_usec() - start, 0);
 }
 
 void
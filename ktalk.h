@@ -0,0 +1,569 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#ifndef KTALK_H
+#define KTALK_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <krb5.h>
+#include <curses.h>
+
+typedef enum {
+  MODE_SERVER, MODE_CLIENT, MODE_ROOM, MODE_DAEMON, MODE_ATTACH
+} ktalk_mode;
+
+/*
+ * Wire framing.  The original protocol sends each message as an ascii
+ * decimal length terminated by a NUL, followed by that many bytes.  Peers
+ * that both understand it switch to a fixed binary header after the
+ * handshake:
+ *
+ *   0        4      5       6         7          8
+ *   | length | type | flags | channel | reserved |
+ *
+ * with the length in network byte order and not counting the header.
+ * The channel is 0 unless both ends offer "chan"; see chan.c.
+ */
+#define FRAMING_ASCII	0
+#define FRAMING_BINARY	1
+
+#define FRAME_HDRLEN	8
+#define FRAME_MAXLEN	65536	/* largest binary frame body we accept */
+#define ASCII_MAXLEN	1024	/* largest ascii frame body we accept */
+#define ASCII_LENMAX	1024	/* longest ascii length prefix */
+
+#define FRAME_DATA	0	/* krb5_mk_priv protected chat text */
+#define FRAME_FILE_BEGIN 1	/* transfer id, size and name of a file */
+#define FRAME_FILE_DATA	2	/* next chunk of the file being sent */
+#define FRAME_FILE_END	3	/* transfer id and status, 0 if complete */
+#define FRAME_FILE_CANCEL 4	/* receiver refuses or abandons a transfer */
+#define FRAME_ROOM_KEY	5	/* key epoch, enctype and the room key */
+#define FRAME_ROOM	6	/* key epoch and a line under the room key */
+#define FRAME_EDIT	7	/* keystrokes typed in live mode */
+#define FRAME_EDIT_ACK	8	/* echoes the time of a drawn edit */
+#define FRAME_WINDOW	9	/* bulk bytes taken so far, see chan.c */
+#define FRAME_PING	10	/* the sender's clock, see ping.c */
+#define FRAME_PONG	11	/* and the same back */
+#define FRAME_PIPE	12	/* bytes from stdin, see pipe.c */
+#define FRAME_PIPE_END	13	/* and the end of them */
+#define FRAME_DGRAM_PORT 14	/* our UDP port, see dgram.c */
+#define FRAME_DGRAM	15	/* a datagram that did not get through */
+
+#define FRAME_F_FAST	0x01	/* body is under the fast path keys, see fast.c */
+
+#define XFER_CHUNK	32768	/* file data per frame, before sealing */
+
+/*
+ * Logical channels.  Each frame type travels on one, and each has its own
+ * output queue and its own fast path sequence numbers, so a chat line can
+ * go ahead of file data that was sealed before it.  Queues are served
+ * most urgent first, in the order below.
+ */
+#define CHAN_CHAT	0	/* chat, typing, and everything before channels */
+#define CHAN_BULK	1	/* files being sent */
+#define CHAN_CTL	2	/* flow control and keepalive */
+#define CHAN_COUNT	3
+
+#define CHAN_WINDOW	(256 * 1024)	/* bulk bytes the peer has not taken */
+#define CHAN_LOWAT	16384	/* unsent bytes the socket may hold */
+
+#define CONN_WBUF_HIGH	(256 * 1024)	/* no more bulk data past this */
+#define CONN_WBUF_MAX	(1024 * 1024)	/* never queue more than this */
+#define CONN_RBUF_MIN	4096	/* read buffer to start with */
+#define SEAL_SLOP	1024	/* more than krb5_mk_priv ever adds */
+
+/*
+ * Capabilities are advertised after the ascii length of the handshake
+ * frames ("123 bin"), where atoi() in older peers stops reading.  The
+ * server offers its set with the ticket and the client answers with the
+ * subset it also supports.
+ */
+#define CAP_BINARY	0x0001
+#define CAP_FILE	0x0002
+#define CAP_ROOM	0x0004
+#define CAP_LIVE	0x0008
+#define CAP_FAST	0x0010
+#define CAP_ZLIB	0x0020	/* only with -z, see zip.c */
+#define CAP_CHAN	0x0040	/* logical channels, with CAP_FAST only */
+#define CAP_PING	0x0080	/* keepalive, with CAP_CHAN only */
+#define CAP_PIPE	0x0100	/* only with -P, see pipe.c */
+#define CAP_DGRAM	0x0200	/* only with -u, and CAP_FAST, see dgram.c */
+
+#define ROOM_MAX	32	/* members in a room, not counting the host */
+#define DAEMON_PORT	2050	/* where ktalk -D listens unless told */
+#define KU_ROOM		1024	/* key usage for lines under the room key */
+#define KU_FAST		1026	/* key usage for fast path frames */
+#define KU_LOG		1028	/* key usage for sealed transcript records */
+#define KU_DGRAM	1030	/* key usage for datagrams */
+
+typedef struct kframe {
+  int type;
+  int flags;
+  int chan;
+  unsigned int caps;		/* capabilities carried by an ascii prefix */
+  char *data;			/* points into the connection's read buffer */
+  size_t len;
+} kframe;
+
+typedef struct kqueue {
+  char *buf;
+  size_t size, start, end;
+} kqueue;
+
+typedef struct ktransport ktransport;
+typedef struct ksecops ksecops;
+typedef struct kzip kzip;
+typedef struct kpool kpool;
+typedef struct kfast kfast;
+
+typedef struct kconn {
+  int fd;
+  const ktransport *transport;
+  int framing;
+  unsigned int caps;		/* capabilities agreed with the peer */
+  char *rbuf;			/* buffered input, reused for every frame */
+  size_t rbufsize, rstart, rend;
+  kqueue wq[CHAN_COUNT];	/* output the socket has not taken yet */
+  int wchan;			/* the channel being written from */
+  size_t wleft;			/* and what is left of its frame */
+  int bulk_waiting;		/* bulk frames queued but not started */
+  unsigned long long bulk_sent, bulk_acked;	/* the bulk window */
+  unsigned long long bulk_read, bulk_granted;
+  int bulk_held;		/* grant no more window for now */
+  int nonblock;
+  const ksecops *sec;		/* how frames are sealed, see sec.c */
+  void *secstate;
+  kzip *zip;			/* compression, if agreed */
+  kpool *pool;			/* threads for bulk crypto, if any */
+} kconn;
+
+/*
+ * A transport gets the session a file descriptor, and can say what krb5
+ * addresses the two ends have.
+ */
+struct ktransport {
+  const char *name;
+  int (*addresses)(int fd, krb5_address *local, krb5_address *foreign);
+};
+
+/*
+ * A security backend seals frames on the way out and opens them on the
+ * way in.  What open hands back is good until done is called with it.
+ */
+struct ksecops {
+  const char *name;
+  int (*seal)(kconn *c, int type, const char *data, size_t len);
+  krb5_error_code (*open)(kconn *c, kframe *f, krb5_data *msg);
+  void (*done)(kconn *c, kframe *f, krb5_data *msg);
+  void (*release)(kconn *c);
+};
+
+/*
+ * What either half of the krb5 handshake can have ready before there is
+ * a connection, so it can be got while the connection is being made.
+ */
+typedef struct kprep {
+  int server;			/* which half this is for */
+  krb5_context context;
+  krb5_ccache ccache;
+  char *me;			/* our principal */
+  krb5_auth_context auth_context;	/* no addresses yet */
+  krb5_creds *tgt;		/* the server's, to send the client */
+} kprep;
+
+/*
+ * A notifier tells the people we wait for where to connect.  announce()
+ * returns 0 once recip has been told, NOTIFY_AGAIN if it may work on
+ * another try, or NOTIFY_FAILED if it never will.
+ */
+#define NOTIFY_AGAIN	1
+#define NOTIFY_FAILED	2
+
+typedef struct knotifier {
+  const char *name;
+  int (*announce)(const char *recip, int port, const char *arg);
+} knotifier;
+
+#define EV_READ		0x1
+#define EV_WRITE	0x2
+
+typedef struct kev {
+  int fd;
+  int events;
+  void *data;
+} kev;
+
+/* ktalk.c */
+extern int sockfd, curs_start, use_curses, debug_flag;
+extern int need_resize;
+extern int show_timings;
+
+void debug(const char *format, ...);
+void fail(long err, const char *context);
+void bye(const char *message);
+extern WINDOW *sendwin, *receivewin, *sepwin;
+
+#define STATUS_PROMPT	0	/* reading a file name */
+#define STATUS_XFER	1	/* file transfer progress */
+#define STATUS_NET	2	/* output waiting on the network */
+#define STATUS_LIVE	3	/* live typing latency */
+#define STATUS_SCROLL	4	/* scrolled back, or searching */
+#define STATUS_ZIP	5	/* what compression has saved */
+#define STATUS_PING	6	/* round trip time and throughput */
+#define STATUS_STATS	7	/* timings, with -v */
+#define STATUS_SLOTS	8
+
+#define INPUT_NONE	0
+#define INPUT_LINE	1
+#define INPUT_FILE	2
+#define INPUT_EDIT	3	/* live keystrokes to send before reading on */
+#define INPUT_EOF	4
+
+void notice(const char *format, ...);
+void set_status(int slot, const char *text);
+void draw_status(void);
+void show_backlog(kconn *conn);
+void show_zip(kconn *conn);
+void show_stats(void);
+void paint(void);
+int get_input(char **text, int *len);
+void setup_screen(const char *startupmsg);
+void resize_windows(void);
+int send_chat(kconn *conn, char *buff, int len);
+void receive_line(krb5_data *msg);
+
+/* frame.c */
+extern unsigned int local_caps;
+
+void conn_init(kconn *c, int fd, const ktransport *transport);
+void conn_free(kconn *c);
+int conn_nonblock(kconn *c);
+size_t conn_buffered(kconn *c);
+void conn_shrink(kconn *c);
+size_t conn_pending(kconn *c);
+int conn_congested(kconn *c);
+int conn_full(kconn *c, size_t len);
+int conn_flush(kconn *c);
+int conn_fill(kconn *c);
+int conn_frame(kconn *c, kframe *f);
+void conn_unframe(kconn *c, kframe *f);
+int conn_readframe(kconn *c, kframe *f);
+void conn_agree(kconn *c);
+int conn_send(kconn *c, int type, int flags, const char *data, size_t len);
+int conn_send_ascii(kconn *c, const char *data, size_t len,
+		    unsigned int caps);
+int netwritev(int fd, struct iovec *iov, int iovcnt);
+void put32(unsigned char *p, krb5_ui_4 v);
+krb5_ui_4 get32(const unsigned char *p);
+void put64(unsigned char *p, long long v);
+long long get64(const unsigned char *p);
+void caps_format(unsigned int caps, char *buf, size_t buflen);
+unsigned int caps_parse(const char *s);
+
+/* chan.c */
+int frame_chan(kconn *c, int type);
+int chan_bulk_room(kconn *c);
+int chan_consumed(kconn *c, kframe *f);
+int chan_grant(kconn *c);
+void chan_window(kconn *c, krb5_data *msg);
+
+/* dgram.c */
+void dgram_start(kconn *c);
+int dgram_fd(void);
+int dgram_pending(void);
+void dgram_port(kconn *c, krb5_data *msg);
+int dgram_send_line(kconn *c, const char *data, size_t len);
+void dgram_receive(kconn *c);
+void dgram_carried(kconn *c, krb5_data *msg);
+int dgram_timeout(void);
+void dgram_tick(kconn *c);
+
+/* ev.c */
+void ev_init(void);
+void ev_set(int fd, int events, void *data);
+int ev_wait(kev *evs, int maxevs, int timeout);
+int ev_sooner(int a, int b);
+int set_nonblock(int fd);
+int set_nodelay(int fd);
+int set_lowat(int fd, int bytes);
+long long now_usec(void);
+
+/* net.c */
+extern const ktransport transport_tcp, transport_pair, transport_unix;
+extern int connect_timeout;
+
+int tcp_bind(unsigned short *port, int walk);
+int tcp_listen(char **users, int nusers, const knotifier *nf,
+	       const char *nfarg);
+int tcp_accept(int servsock, const char *user);
+int tcp_connect(const char *host, unsigned short port);
+void pair_open(int fds[2]);
+
+/* notify.c */
+extern const knotifier notify_zephyr, notify_exec, notify_file, notify_none;
+extern int notify_timeout;
+
+void notify_start(const knotifier *nf, char **users, int nusers, int port,
+		  const char *arg);
+int notify_finished(void);
+int notify_pending(void);
+const char *notify_command(void);
+
+/* sec.c */
+void auth_con_new(krb5_context context, krb5_auth_context * auth_context);
+int auth_con_addrs(krb5_context context, krb5_auth_context auth_context,
+		   kconn *conn);
+int auth_con_setup(krb5_context context, krb5_auth_context * auth_context,
+		   kconn *conn);
+krb5_creds *get_tgt_creds(krb5_context context, krb5_ccache ccache);
+krb5_error_code read_apreq(krb5_context context,
+			   krb5_auth_context * auth_context, kframe *frame,
+			   char **principal);
+void sec_krb5_attach(kconn *conn, krb5_context context,
+		     krb5_auth_context auth_context);
+void sec_krb5_fast(kconn *conn, int initiator);
+kfast *sec_krb5_kfast(kconn *conn, krb5_context *context);
+void sec_krb5_prepare(kprep *p);
+void sec_krb5_server(kconn *conn, kprep *p, const char *peer,
+		     char *startupmsg);
+void sec_krb5_client(kconn *conn, kprep *p, const char *peer);
+void sec_local_attach(kconn *conn);
+#ifdef KTALK_NULL_CIPHER
+void sec_null_attach(kconn *conn);
+#endif
+int send_sealed(kconn *conn, int type, const char *data, size_t len);
+krb5_error_code open_sealed(kconn *conn, kframe *frame, krb5_data *msg);
+void done_sealed(kconn *conn, kframe *frame, krb5_data *msg);
+
+/* xfer.c */
+extern char *recv_dir;
+
+int xfer_start(kconn *conn, const char *path);
+int xfer_sending(void);
+void xfer_send_next(kconn *conn);
+void xfer_receive(kconn *conn, int type, krb5_data *msg);
+
+/* live.c */
+extern int live_mode, live_window;
+
+int live_full(void);
+int live_key(int c);
+int live_timeout(void);
+void live_flush(kconn *conn, int force);
+void live_receive(int type, krb5_data *msg);
+
+/* ping.c */
+extern int ping_secs;
+
+void ping_start(kconn *c);
+void ping_heard(void);
+int ping_timeout(void);
+void ping_tick(kconn *c);
+int ping_receive(kconn *c, int type, krb5_data *msg);
+
+/* pipe.c */
+extern int pipe_mode;
+
+void pipe_setup(void);
+void pipe_start(kconn *c);
+int pipe_wants_input(kconn *c);
+void pipe_send_next(kconn *c);
+void pipe_receive(kconn *c, int type, krb5_data *msg);
+void pipe_watch(void);
+int pipe_fd(void);
+void pipe_flush(kconn *c);
+int pipe_done(void);
+void pipe_finish(kconn *c);
+
+/* render.c */
+extern int render_rate;
+
+void render_text(const char *text, size_t len);
+void render_sync(void);
+int render_timeout(void);
+int render_flush(int force);
+
+/* edit.c */
+size_t ed_len(void);
+size_t ed_cursor(void);
+void ed_move(size_t pos);
+void ed_insert(int c);
+int ed_backspace(void);
+void ed_delete(void);
+int ed_kill_word(void);
+void ed_kill_line(void);
+void ed_clear(void);
+size_t ed_line_start(size_t pos);
+size_t ed_line_end(size_t pos);
+void ed_updown(int dir);
+void ed_reset(void);
+void ed_draw(void);
+char *ed_text(size_t *len);
+void ed_commit(void);
+
+/* scroll.c */
+#define SCROLL_RECV	0	/* from the other party */
+#define SCROLL_SENT	1	/* typed by us */
+#define SCROLL_NOTICE	2	/* from ktalk itself */
+
+extern int scroll_kbytes;
+
+void scroll_init(void);
+void scroll_add(int kind, const char *text, size_t len);
+void scroll_erase(void);
+int scroll_active(void);
+int scroll_key(int c);
+void scroll_repaint(void);
+
+/* cache.c */
+int private_dir(char *dir, size_t len, int create);
+krb5_creds *get_uu_creds(krb5_context context, krb5_ccache ccache,
+			 const char *peer, krb5_data *tkt);
+
+/* fast.c */
+kfast *fast_start(krb5_context context, krb5_auth_context auth_context,
+		  int initiator);
+void fast_free(krb5_context context, kfast *f);
+int fast_send(krb5_context context, kfast *f, kconn *conn, int type,
+	      const char *data, size_t len);
+krb5_error_code fast_open(krb5_context context, kfast *f, kframe *frame,
+			  krb5_data *msg);
+krb5_key fast_key(krb5_context context, kfast *f, int send);
+void fast_seal_body(krb5_context context, krb5_key key, kfast *f, int type,
+		    long long seq, char *body, size_t len,
+		    unsigned int padlen);
+krb5_error_code fast_claim(kfast *f, kframe *frame, long long *seq);
+krb5_error_code fast_open_body(krb5_context context, krb5_key key, int type,
+			       long long seq, char *body, size_t len,
+			       krb5_data *msg);
+size_t fast_dgram_seal(krb5_context context, kfast *f, int type, long long seq,
+		       const char *data, size_t len, char *buf,
+		       size_t bufsize);
+krb5_error_code fast_dgram_open(krb5_context context, kfast *f, char *buf,
+				size_t len, int *type, long long *seq,
+				krb5_data *msg);
+
+/* pool.c */
+extern int pool_workers;
+
+kpool *pool_start(kfast *f);
+void pool_free(kpool *p);
+int pool_fd(kpool *p);
+int pool_jobs(kpool *p);
+size_t pool_reserved(kpool *p);
+int pool_room(kconn *c);
+int pool_seal(kconn *c, int type, long long seq, const char *data,
+	      size_t len, size_t off, unsigned int padlen, size_t need);
+void pool_flush(kconn *c);
+int pool_open(kconn *c, kframe *f);
+int pool_opened(kconn *c, kframe *f, krb5_data *msg, int wait);
+
+/* room.c */
+void room_host(krb5_context context, krb5_ccache ccache, char **users,
+	       int nusers, const knotifier *nf, const char *nfarg,
+	       const char *me);
+void room_setkey(krb5_context context, krb5_data *msg);
+void room_receive(krb5_context context, kframe *frame);
+
+/* daemon.c */
+void daemon_run(krb5_context context, krb5_ccache ccache,
+		unsigned short port);
+unsigned int daemon_attach(kconn *conn, const char *user,
+			   const knotifier *nf, const char *nfarg,
+			   char *startupmsg);
+
+/* log.c */
+#define LOG_RECV	0	/* from the other side */
+#define LOG_SENT	1	/* from us */
+#define LOG_NOTICE	2	/* from ktalk itself */
+
+void log_open(const char *dir, const char *peer, const char *keytab);
+void log_record(int kind, const char *text, size_t len);
+void log_dump(const char *path, const char *keytab);
+
+/* stats.c */
+#define ST_INIT		0	/* krb5_init_context and the ccache */
+#define ST_TGS		1	/* getting a user to user ticket from the KDC */
+#define ST_RDREQ	2	/* krb5_rd_req */
+#define ST_SEAL		3	/* sealing a frame */
+#define ST_OPEN		4	/* opening one */
+#define ST_READ		5	/* bytes a read() got */
+#define ST_WRITE	6	/* bytes a write() took */
+#define ST_RENDER	7	/* drawing incoming text */
+#define ST_PAINT	8	/* doupdate() */
+#define ST_READY	9	/* from starting to the end of the handshake */
+#define ST_FIRST	10	/* from starting to the first message either way */
+#define ST_LINE_ACK	11	/* from a datagram line first going to its ACK */
+#define ST_COUNT	12
+
+extern const char *stat_file;
+
+void stat_init(void);
+void stat_add(int id, long long v);
+void stat_time(int id, long long start);
+long long stat_sum(int id);
+void stat_dump(void);
+void stat_poll(void);
+int stat_summary(char *buf, size_t len);
+
+/* trace.c */
+#define TR_READ		0	/* fd, bytes */
+#define TR_WRITE	1	/* fd, bytes */
+#define TR_WAIT		2	/* events, timeout ms */
+#define TR_SEAL		3	/* type, length, us */
+#define TR_OPEN		4	/* type, length, us */
+#define TR_MKPRIV	5	/* type, length, local seq */
+#define TR_RDPRIV	6	/* type, length, remote seq */
+#define TR_KEY		7	/* key */
+#define TR_RENDER	8	/* bytes drawn */
+#define TR_PAINT	9	/* us */
+#define TR_XFER		10	/* transfer id, offset, bytes */
+#define TR_COUNT	11
+
+typedef struct ktrace_ev {
+  long long ns;
+  int id, a;
+  long long b, c;
+} ktrace_ev;
+
+#ifdef KTALK_TRACE
+extern ktrace_ev *trace_ring;
+
+#define TRACE(id, a, b, c) \
+  do { if (trace_ring) trace_event((id), (a), (b), (c)); } while (0)
+
+void trace_event(int id, long a, long long b, long long c);
+void trace_start(const char *path);
+#else
+#define TRACE(id, a, b, c)	((void)0)
+#endif
+
+/* zip.c */
+kzip *zip_start(void);
+void zip_free(kzip *z);
+int zip_seal(kconn *conn, int type, const char *data, size_t len);
+krb5_error_code zip_open(kconn *conn, kframe *frame, krb5_data *msg);
+void zip_done(kconn *conn, kframe *frame, krb5_data *msg);
+int zip_stats(kzip *z, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,256 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+ * Live typing (-k ms), the way talk does it.  Keystrokes are gathered for
+ * a few milliseconds and sent as one FRAME_EDIT, so a fast typist costs
+ * one krb5_mk_priv and one segment per burst rather than per key.  The
+ * other side draws the edits into its receive window as they arrive.
+ *
+ * An edit frame is a flag byte, the time its first key was typed, and
+ * the keys: printable characters and newline are typed, EDIT_ERASE rubs
+ * out one character and EDIT_KILL the whole line.  About once a second
+ * the sender asks for the time back once the edit has been drawn, which
+ * gives the keystroke to glyph latency plus the trip back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ktalk.h"
+
+#define EDIT_ERASE	0x7f
+#define EDIT_KILL	('U' - '@')
+#define EDIT_WANTACK	0x01
+#define EDIT_HDRLEN	9
+
+int live_mode = 0;
+int live_window = 15;		/* milliseconds to gather keystrokes */
+
+static char editbuff[EDIT_HDRLEN + 1024];
+static int editlen = 0;
+static long long first_key;	/* when the oldest unsent key was typed */
+static long long last_ackreq = 0;
+static long long ack_due = -1;	/* a time to echo back, if asked for one */
+static int rlinelen = 0;	/* characters on the other party's line */
+static char rline[1024];	/* and the first of them, for the transcript */
+
+static long long lat_last, lat_min, lat_max, lat_sum;
+static int lat_count = 0;
+
+/* whether the batch is full, so no more keys can be taken until it goes */
+int
+live_full(void) {
+  return editlen >= (int)sizeof(editbuff) - EDIT_HDRLEN;
+}
+
+/*
+ * Note a keystroke for the other party.  Returns 1 when the batch is full
+ * and should be sent before reading more; a key that comes anyway is
+ * refused with a beep.
+ */
+int
+live_key(int c) {
+  if (live_full()) {
+    beep();
+    return 1;
+  }
+  if (c == 13)
+    c = '\n';
+  if (c == 8)
+    c = EDIT_ERASE;
+  if (!editlen)
+    first_key = now_usec();
+  editbuff[EDIT_HDRLEN + editlen++] = c;
+  return live_full();
+}
+
+/* milliseconds until something here needs doing, or -1 */
+int
+live_timeout(void) {
+  long long left;
+
+  if (ack_due >= 0)
+    return 0;
+  if (!editlen)
+    return -1;
+  left = first_key + live_window * 1000LL - now_usec();
+  return left > 0 ? (int)((left + 999) / 1000) : 0;
+}
+
+/* send the gathered keystrokes once they are old enough, or now if forced */
+void
+live_flush(kconn *conn, int force) {
+  unsigned char ack[8];
+  long long now;
+
+  if (ack_due >= 0) {
+    put64(ack, ack_due);
+    ack_due = -1;
+    if (send_sealed(conn, FRAME_EDIT_ACK, (char *)ack, sizeof(ack)) < 0
+	&& errno != ENOBUFS)
+      fail(errno, "sending chat data to party");
+  }
+
+  if (!editlen)
+    return;
+  now = now_usec();
+  if (!force && now - first_key < live_window * 1000LL)
+    return;
+
+  editbuff[0] = 0;
+  if (now - last_ackreq >= 1000000) {
+    editbuff[0] |= EDIT_WANTACK;
+    last_ackreq = now;
+  }
+  put64((unsigned char *)editbuff + 1, first_key);
+  if (send_sealed(conn, FRAME_EDIT, editbuff, EDIT_HDRLEN + editlen) < 0) {
+    if (errno != ENOBUFS)
+      fail(errno, "sending chat data to party");
+    /* keep the keys and try again on the next pass */
+    return;
+  }
+  editlen = 0;
+}
+
+static void
+erase_one(int hold) {
+  int x, y;
+
+  if (!rlinelen)
+    return;
+  rlinelen--;
+  scroll_erase();
+  if (hold)
+    return;
+  if (!use_curses) {
+    fputs("\b \b", stdout);
+    return;
+  }
+  getyx(receivewin, y, x);
+  if (x > 0) {
+    x--;
+  } else if (y > 0) {
+    y--;
+    x = COLS - 1;
+  } else {
+    return;			/* scrolled off the top */
+  }
+  mvwaddch(receivewin, y, x, ' ');
+  wmove(receivewin, y, x);
+}
+
+static void
+draw_edits(const char *p, size_t len) {
+  int hold = use_curses && scroll_active();	/* only keep it for now */
+  size_t i;
+  int n;
+
+  render_sync();
+  for (i = 0; i < len; i++) {
+    switch ((unsigned char)p[i]) {
+    case EDIT_ERASE:
+      erase_one(hold);
+      break;
+    case EDIT_KILL:
+      while (rlinelen)
+	erase_one(hold);
+      break;
+    case '\n':
+      n = rlinelen < (int)sizeof(rline) ? rlinelen : (int)sizeof(rline) - 1;
+      rline[n] = '\n';
+      log_record(LOG_RECV, rline, n + 1);
+      rlinelen = 0;
+      if (use_curses)
+	scroll_add(SCROLL_RECV, &p[i], 1);
+      if (hold)
+	break;
+      if (use_curses)
+	waddch(receivewin, '\n');
+      else
+	putchar('\n');
+      break;
+    default:
+      if ((unsigned char)p[i] < 32)
+	break;
+      if (rlinelen < (int)sizeof(rline))
+	rline[rlinelen] = p[i];
+      rlinelen++;
+      if (use_curses)
+	scroll_add(SCROLL_RECV, &p[i], 1);
+      if (hold)
+	break;
+      if (use_curses)
+	waddch(receivewin, (unsigned char)p[i]);
+      else
+	putchar(p[i]);
+      break;
+    }
+  }
+  if (hold)
+    return;
+  if (use_curses)
+    wnoutrefresh(receivewin);
+  else
+    fflush(stdout);
+}
+
+static void
+note_latency(long long sent) {
+  char buf[64];
+
+  lat_last = now_usec() - sent;
+  if (!lat_count || lat_last < lat_min)
+    lat_min = lat_last;
+  if (!lat_count || lat_last > lat_max)
+    lat_max = lat_last;
+  lat_sum += lat_last;
+  lat_count++;
+  debug("keystroke to glyph and back %lld us (min %lld avg %lld max %lld)",
+	lat_last, lat_min, lat_sum / lat_count, lat_max);
+  snprintf(buf, sizeof(buf), "live %lldms, avg %lldms", lat_last / 1000,
+	   lat_sum / lat_count / 1000);
+  set_status(STATUS_LIVE, buf);
+}
+
+void
+live_receive(int type, krb5_data *msg) {
+  const unsigned char *p = (const unsigned char *)msg->data;
+
+  if (type == FRAME_EDIT_ACK) {
+    if (msg->length >= 8)
+      note_latency(get64(p));
+    return;
+  }
+
+  if (msg->length < EDIT_HDRLEN)
+    return;
+  draw_edits(msg->data + EDIT_HDRLEN, msg->length - EDIT_HDRLEN);
+  if (p[0] & EDIT_WANTACK)
+    ack_due = get64(p + 1);
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
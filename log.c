@@ -0,0 +1,443 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+
+/*
+ * Session transcripts (-l dir).  Each thing said, either way, and each
+ * notice goes in a file of its own for the session as a record
+ *
+ *   | length (4) | kind (1) | flags (1) | 0 (2) | microseconds (8) | text |
+ *
+ * after an 8 byte magic.  With -K keytab the text of every record is
+ * sealed with krb5_c_encrypt, under a key derived from one kept in that
+ * keytab (made the first time), and has LOG_F_SEALED set.  The rest of
+ * the header but the length is sealed along with the text, so a record
+ * cannot be made out to be the other party's, or from another time.
+ * ktalk -T file prints a transcript back.
+ *
+ * The key is not derived from our Kerberos credentials, though that would
+ * need no keytab: the TGT's session key is new with every kinit, and a
+ * transcript has to open long after that.  So it is a random key of its
+ * own under LOG_PRINCIPAL, and whoever can read the keytab can read the
+ * transcripts.
+ *
+ * The chat never waits for the disk: log_record() only copies into a
+ * buffer, and a thread of our own seals the records and writes them out
+ * in a batch once LOG_BATCH bytes have built up or LOG_INTERVAL has
+ * passed, with one fdatasync() after each.  If the disk falls so far
+ * behind that LOG_MAX is waiting, records are dropped and the transcript
+ * says how many.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "ktalk.h"
+
+#define LOG_MAGIC	"KTALKLG1"
+#define LOG_HDRLEN	16
+#define LOG_F_SEALED	0x01
+#define LOG_BATCH	32768		/* write once this much is waiting */
+#define LOG_INTERVAL	1000		/* or once the oldest is this old, ms */
+#define LOG_MAX		(4 * 1024 * 1024)	/* drop records past this */
+#define LOG_PRINCIPAL	"ktalk/transcript"
+
+typedef struct logbuf {
+  char *data;
+  size_t len, size;
+} logbuf;
+
+static int logfd = -1;
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static logbuf fill, out, sealed;	/* fill is only touched under lock */
+static unsigned long lost = 0;
+static int closing = 0;
+
+/* the writer's own context and key; krb5 contexts are not to be shared */
+static krb5_context wcontext;
+static krb5_keyblock *logkey = NULL;
+
+static void
+buf_need(logbuf *b, size_t len) {
+  size_t want;
+
+  if (b->len + len <= b->size)
+    return;
+  want = b->size ? b->size : LOG_BATCH * 2;
+  while (want < b->len + len)
+    want *= 2;
+  b->data = realloc(b->data, want);
+  if (!b->data)
+    fail(errno, "allocating transcript buffer");
+  b->size = want;
+}
+
+static void
+buf_add(logbuf *b, int kind, int flags, long long usec, const char *text,
+	size_t len) {
+  unsigned char *h;
+
+  buf_need(b, LOG_HDRLEN + len);
+  h = (unsigned char *)b->data + b->len;
+  put32(h, len);
+  h[4] = kind;
+  h[5] = flags;
+  h[6] = h[7] = 0;
+  put64(h + 8, usec);
+  memcpy(b->data + b->len + LOG_HDRLEN, text, len);
+  b->len += LOG_HDRLEN + len;
+}
+
+static long long
+wallclock_usec(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/*
+ * The key for sealing records, derived from the one kept in keytab under
+ * LOG_PRINCIPAL; if it has none, one is made and added.
+ */
+static krb5_error_code
+get_logkey(krb5_context context, const char *keytab, krb5_keyblock **key) {
+  krb5_keytab kt;
+  krb5_keytab_entry entry;
+  krb5_principal princ;
+  krb5_error_code ret;
+
+  ret = krb5_kt_resolve(context, keytab, &kt);
+  if (ret)
+    return ret;
+  ret = krb5_parse_name(context, LOG_PRINCIPAL, &princ);
+  if (ret) {
+    krb5_kt_close(context, kt);
+    return ret;
+  }
+  ret = krb5_kt_get_entry(context, kt, princ, 0, 0, &entry);
+  if (ret == KRB5_KT_NOTFOUND || ret == ENOENT) {
+    memset(&entry, 0, sizeof(entry));
+    entry.principal = princ;
+    entry.vno = 1;
+    ret = krb5_c_make_random_key(context, ENCTYPE_AES256_CTS_HMAC_SHA1_96,
+				 &entry.key);
+    if (!ret)
+      ret = krb5_kt_add_entry(context, kt, &entry);
+    if (!ret)
+      ret = krb5_c_fx_cf2_simple(context, &entry.key, "ktalk transcript",
+				 &entry.key, "records", key);
+    krb5_free_keyblock_contents(context, &entry.key);
+  } else if (!ret) {
+    ret = krb5_c_fx_cf2_simple(context, &entry.key, "ktalk transcript",
+			       &entry.key, "records", key);
+    krb5_free_keytab_entry_contents(context, &entry);
+  }
+  krb5_free_principal(context, princ);
+  krb5_kt_close(context, kt);
+  return ret;
+}
+
+/* seal each record of out, with its kind, flags and time, into sealed */
+static void
+seal_batch(void) {
+  unsigned char *h;
+  krb5_data plain;
+  krb5_enc_data enc;
+  size_t off, len, enclen;
+  krb5_error_code ret;
+
+  sealed.len = 0;
+  for (off = 0; off < out.len; off += LOG_HDRLEN + len) {
+    h = (unsigned char *)out.data + off;
+    len = get32(h);
+    h[5] |= LOG_F_SEALED;
+    ret = krb5_c_encrypt_length(wcontext, logkey->enctype,
+				LOG_HDRLEN - 4 + len, &enclen);
+    if (ret)
+      fail(ret, "sealing transcript");
+    buf_need(&sealed, LOG_HDRLEN + enclen);
+    memset(&enc, 0, sizeof(enc));
+    enc.ciphertext.data = sealed.data + sealed.len + LOG_HDRLEN;
+    enc.ciphertext.length = enclen;
+    plain.data = (char *)h + 4;
+    plain.length = LOG_HDRLEN - 4 + len;
+    ret = krb5_c_encrypt(wcontext, logkey, KU_LOG, NULL, &plain, &enc);
+    if (ret)
+      fail(ret, "sealing transcript");
+    memcpy(sealed.data + sealed.len, h, LOG_HDRLEN);
+    put32((unsigned char *)sealed.data + sealed.len, enc.ciphertext.length);
+    sealed.len += LOG_HDRLEN + enc.ciphertext.length;
+  }
+}
+
+static void
+write_all(const char *p, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(logfd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      /* a full disk is no reason to end the conversation */
+      debug("writing transcript: %s", strerror(errno));
+      return;
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+static void
+add_deadline(struct timespec *ts, int ms) {
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+static void *
+write_loop(void *arg) {
+  struct timespec deadline;
+  logbuf t;
+
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (!fill.len && !closing)
+      pthread_cond_wait(&wake, &lock);
+    if (!fill.len && closing)
+      break;
+
+    /* let a batch build up, unless it already has */
+    add_deadline(&deadline, LOG_INTERVAL);
+    while (fill.len < LOG_BATCH && !closing)
+      if (pthread_cond_timedwait(&wake, &lock, &deadline) == ETIMEDOUT)
+	break;
+
+    t = out;
+    out = fill;
+    fill = t;
+    fill.len = 0;
+    pthread_mutex_unlock(&lock);
+
+    if (logkey) {
+      seal_batch();
+      write_all(sealed.data, sealed.len);
+    } else {
+      write_all(out.data, out.len);
+    }
+    fdatasync(logfd);
+    out.len = 0;
+
+    pthread_mutex_lock(&lock);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+/* write out what is left; run at exit */
+static void
+log_close(void) {
+  if (logfd < 0)
+    return;
+  /* interrupted inside log_record(), the last batch is lost */
+  if (pthread_mutex_trylock(&lock))
+    return;
+  closing = 1;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+  pthread_join(writer, NULL);
+  close(logfd);
+  logfd = -1;
+}
+
+/*
+ * Start a transcript of the session with peer in dir, sealed with a key
+ * from keytab if that is not NULL.
+ */
+void
+log_open(const char *dir, const char *peer, const char *keytab) {
+  char path[1024], stamp[32], *p;
+  time_t now;
+  krb5_error_code ret;
+
+  ret = krb5_init_context(&wcontext);
+  if (ret)
+    fail(ret, "krb5_init_context");
+  if (keytab) {
+    ret = get_logkey(wcontext, keytab, &logkey);
+    if (ret)
+      fail(ret, "getting the transcript key");
+  }
+
+  now = time(NULL);
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+  snprintf(path, sizeof(path), "%s/%s-%s.ktlog", dir, peer, stamp);
+  for (p = path + strlen(dir) + 1; *p; p++) {
+    if (*p == '/')
+      *p = '_';
+  }
+  logfd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0600);
+  if (logfd < 0)
+    fail(errno, path);
+  write_all(LOG_MAGIC, 8);
+
+  errno = pthread_create(&writer, NULL, write_loop, NULL);
+  if (errno)
+    fail(errno, "starting transcript writer");
+  atexit(log_close);
+  debug("transcript in %s%s", path, logkey ? ", sealed" : "");
+}
+
+/* add to the transcript, if there is one; this never waits on the disk */
+void
+log_record(int kind, const char *text, size_t len) {
+  char note[64];
+  long long usec;
+
+  if (logfd < 0 || !len)
+    return;
+  usec = wallclock_usec();
+  pthread_mutex_lock(&lock);
+  if (fill.len + LOG_HDRLEN + len > LOG_MAX) {
+    lost++;
+  } else {
+    if (lost) {
+      snprintf(note, sizeof(note), "[%lu records lost, the disk is slow]\n",
+	       lost);
+      buf_add(&fill, LOG_NOTICE, 0, usec, note, strlen(note));
+      lost = 0;
+    }
+    buf_add(&fill, kind, 0, usec, text, len);
+    if (fill.len == LOG_HDRLEN + len || fill.len >= LOG_BATCH)
+      pthread_cond_signal(&wake);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/* print a transcript, opening its records with a key from keytab */
+void
+log_dump(const char *path, const char *keytab) {
+  static const char *tags[] = { "<", ">", "*" };
+  unsigned char h[LOG_HDRLEN];
+  char magic[8], *rec, *text, stamp[32];
+  krb5_context context;
+  krb5_enc_data enc;
+  krb5_data plain;
+  krb5_keyblock *key = NULL;
+  krb5_error_code ret;
+  long long usec;
+  size_t len, i;
+  time_t secs;
+  FILE *f;
+
+  ret = krb5_init_context(&context);
+  if (ret)
+    fail(ret, "krb5_init_context");
+  if (keytab) {
+    ret = get_logkey(context, keytab, &key);
+    if (ret)
+      fail(ret, "getting the transcript key");
+  }
+  f = fopen(path, "r");
+  if (!f)
+    fail(errno, path);
+  if (fread(magic, 1, 8, f) != 8 || memcmp(magic, LOG_MAGIC, 8)) {
+    fprintf(stderr, "%s: not a ktalk transcript\n", path);
+    exit(1);
+  }
+
+  while (fread(h, 1, LOG_HDRLEN, f) == LOG_HDRLEN) {
+    len = get32(h);
+    text = rec = malloc(len + 1);
+    if (!rec)
+      fail(errno, "reading transcript");
+    if (fread(rec, 1, len, f) != len) {
+      free(rec);
+      break;
+    }
+    usec = get64(h + 8);
+    secs = usec / 1000000;
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+
+    if (h[5] & LOG_F_SEALED) {
+      if (!key) {
+	fprintf(stderr, "the transcript is sealed; give the keytab with -K\n");
+	exit(1);
+      }
+      memset(&enc, 0, sizeof(enc));
+      enc.enctype = key->enctype;
+      enc.ciphertext.data = text;
+      enc.ciphertext.length = len;
+      plain.data = malloc(len);
+      plain.length = len;
+      if (!plain.data)
+	fail(errno, "reading transcript");
+      ret = krb5_c_decrypt(context, key, KU_LOG, NULL, &enc, &plain);
+      if (ret)
+	fail(ret, "opening transcript record");
+      if (plain.length < LOG_HDRLEN - 4
+	  || memcmp(plain.data, h + 4, LOG_HDRLEN - 4)) {
+	fprintf(stderr, "a record's header does not match what was sealed\n");
+	exit(1);
+      }
+      free(rec);
+      rec = plain.data;
+      text = rec + LOG_HDRLEN - 4;
+      len = plain.length - (LOG_HDRLEN - 4);
+    }
+
+    /* one line of output a line of text, each with the time and who */
+    printf("%s %s ", stamp, h[4] < 3 ? tags[h[4]] : "?");
+    for (i = 0; i < len; i++) {
+      if (text[i] == '\0')
+	continue;
+      putchar(text[i]);
+      if (text[i] == '\n' && i + 1 < len)
+	printf("%s %s ", stamp, h[4] < 3 ? tags[h[4]] : "?");
+    }
+    if (len && text[len - 1] != '\n')
+      putchar('\n');
+    free(rec);
+  }
+  fclose(f);
+  if (key)
+    krb5_free_keyblock(context, key);
+  krb5_free_context(context);
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
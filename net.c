@@ -0,0 +1,372 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+ * Transports.  Everything above here only needs a file descriptor to read
+ * and write frames on, plus the krb5 addresses of the two ends for the
+ * auth context.  TCP is what people use; a socketpair puts both ends of a
+ * session in one process, for benchmarks.  A front end talks to the
+ * daemon over a Unix socket, which never needs addresses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include "ktalk.h"
+
+/* give up on connecting after this many seconds (-t) */
+int connect_timeout = 20;
+
+/* start on the next address if the last has not answered in this long */
+#define CONNECT_STAGGER	250	/* ms */
+#define CONNECT_MAX	16	/* addresses tried */
+
+static void
+set_address(krb5_address * k5, int type, const void *addr, size_t len) {
+  k5->addrtype = type;
+  k5->length = len;
+  k5->contents = malloc(len);
+  if (!k5->contents)
+    fail(errno, "allocating address");
+  memcpy(k5->contents, addr, len);
+}
+
+/*
+ * An IPv4 peer on our dual stack socket shows up as ::ffff:a.b.c.d, but
+ * it sees itself as a.b.c.d, so that is what both ends must use.
+ */
+static void
+sockaddr_to_krb5_address(krb5_address * k5, struct sockaddr *sock) {
+  switch (sock->sa_family) {
+  case AF_INET:
+    {
+      struct sockaddr_in *sin = (struct sockaddr_in *)sock;
+
+      set_address(k5, ADDRTYPE_INET, &sin->sin_addr, sizeof(sin->sin_addr));
+    }
+    break;
+  case AF_INET6:
+    {
+      struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sock;
+
+      if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+	set_address(k5, ADDRTYPE_INET, &sin6->sin6_addr.s6_addr[12], 4);
+      else
+	set_address(k5, ADDRTYPE_INET6, &sin6->sin6_addr,
+		    sizeof(sin6->sin6_addr));
+    }
+    break;
+  default:
+    fprintf(stderr, "can't copy address");	/* XXX */
+    break;
+  }
+}
+
+static int
+tcp_addresses(int fd, krb5_address *local, krb5_address *foreign) {
+  struct sockaddr_storage laddr, faddr;
+  socklen_t len;
+
+  len = sizeof(laddr);
+  if (getsockname(fd, (struct sockaddr *)&laddr, &len) != 0)
+    return -1;
+  len = sizeof(faddr);
+  if (getpeername(fd, (struct sockaddr *)&faddr, &len) != 0)
+    return -1;
+  sockaddr_to_krb5_address(local, (struct sockaddr *)&laddr);
+  sockaddr_to_krb5_address(foreign, (struct sockaddr *)&faddr);
+  return 0;
+}
+
+/* a socketpair has no addresses, so both ends say they are loopback */
+static int
+pair_addresses(int fd, krb5_address *local, krb5_address *foreign) {
+  struct sockaddr_in sin;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sockaddr_to_krb5_address(local, (struct sockaddr *)&sin);
+  sockaddr_to_krb5_address(foreign, (struct sockaddr *)&sin);
+  return 0;
+}
+
+const ktransport transport_tcp = { "tcp", tcp_addresses };
+const ktransport transport_pair = { "socketpair", pair_addresses };
+const ktransport transport_unix = { "unix", pair_addresses };
+
+static int
+bind_any(int fd, int family, unsigned short port) {
+  struct sockaddr_in6 sin6;
+  struct sockaddr_in sin;
+
+  if (family == AF_INET6) {
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_addr = in6addr_any;
+    sin6.sin6_port = htons(port);
+    return bind(fd, (struct sockaddr *)&sin6, sizeof(sin6));
+  }
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_ANY);
+  sin.sin_port = htons(port);
+  return bind(fd, (struct sockaddr *)&sin, sizeof(sin));
+}
+
+/*
+ * A socket listening on port, or with walk on the first free port from
+ * there up, which is put back in port.  It takes IPv6 and IPv4 both,
+ * unless this host has no IPv6.
+ */
+int
+tcp_bind(unsigned short *port, int walk) {
+  int ret, servsock, family = AF_INET6, off = 0, on = 1;
+
+  servsock = socket(AF_INET6, SOCK_STREAM, 0);
+  if (servsock >= 0) {
+    setsockopt(servsock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+  } else {
+    family = AF_INET;
+    servsock = socket(AF_INET, SOCK_STREAM, 0);
+  }
+  if (servsock < 0)
+    fail(errno, "creating socket");
+  /* a port of our own should come back at once after a restart */
+  if (!walk)
+    setsockopt(servsock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  while ((ret = bind_any(servsock, family, *port)) != 0) {
+    if (errno == EADDRINUSE && walk)
+      (*port)++;
+    else
+      fail(errno, "binding address");
+  }
+
+  ret = listen(servsock, walk ? 5 : SOMAXCONN);
+  if (ret < 0)
+    fail(errno, "listening for connection");
+  return servsock;
+}
+
+/* listen on the first free port from 2050 up and tell users about it */
+int
+tcp_listen(char **users, int nusers, const knotifier *nf, const char *nfarg) {
+  unsigned short port = 2050;
+  int servsock;
+
+  servsock = tcp_bind(&port, 1);
+  notify_start(nf, users, nusers, port, nfarg);
+
+  printf("waiting for connection on port %i .... \n", port);
+  return servsock;
+}
+
+/*
+ * Wait for user to connect to servsock, from tcp_listen(), saying so if
+ * they could not be told.
+ */
+int
+tcp_accept(int servsock, const char *user) {
+  struct pollfd pfd;
+  int fd, ret;
+
+  pfd.fd = servsock;
+  pfd.events = POLLIN;
+  for (;;) {
+    ret = poll(&pfd, 1, notify_pending() ? 200 : -1);
+    if (ret < 0 && errno != EINTR)
+      fail(errno, "waiting for connection");
+    if (notify_finished() > 0)
+      printf("could not tell %s where to connect; they can use: %s\n", user,
+	     notify_command());
+    if (ret > 0)
+      break;
+  }
+
+  fd = accept(servsock, NULL, NULL);
+  if (fd < 0)
+    fail(errno, "accepting connection");
+
+  close(servsock);
+
+  return fd;
+}
+
+/*
+ * Connect to host, trying every address it has.  Attempts start
+ * CONNECT_STAGGER ms apart, alternating IPv6 and IPv4, or at once when the
+ * one before fails; the first to finish wins.  After connect_timeout
+ * seconds we give up.
+ */
+int
+tcp_connect(const char *host, unsigned short port) {
+  struct addrinfo hints, *res, *ai, *p6, *p4, *order[CONNECT_MAX];
+  struct pollfd pfd[CONNECT_MAX];
+  char serv[16], name[NI_MAXHOST];
+  int n6 = 0, n4 = 0, naddr = 0, started = 0, live = 0, fd = -1;
+  int i, ret, err = ETIMEDOUT, soerr, flags, want6;
+  long long start, deadline, next, now;
+  socklen_t len;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(serv, sizeof(serv), "%u", port);
+  ret = getaddrinfo(host, serv, &hints, &res);
+  if (ret) {
+    fprintf(stderr, "%s: %s\n", host, gai_strerror(ret));
+    exit(1);
+  }
+
+  /* take the families in turn, starting with whichever came first */
+  for (ai = res; ai; ai = ai->ai_next) {
+    if (ai->ai_family == AF_INET6)
+      n6++;
+    else if (ai->ai_family == AF_INET)
+      n4++;
+  }
+  p6 = p4 = res;
+  want6 = res->ai_family != AF_INET;
+  while (naddr < CONNECT_MAX && (n6 || n4)) {
+    if ((want6 && n6) || !n4) {
+      while (p6->ai_family != AF_INET6)
+	p6 = p6->ai_next;
+      order[naddr++] = p6;
+      p6 = p6->ai_next;
+      n6--;
+    } else {
+      while (p4->ai_family != AF_INET)
+	p4 = p4->ai_next;
+      order[naddr++] = p4;
+      p4 = p4->ai_next;
+      n4--;
+    }
+    want6 = !want6;
+  }
+
+  start = next = now_usec();
+  deadline = start + connect_timeout * 1000000LL;
+  while (fd < 0) {
+    now = now_usec();
+    if (now >= deadline) {
+      err = ETIMEDOUT;
+      break;
+    }
+
+    /* start the next attempt if it is due */
+    if (started < naddr && (now >= next || !live)) {
+      ai = order[started];
+      pfd[started].fd = socket(ai->ai_family, SOCK_STREAM, 0);
+      pfd[started].events = POLLOUT;
+      pfd[started].revents = 0;
+      if (pfd[started].fd >= 0) {
+	fcntl(pfd[started].fd, F_SETFL, O_NONBLOCK);
+	ret = connect(pfd[started].fd, ai->ai_addr, ai->ai_addrlen);
+	if (ret == 0 || errno == EINPROGRESS) {
+	  live++;
+	} else {
+	  err = errno;
+	  close(pfd[started].fd);
+	  pfd[started].fd = -1;
+	}
+      } else {
+	err = errno;
+      }
+      started++;
+      next = now + CONNECT_STAGGER * 1000LL;
+      continue;
+    }
+    if (!live)
+      break;
+
+    /* wait for one to finish, or for the next to be due */
+    if (started < naddr && next < deadline)
+      ret = (int)((next - now + 999) / 1000);
+    else
+      ret = (int)((deadline - now + 999) / 1000);
+    ret = poll(pfd, started, ret);
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      fail(errno, "waiting for connection");
+    }
+    for (i = 0; i < started && fd < 0; i++) {
+      if (pfd[i].fd < 0 || !pfd[i].revents)
+	continue;
+      len = sizeof(soerr);
+      if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &len) < 0)
+	soerr = errno;
+      if (soerr == 0) {
+	fd = pfd[i].fd;
+	pfd[i].fd = -1;
+	ai = order[i];
+      } else {
+	err = soerr;
+	close(pfd[i].fd);
+	pfd[i].fd = -1;
+	live--;
+      }
+    }
+  }
+
+  for (i = 0; i < started; i++) {
+    if (pfd[i].fd >= 0)
+      close(pfd[i].fd);
+  }
+  if (fd < 0) {
+    freeaddrinfo(res);
+    fail(err, "connecting");
+  }
+
+  flags = fcntl(fd, F_GETFL);
+  fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+  if (getnameinfo(ai->ai_addr, ai->ai_addrlen, name, sizeof(name), NULL, 0,
+		  NI_NUMERICHOST))
+    strcpy(name, "?");
+  debug("connected to %s after %lld ms", name, (now_usec() - start) / 1000);
+  freeaddrinfo(res);
+  return fd;
+}
+
+/* both ends of a session in this process */
+void
+pair_open(int fds[2]) {
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    fail(errno, "socketpair");
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
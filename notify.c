@@ -0,0 +1,335 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+ * Notifiers, which tell the people we are waiting for where to connect:
+ * a zephyrgram, a messenger program of the user's own (-e), a line in a
+ * file (-N) for scripts and tests, or nothing at all (-n) when they will be
+ * told some other way.
+ *
+ * Telling them can be slow, and nobody can connect until the socket is
+ * listening anyway, so it happens in a child process of its own that
+ * starts once it is.  Each announcement gets notify_timeout seconds and
+ * NOTIFY_TRIES tries; the child's exit status is how many people it could
+ * not reach, and SIGCHLD reaps it whenever it is done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <arpa/nameser.h>
+#include <zephyr/zephyr.h>
+#include "ktalk.h"
+
+#define NOTIFY_TRIES	3
+
+int notify_timeout = 10;	/* seconds for each try */
+
+static volatile sig_atomic_t notify_pid = 0, notify_status = 0;
+static int notify_reported = 1;
+static char notify_line[NS_MAXDNAME + 128];
+
+static void
+our_hostname(char *hostname, size_t len) {
+  gethostname(hostname, len);
+  hostname[len - 1] = '\0';
+  if (strlen(hostname) > 8
+      && strcasecmp(&hostname[strlen(hostname) - 8], ".mit.edu") == 0)
+    hostname[strlen(hostname) - 8] = '\0';
+}
+
+static char *
+our_username(void) {
+  struct passwd *pw;
+
+  pw = getpwuid(getuid());
+  return strdup(pw ? pw->pw_name : "unknown");
+}
+
+static int
+zephyr_announce(const char *recip, int port, const char *arg) {
+  char hostname[NS_MAXDNAME + 1];
+  ZNotice_t notice, ack;
+  char *list[2];
+  char msg[2048];
+  char *sender, *foo;
+  Code_t ret;
+
+  our_hostname(hostname, sizeof(hostname));
+
+  ret = ZInitialize();
+  if (ret != ZERR_NONE) {
+    debug("zephyr: %s", error_message(ret));
+    return NOTIFY_AGAIN;
+  }
+
+  sender = strdup(ZGetSender());
+  foo = strstr(sender, "@ATHENA.MIT.EDU");
+  if (foo)
+    *foo = '\0';
+
+  snprintf(msg, 2048,
+	   "This user is requesting a krb5 user to user encrypted communication channel.\n"
+	   "To open the channel type:\n"
+	   "\n   add ktools\n"
+	   "   ktalk %s %s %i\n"
+	   "\nat the Athena%% prompt.\n", sender, hostname, port);
+
+  free(sender);
+
+  memset(&notice, 0, sizeof(notice));
+  notice.z_kind = ACKED;
+  notice.z_class = "message";
+  notice.z_class_inst = "personal";
+  notice.z_recipient = (char *)recip;
+  notice.z_default_format =
+      "Class $class, Instance $instance:\nTo: @bold($recipient) at $time $date\nFrom: @bold{$1 <$sender>}\n\n$2";
+  notice.z_sender = ZGetSender();
+  notice.z_opcode = "";
+
+  list[0] = "Advertise here";
+  list[1] = msg;
+
+  /* the server's acknowledgement says whether anyone got it */
+  ret = ZSendList(&notice, list, 2, ZAUTH);
+  if (ret == ZERR_NONE)
+    ret = ZIfNotice(&ack, NULL, ZCompareUIDPred, (char *)&notice.z_uid);
+  ZClosePort();
+  if (ret != ZERR_NONE) {
+    debug("zephyr to %s: %s", recip, error_message(ret));
+    return NOTIFY_AGAIN;
+  }
+  if (ack.z_kind == SERVACK && ack.z_message
+      && !strcmp(ack.z_message, ZSRVACK_NOTSENT)) {
+    debug("zephyr to %s: not logged in", recip);
+    ret = NOTIFY_FAILED;
+  } else if (ack.z_kind == SERVNAK) {
+    debug("zephyr to %s: refused by the server", recip);
+    ret = NOTIFY_FAILED;
+  }
+  ZFreeNotice(&ack);
+  return ret;
+}
+
+static void
+on_alarm(int sig) {
+}
+
+/* run the messenger as "messenger <sender> <host> <port>" */
+static int
+exec_announce(const char *recip, int port, const char *execstr) {
+  char hostname[NS_MAXDNAME + 1], portstr[16];
+  char *sender;
+  int pid, status;
+
+  our_hostname(hostname, sizeof(hostname));
+  sender = our_username();
+  pid = fork();
+  if (pid < 0) {
+    free(sender);
+    return NOTIFY_AGAIN;
+  } else if (pid == 0) {
+    snprintf(portstr, sizeof(portstr), "%i", port);
+    execlp(execstr, execstr, sender, hostname, portstr, (char *)NULL);
+    _exit(127);
+  }
+  free(sender);
+
+  /* the alarm is what stops a messenger that takes too long */
+  if (waitpid(pid, &status, 0) < 0) {
+    kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+    debug("%s took too long", execstr);
+    return NOTIFY_AGAIN;
+  }
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+    debug("could not run %s", execstr);
+    return NOTIFY_FAILED;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : NOTIFY_AGAIN;
+}
+
+/* write "ktalk <sender> <host> <port>" to a file, all at once */
+static int
+file_announce(const char *recip, int port, const char *path) {
+  char hostname[NS_MAXDNAME + 1], tmp[1024];
+  char *sender;
+  FILE *f;
+  int ok;
+
+  our_hostname(hostname, sizeof(hostname));
+  sender = our_username();
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  f = fopen(tmp, "w");
+  if (!f) {
+    free(sender);
+    return NOTIFY_FAILED;
+  }
+  fprintf(f, "ktalk %s %s %i\n", sender, hostname, port);
+  free(sender);
+  ok = fclose(f) == 0 && rename(tmp, path) == 0;
+  return ok ? 0 : NOTIFY_FAILED;
+}
+
+static int
+none_announce(const char *recip, int port, const char *arg) {
+  char hostname[NS_MAXDNAME + 1];
+  char *sender;
+
+  our_hostname(hostname, sizeof(hostname));
+  sender = our_username();
+  printf("%s can connect with: ktalk %s %s %i\n", recip, sender, hostname,
+	 port);
+  fflush(stdout);
+  free(sender);
+  return 0;
+}
+
+const knotifier notify_zephyr = { "zephyr", zephyr_announce };
+const knotifier notify_exec = { "exec", exec_announce };
+const knotifier notify_file = { "file", file_announce };
+const knotifier notify_none = { "none", none_announce };
+
+static void
+reap_notifier(int sig) {
+  int saved = errno, status;
+
+  if (notify_pid && waitpid(notify_pid, &status, WNOHANG) == notify_pid) {
+    notify_status = status;
+    notify_pid = 0;
+  }
+  errno = saved;
+}
+
+/* in the child: tell each of them, trying a few times, and exit */
+static void
+announce_all(const knotifier *nf, char **users, int nusers, int port,
+	     const char *arg) {
+  struct sigaction sigact;
+  int i, try, ret, missed = 0;
+
+  sigemptyset(&sigact.sa_mask);
+  sigact.sa_flags = 0;
+  sigact.sa_handler = SIG_DFL;
+  sigaction(SIGCHLD, &sigact, NULL);
+  sigaction(SIGINT, &sigact, NULL);
+  sigact.sa_handler = on_alarm;
+  sigaction(SIGALRM, &sigact, NULL);
+
+  for (i = 0; i < nusers; i++) {
+    for (try = 1; try <= NOTIFY_TRIES; try++) {
+      alarm(notify_timeout);
+      ret = nf->announce(users[i], port, arg);
+      alarm(0);
+      if (ret != NOTIFY_AGAIN)
+	break;
+      if (try < NOTIFY_TRIES)
+	sleep(try);
+    }
+    if (ret != 0)
+      missed++;
+  }
+  _exit(missed > 255 ? 255 : missed);
+}
+
+/* start telling users to connect to port, and return without waiting */
+void
+notify_start(const knotifier *nf, char **users, int nusers, int port,
+	     const char *arg) {
+  char hostname[NS_MAXDNAME + 1];
+  char *sender;
+  struct sigaction sigact;
+  sigset_t chld, old;
+  int pid, i;
+
+  our_hostname(hostname, sizeof(hostname));
+  sender = our_username();
+  snprintf(notify_line, sizeof(notify_line), "ktalk %s %s %i", sender,
+	   hostname, port);
+  free(sender);
+
+  /* nothing to wait for */
+  if (nf == &notify_none) {
+    for (i = 0; i < nusers; i++)
+      nf->announce(users[i], port, arg);
+    return;
+  }
+
+  sigemptyset(&sigact.sa_mask);
+  sigact.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigact.sa_handler = reap_notifier;
+  sigaction(SIGCHLD, &sigact, NULL);
+
+  /* so it cannot be reaped before we know its pid */
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, &old);
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    announce_all(nf, users, nusers, port, arg);
+  }
+  if (pid < 0) {
+    fprintf(stderr, "could not fork to send connection message\n");
+  } else {
+    debug("notifying with %s, pid %d", nf->name, pid);
+    notify_pid = pid;
+    notify_reported = 0;
+  }
+  sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Once the notifier has finished, how many people it could not reach,
+ * reported just once; -1 until then, and after.
+ */
+int
+notify_finished(void) {
+  if (notify_reported || notify_pid)
+    return -1;
+  notify_reported = 1;
+  return WIFEXITED(notify_status) ? WEXITSTATUS(notify_status) : 1;
+}
+
+/* 1 while there is still a result to come */
+int
+notify_pending(void) {
+  return !notify_reported;
+}
+
+/* what to tell people by hand when the notifier could not */
+const char *
+notify_command(void) {
+  return notify_line;
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
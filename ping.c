@@ -0,0 +1,189 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+
+/*
+ * Keepalive.  When both ends offer "ping", each sends a PING frame with
+ * the time on it every quarter of ping_secs (-p), every PING_EVERY at
+ * most, and the other sends the same eight bytes straight back in a PONG.
+ * That gives the round trip time, smoothed the way TCP does it, for the
+ * separator line along with how fast data is moving; and when nothing at
+ * all has come from the peer for ping_secs, the connection is dead.
+ *
+ * Pings go on the control channel, whose fast path sequence numbers are
+ * its own, so none of chat's are used up.  "ping" is only agreed along
+ * with "chan", and a peer that does not know it never sees one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ktalk.h"
+
+#define PING_EVERY	5000000LL	/* microseconds between pings, at most */
+
+int ping_secs = 30;		/* silence before we give up, 0 for never */
+
+static int pinging = 0;
+static long long last_heard, last_ping;
+static long long rtt, srtt = -1;
+static long long rate_at, rate_in, rate_out;	/* byte counts, and when */
+static double in_rate, out_rate;	/* bytes a second since then */
+
+static long long
+ping_every(void) {
+  long long every = ping_secs * 1000000LL / 4;
+
+  return every < PING_EVERY ? every : PING_EVERY;
+}
+
+/* what the separator line says about the connection */
+static void
+show_ping(void) {
+  char buf[128];
+  int n;
+
+  if (srtt < 0)
+    return;
+  n = snprintf(buf, sizeof(buf), "rtt %.1fms, avg %.1fms", rtt / 1000.0,
+	       srtt / 1000.0);
+  if (in_rate >= 1024)
+    n += snprintf(buf + n, sizeof(buf) - n, ", %.0f KB/s in",
+		  in_rate / 1024);
+  if (out_rate >= 1024)
+    snprintf(buf + n, sizeof(buf) - n, ", %.0f KB/s out", out_rate / 1024);
+  set_status(STATUS_PING, buf);
+}
+
+/* bytes a second either way since the last time, once a second at most */
+static void
+take_rates(long long now) {
+  long long in, out;
+  double secs;
+
+  secs = (now - rate_at) / 1e6;
+  if (secs < 1)
+    return;
+  in = stat_sum(ST_READ);
+  out = stat_sum(ST_WRITE);
+  in_rate = (in - rate_in) / secs;
+  out_rate = (out - rate_out) / secs;
+  rate_at = now;
+  rate_in = in;
+  rate_out = out;
+  show_ping();
+}
+
+/* start the clocks, once the handshake is done */
+void
+ping_start(kconn *c) {
+  pinging = (c->caps & CAP_PING) && ping_secs > 0;
+  last_heard = last_ping = rate_at = now_usec();
+  rate_in = stat_sum(ST_READ);
+  rate_out = stat_sum(ST_WRITE);
+  if (pinging)
+    debug("pinging every %lld ms", ping_every() / 1000);
+}
+
+/* something has come from the peer, so they are still there */
+void
+ping_heard(void) {
+  last_heard = now_usec();
+}
+
+/* milliseconds until ping_tick() has something to do, or -1 */
+int
+ping_timeout(void) {
+  long long next, left;
+
+  if (!pinging)
+    return -1;
+  next = last_ping + ping_every();
+  if (last_heard + ping_secs * 1000000LL < next)
+    next = last_heard + ping_secs * 1000000LL;
+  /* while data is moving, the rates want taking every second */
+  if ((in_rate >= 1024 || out_rate >= 1024) && rate_at + 1000000 < next)
+    next = rate_at + 1000000;
+  left = next - now_usec();
+  return left > 0 ? (int)((left + 999) / 1000) : 0;
+}
+
+/* send a ping if one is due, and give up on a peer gone quiet */
+void
+ping_tick(kconn *c) {
+  unsigned char buf[8];
+  char msg[128];
+  long long now;
+
+  if (!pinging)
+    return;
+  now = now_usec();
+  if (now - last_heard >= ping_secs * 1000000LL) {
+    snprintf(msg, sizeof(msg), "nothing from the other party in %d seconds, "
+	     "giving up", ping_secs);
+    bye(msg);
+  }
+  if (now - last_ping >= ping_every()) {
+    put64(buf, now);
+    if (send_sealed(c, FRAME_PING, (char *)buf, sizeof(buf)) < 0) {
+      if (errno != ENOBUFS)
+	fail(errno, "sending to party");
+    } else {
+      last_ping = now;
+    }
+  }
+  take_rates(now);
+}
+
+/*
+ * A PING to answer or a PONG to time.  Anyone who has agreed to "ping"
+ * answers, whether or not they send pings of their own.  Returns -1 with
+ * errno set if the answer could not be sent for good.
+ */
+int
+ping_receive(kconn *c, int type, krb5_data *msg) {
+  long long sample;
+
+  if (msg->length < 8)
+    return 0;
+  if (type == FRAME_PING) {
+    /* with the queue full this one goes unanswered; the next will do */
+    if (send_sealed(c, FRAME_PONG, msg->data, 8) < 0 && errno != ENOBUFS)
+      return -1;
+    return 0;
+  }
+
+  sample = now_usec() - get64((unsigned char *)msg->data);
+  if (sample < 0)
+    return 0;
+  rtt = sample;
+  srtt = srtt < 0 ? rtt : (7 * srtt + rtt) / 8;
+  debug("round trip %lld us, smoothed %lld us", rtt, srtt);
+  show_ping();
+  return 0;
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
@@ -0,0 +1,251 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+ * Pipe mode (-P), an encrypted netcat.  Whatever comes in on stdin goes
+ * out on the other party's stdout, byte for byte, and theirs comes out on
+ * ours.  Input is read as it arrives, up to a chunk at a time, and sent
+ * as PIPE frames on the bulk channel, so it has the window and the pool
+ * behind it just as a file does.  At the end of input a PIPE_END follows,
+ * and the other side closes its stdout on it.  The two directions end on
+ * their own, and ktalk leaves once both have and all is sent.
+ *
+ * Stdout is written without blocking, so a slow reader there never stalls
+ * the connection, pings and all.  What it will not take yet waits in a
+ * queue, and while anything does no more window is granted, so the other
+ * side stops sending until it has gone.
+ *
+ * Both ends must be run with -P, which they agree on as "pipe".  Nothing
+ * but data goes to stdout, so everything ktalk has to say goes to stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "ktalk.h"
+
+int pipe_mode = 0;
+
+static int pipe_out = -1;	/* the real stdout, where data goes */
+static int out_flags;		/* its flags, to put back */
+static int sent_end = 0, got_end = 0;
+static char chunk[XFER_CHUNK];
+static char *queue = NULL;	/* for stdout, from qoff to qlen */
+static size_t qoff = 0, qlen = 0, qsize = 0;
+
+/* keep stdout for the data, and send everything else to stderr */
+void
+pipe_setup(void) {
+  fflush(stdout);
+  pipe_out = dup(fileno(stdout));
+  if (pipe_out < 0 || dup2(fileno(stderr), fileno(stdout)) < 0)
+    fail(errno, "setting up the pipe");
+  fcntl(pipe_out, F_SETFD, FD_CLOEXEC);
+  out_flags = fcntl(pipe_out, F_GETFL, 0);
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  local_caps |= CAP_PIPE;
+}
+
+/* the other end must be piping too, or the data has nowhere to go */
+void
+pipe_start(kconn *c) {
+  if (!(c->caps & CAP_PIPE)) {
+    fprintf(stderr, "the other party is not in pipe mode (-P)\n");
+    exit(1);
+  }
+  if (set_nonblock(pipe_out) < 0)
+    fail(errno, "setting up the pipe");
+}
+
+/* whether to read stdin now: it is still open and there is room to send */
+int
+pipe_wants_input(kconn *c) {
+  return !sent_end && chan_bulk_room(c);
+}
+
+/* stdin is readable; send what is there, or the end if that is all */
+void
+pipe_send_next(kconn *c) {
+  int n;
+
+  n = read(fileno(stdin), chunk, sizeof(chunk));
+  if (n < 0) {
+    if (errno == EINTR || errno == EAGAIN)
+      return;
+    fail(errno, "reading from stdin");
+  }
+  if (n == 0) {
+    if (send_sealed(c, FRAME_PIPE_END, "", 0) < 0)
+      fail(errno, "sending to party");
+    sent_end = 1;
+    return;
+  }
+  if (send_sealed(c, FRAME_PIPE, chunk, n) < 0)
+    fail(errno, "sending to party");
+}
+
+/* write as much of data as stdout will take now, and say how much */
+static size_t
+write_some(const char *data, size_t len) {
+  size_t off;
+  int n;
+
+  for (off = 0; off < len; off += n) {
+    n = write(pipe_out, data + off, len - off);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	break;
+      if (errno == EINTR) {
+	n = 0;
+	continue;
+      }
+      fail(errno, "writing to stdout");
+    }
+  }
+  return off;
+}
+
+static void
+close_out(void) {
+  ev_set(pipe_out, 0, NULL);
+  fcntl(pipe_out, F_SETFL, out_flags);
+  close(pipe_out);
+  pipe_out = -1;
+}
+
+void
+pipe_receive(kconn *c, int type, krb5_data *msg) {
+  size_t off = 0, want;
+
+  if (pipe_out < 0)
+    return;
+  if (type == FRAME_PIPE_END) {
+    got_end = 1;
+    if (qoff == qlen)
+      close_out();
+    return;
+  }
+  if (qoff == qlen)
+    off = write_some(msg->data, msg->length);
+  if (off == msg->length)
+    return;
+
+  /* the rest waits its turn */
+  if (qoff) {
+    memmove(queue, queue + qoff, qlen - qoff);
+    qlen -= qoff;
+    qoff = 0;
+  }
+  if (qlen + msg->length - off > qsize) {
+    want = qsize ? qsize : XFER_CHUNK * 2;
+    while (want < qlen + msg->length - off)
+      want *= 2;
+    queue = realloc(queue, want);
+    if (!queue)
+      fail(errno, "allocating pipe buffer");
+    qsize = want;
+  }
+  memcpy(queue + qlen, msg->data + off, msg->length - off);
+  qlen += msg->length - off;
+  c->bulk_held = 1;
+}
+
+/* watch stdout while there is something for it */
+void
+pipe_watch(void) {
+  if (pipe_out >= 0)
+    ev_set(pipe_out, qoff < qlen ? EV_WRITE : 0, NULL);
+}
+
+int
+pipe_fd(void) {
+  return pipe_out;
+}
+
+/* stdout has room; write what is waiting, and close it if that was all */
+void
+pipe_flush(kconn *c) {
+  qoff += write_some(queue + qoff, qlen - qoff);
+  if (qoff < qlen)
+    return;
+  qoff = qlen = 0;
+  c->bulk_held = 0;
+  if (got_end)
+    close_out();
+}
+
+/* both ways have ended */
+int
+pipe_done(void) {
+  return sent_end && got_end;
+}
+
+/*
+ * Everything is sent; leave once the other side has it.  Closing with
+ * anything unread would reset the connection and lose what is still on
+ * its way, so only shut our half and take what comes until theirs is
+ * shut too.  Nothing more is sent, not even an answer to a ping.
+ */
+void
+pipe_finish(kconn *c) {
+  kframe frame;
+  kev ev;
+  int ret;
+
+  /* nothing else is left to do, so the last of stdout can wait */
+  if (pipe_out >= 0) {
+    fcntl(pipe_out, F_SETFL, out_flags);
+    pipe_flush(c);
+  }
+  if (shutdown(c->fd, SHUT_WR) < 0)
+    fail(errno, "shutting down connection");
+  ev_set(fileno(stdin), 0, NULL);
+  if (c->pool)
+    ev_set(pool_fd(c->pool), 0, NULL);
+  if (dgram_fd() >= 0)
+    ev_set(dgram_fd(), 0, NULL);
+  ev_set(c->fd, EV_READ, NULL);
+  for (;;) {
+    ret = ev_wait(&ev, 1, ping_secs > 0 ? ping_secs * 1000 : -1);
+    if (ret < 0 && errno != EINTR)
+      fail(errno, "waiting for data");
+    if (ret == 0)
+      break;
+    ret = conn_fill(c);
+    if (ret == 0)
+      break;
+    if (ret < 0 && errno != EINTR && errno != EAGAIN)
+      break;
+    while (conn_frame(c, &frame) > 0)
+      ;
+  }
+  exit(0);
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
@@ -0,0 +1,442 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+
+/*
+ * Sealing and opening bulk data on more than one core.  krb5_mk_priv
+ * takes every frame through one auth context in turn, but fast path
+ * frames on the bulk channel each carry their own sequence number under
+ * a key derived from the session key, so any thread with that key can
+ * seal or open one.  The pool has a thread for each spare core, each
+ * with a krb5 context and key objects of its own.
+ *
+ * The main thread still numbers the frames and sends and handles them in
+ * order: a frame goes into a ring when it is numbered (or read), the
+ * workers take whichever are waiting, and the ring is emptied from the
+ * oldest end as they finish.  At most depth frames are in each ring, so
+ * what is in memory stays bounded whatever the size of the file.  A byte
+ * down the wake pipe tells the event loop when something is done.  How
+ * long a worker took goes with the job, and the main thread counts it in
+ * the stats as it sends or handles the frame, so they stay its own.
+ *
+ * Chat never comes here: it stays on the ordered path in fast.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "ktalk.h"
+
+#define POOL_MAX	8	/* threads at most */
+#define POOL_DEPTH	16	/* frames in each ring at most */
+
+#define JOB_FREE	0
+#define JOB_QUEUED	1
+#define JOB_BUSY	2
+#define JOB_DONE	3
+
+typedef struct kjob {
+  int state;			/* only changed under the lock */
+  int type, flags;
+  long long seq;
+  size_t len;			/* the data, or the frame body to open */
+  size_t need;			/* the sealed body */
+  unsigned int padlen;
+  char *buf;			/* FRAME_MAXLEN, kept from job to job */
+  krb5_data msg;		/* what opening it gave */
+  krb5_error_code err;
+  long long usec;		/* how long sealing or opening took */
+} kjob;
+
+typedef struct kring {
+  kjob job[POOL_DEPTH];
+  int first, count;		/* the oldest job, and how many there are */
+} kring;
+
+typedef struct kworker {
+  kpool *pool;
+  pthread_t thread;
+  krb5_context context;		/* contexts are not to be shared */
+  krb5_key sendkey, recvkey;
+} kworker;
+
+struct kpool {
+  kfast *fast;
+  int nworkers, depth;
+  kworker worker[POOL_MAX];
+  pthread_mutex_t lock;
+  pthread_cond_t work, done;
+  kring seal, open;
+  size_t sealing;		/* bytes in the seal ring */
+  size_t reserved;		/* and write buffer kept for their frames */
+  int held;			/* the oldest opened job is with the caller */
+  int wake[2];
+  int quit;
+};
+
+int pool_workers = -1;
+
+/* the oldest job waiting for a worker, opening or sealing; under the lock */
+static kjob *
+next_job(kpool *p, int *seal) {
+  kring *r;
+  int i, k;
+
+  for (k = 0; k < 2; k++) {
+    r = k ? &p->open : &p->seal;
+    for (i = 0; i < r->count; i++) {
+      if (r->job[(r->first + i) % POOL_DEPTH].state == JOB_QUEUED) {
+	*seal = !k;
+	return &r->job[(r->first + i) % POOL_DEPTH];
+      }
+    }
+  }
+  return NULL;
+}
+
+static void *
+work(void *arg) {
+  kworker *w = arg;
+  kpool *p = w->pool;
+  kjob *j;
+  long long start;
+  int seal;
+
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    while (!p->quit && !(j = next_job(p, &seal)))
+      pthread_cond_wait(&p->work, &p->lock);
+    if (p->quit)
+      break;
+    j->state = JOB_BUSY;
+    pthread_mutex_unlock(&p->lock);
+
+    start = now_usec();
+    if (seal)
+      fast_seal_body(w->context, w->sendkey, p->fast, j->type, j->seq,
+		     j->buf, j->len, j->padlen);
+    else
+      j->err = fast_open_body(w->context, w->recvkey, j->type, j->seq,
+			      j->buf, j->len, &j->msg);
+    j->usec = now_usec() - start;
+
+    pthread_mutex_lock(&p->lock);
+    j->state = JOB_DONE;
+    pthread_cond_broadcast(&p->done);
+    if (write(p->wake[1], "", 1) < 0 && errno != EAGAIN)
+      debug("waking the event loop: %s", strerror(errno));
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+/*
+ * A pool for f's keys, with pool_workers threads, or one for each core
+ * but ours if that is -1.  NULL if that comes to none.
+ */
+kpool *
+pool_start(kfast *f) {
+  kworker *w;
+  kpool *p;
+  long n;
+  int i, ret;
+
+  n = pool_workers;
+  if (n < 0)
+    n = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  if (n > POOL_MAX)
+    n = POOL_MAX;
+  if (n < 1)
+    return NULL;
+
+  p = calloc(1, sizeof(*p));
+  if (!p)
+    fail(errno, "allocating the crypto pool");
+  p->fast = f;
+  p->nworkers = n;
+  p->depth = 2 * n < POOL_DEPTH ? 2 * n : POOL_DEPTH;
+  if (pipe(p->wake) < 0 || set_nonblock(p->wake[0]) < 0
+      || set_nonblock(p->wake[1]) < 0)
+    fail(errno, "making the crypto pool's pipe");
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work, NULL);
+  pthread_cond_init(&p->done, NULL);
+
+  for (i = 0; i < n; i++) {
+    w = &p->worker[i];
+    w->pool = p;
+    ret = krb5_init_context(&w->context);
+    if (ret)
+      fail(ret, "krb5_init_context");
+    w->sendkey = fast_key(w->context, f, 1);
+    w->recvkey = fast_key(w->context, f, 0);
+    ret = pthread_create(&w->thread, NULL, work, w);
+    if (ret)
+      fail(ret, "starting the crypto pool");
+  }
+  debug("sealing bulk data on %d threads, %d frames deep", p->nworkers,
+	p->depth);
+  return p;
+}
+
+void
+pool_free(kpool *p) {
+  kworker *w;
+  int i;
+
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+  for (i = 0; i < p->nworkers; i++) {
+    w = &p->worker[i];
+    pthread_join(w->thread, NULL);
+    krb5_k_free_key(w->context, w->sendkey);
+    krb5_k_free_key(w->context, w->recvkey);
+    krb5_free_context(w->context);
+  }
+  for (i = 0; i < POOL_DEPTH; i++) {
+    free(p->seal.job[i].buf);
+    free(p->open.job[i].buf);
+  }
+  close(p->wake[0]);
+  close(p->wake[1]);
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->work);
+  pthread_cond_destroy(&p->done);
+  free(p);
+}
+
+/* what the event loop should wait on, or -1 */
+int
+pool_fd(kpool *p) {
+  return p ? p->wake[0] : -1;
+}
+
+/* frames still being sealed or opened, or waiting to be sent or handled */
+int
+pool_jobs(kpool *p) {
+  return p ? p->seal.count + p->open.count : 0;
+}
+
+/*
+ * Write buffer kept for frames in the seal ring.  A frame only goes in
+ * once fast_send() has found room for it, and that room stays kept, so
+ * writing it out when it is sealed can never fail for want of room.
+ */
+size_t
+pool_reserved(kpool *p) {
+  return p ? p->reserved : 0;
+}
+
+/*
+ * May another bulk frame be sealed: the ones sealing and the ones sealed
+ * but not yet written come to less than depth, and the window has room
+ * for them all.
+ */
+int
+pool_room(kconn *c) {
+  kpool *p = c->pool;
+
+  return c->bulk_waiting + p->seal.count < p->depth
+      && c->bulk_sent + p->sealing - c->bulk_acked < CHAN_WINDOW;
+}
+
+/* the next free job in r, with its buffer */
+static kjob *
+add_job(kring *r) {
+  kjob *j = &r->job[(r->first + r->count) % POOL_DEPTH];
+
+  if (!j->buf) {
+    j->buf = malloc(FRAME_MAXLEN);
+    if (!j->buf)
+      fail(errno, "allocating the crypto pool");
+  }
+  return j;
+}
+
+/* hand the job add_job() gave to the workers */
+static void
+queue_job(kpool *p, kring *r) {
+  pthread_mutex_lock(&p->lock);
+  r->job[(r->first + r->count) % POOL_DEPTH].state = JOB_QUEUED;
+  r->count++;
+  pthread_cond_signal(&p->work);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* the oldest job in r, once it is done; with wait, wait until it is */
+static kjob *
+oldest(kpool *p, kring *r, int wait) {
+  kjob *j = &r->job[r->first];
+  int state;
+
+  if (!r->count)
+    return NULL;
+  pthread_mutex_lock(&p->lock);
+  while (wait && j->state != JOB_DONE)
+    pthread_cond_wait(&p->done, &p->lock);
+  state = j->state;
+  pthread_mutex_unlock(&p->lock);
+  return state == JOB_DONE ? j : NULL;
+}
+
+static void
+drop_oldest(kpool *p, kring *r) {
+  pthread_mutex_lock(&p->lock);
+  r->job[r->first].state = JOB_FREE;
+  r->first = (r->first + 1) % POOL_DEPTH;
+  r->count--;
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* send what has been sealed, in order; with wait, the oldest at least */
+static int
+send_sealed_jobs(kconn *c, int wait) {
+  kpool *p = c->pool;
+  kjob *j;
+
+  while ((j = oldest(p, &p->seal, wait))) {
+    p->reserved -= FRAME_HDRLEN + j->need;
+    if (conn_send(c, j->type, FRAME_F_FAST, j->buf, j->need) < 0) {
+      p->reserved += FRAME_HDRLEN + j->need;
+      return -1;
+    }
+    stat_add(ST_SEAL, j->usec);
+    TRACE(TR_SEAL, j->type, j->len, j->usec);
+    p->sealing -= j->need;
+    drop_oldest(p, &p->seal);
+    wait = 0;
+  }
+  return 0;
+}
+
+/*
+ * Seal a bulk frame on the pool; fast_send() has numbered it.  Only a
+ * full ring makes this wait, for its oldest frame to be sealed and sent.
+ */
+int
+pool_seal(kconn *c, int type, long long seq, const char *data, size_t len,
+	  size_t off, unsigned int padlen, size_t need) {
+  kpool *p = c->pool;
+  kjob *j;
+
+  if (p->seal.count == p->depth && send_sealed_jobs(c, 1) < 0)
+    return -1;
+  j = add_job(&p->seal);
+  memcpy(j->buf + off, data, len);
+  j->type = type;
+  j->seq = seq;
+  j->len = len;
+  j->padlen = padlen;
+  j->need = need;
+  p->sealing += need;
+  p->reserved += FRAME_HDRLEN + need;
+  queue_job(p, &p->seal);
+  return len;
+}
+
+/* send whatever the workers have finished sealing */
+void
+pool_flush(kconn *c) {
+  kpool *p = c->pool;
+  char buf[64];
+
+  if (!p)
+    return;
+  while (read(p->wake[0], buf, sizeof(buf)) > 0)
+    ;
+  if (send_sealed_jobs(c, 0) < 0 && errno != ENOBUFS)
+    fail(errno, "sending file data to party");
+}
+
+/*
+ * Take an incoming frame to be opened on the pool, if it is bulk data.
+ * Returns 1 if it was taken, 0 if it is for the caller to open, or -1 if
+ * the ring is full and the caller must handle some with pool_opened()
+ * first.  The frame's sequence number is checked and used up here.
+ */
+int
+pool_open(kconn *c, kframe *f) {
+  kpool *p = c->pool;
+  krb5_error_code ret;
+  long long seq;
+  kjob *j;
+
+  if (!p || f->chan != CHAN_BULK || !(f->flags & FRAME_F_FAST) || c->zip)
+    return 0;
+  if (p->open.count == p->depth)
+    return -1;
+  ret = fast_claim(p->fast, f, &seq);
+  if (ret)
+    fail(ret, "opening message");
+  j = add_job(&p->open);
+  memcpy(j->buf, f->data, f->len);
+  j->type = f->type;
+  j->flags = f->flags;
+  j->seq = seq;
+  j->len = f->len;
+  queue_job(p, &p->open);
+  return 1;
+}
+
+/*
+ * The next frame the pool has opened, in the order they came; with wait,
+ * wait for one if there are any.  frame and msg are good until the next
+ * call.  Returns 1 for a frame, 0 if there is none yet.
+ */
+int
+pool_opened(kconn *c, kframe *f, krb5_data *msg, int wait) {
+  kpool *p = c->pool;
+  kjob *j;
+
+  if (!p)
+    return 0;
+  if (p->held) {
+    drop_oldest(p, &p->open);
+    p->held = 0;
+  }
+  j = oldest(p, &p->open, wait);
+  if (!j)
+    return 0;
+  if (j->err)
+    fail(j->err, "opening message");
+  stat_add(ST_OPEN, j->usec);
+  TRACE(TR_OPEN, j->type, j->len, j->usec);
+  f->type = j->type;
+  f->flags = j->flags;
+  f->chan = CHAN_BULK;
+  f->caps = 0;
+  f->data = j->buf;
+  f->len = j->len;
+  *msg = j->msg;
+  p->held = 1;
+  return 1;
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
@@ -0,0 +1,162 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+ * Drawing what the other side says.  Incoming text is gathered here and
+ * put in the receive window at most render_rate times a second, so a
+ * pasted page costs one screen update rather than one per line.  Text
+ * that would scroll straight off the window before anyone saw it is never
+ * drawn at all.  Without curses the same goes for flushing stdout.
+ *
+ * Anything that draws in the receive window itself must call render_sync()
+ * first, so it lands after the text that came before it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ktalk.h"
+
+/* past this much undrawn text, throw away what is already off the screen */
+#define RENDER_COLLAPSE	65536
+
+int render_rate = 30;		/* screen updates a second, 0 for no limit */
+
+static char *pending = NULL;
+static size_t pendlen = 0, pendsize = 0;
+static int dirty = 0;
+static long long next_frame = 0;
+
+/*
+ * Drop the front of the pending text if what follows it fills the window
+ * by itself.  That is true once there are more whole lines after the cut
+ * than the window is high, however they wrap.
+ */
+static void
+collapse(void) {
+  int height, lines = 0;
+  size_t i;
+
+  height = getmaxy(receivewin);
+  for (i = pendlen; i > 0; i--) {
+    if (pending[i - 1] == '\n' && ++lines > height)
+      break;
+  }
+  if (i == 0)
+    return;
+  debug("not drawing %lu bytes that scrolled away", (unsigned long)i);
+  memmove(pending, pending + i, pendlen - i);
+  pendlen -= i;
+}
+
+/* text from the peer, to be drawn when the next frame is due */
+void
+render_text(const char *text, size_t len) {
+  size_t want;
+
+  dirty = 1;
+  log_record(LOG_RECV, text, len);
+  if (!use_curses) {
+    fwrite(text, 1, len, stdout);
+    return;
+  }
+  scroll_add(SCROLL_RECV, text, len);
+
+  if (pendlen + len > pendsize) {
+    want = pendsize ? pendsize : 4096;
+    while (want < pendlen + len)
+      want *= 2;
+    pending = realloc(pending, want);
+    if (!pending)
+      fail(errno, "allocating screen buffer");
+    pendsize = want;
+  }
+  memcpy(pending + pendlen, text, len);
+  pendlen += len;
+  if (pendlen > RENDER_COLLAPSE)
+    collapse();
+}
+
+static void
+draw(void) {
+  long long start = now_usec();
+
+  if (use_curses) {
+    /* while scrolled back it is in the scrollback, and drawn from there */
+    if (!scroll_active()) {
+      collapse();
+      TRACE(TR_RENDER, 0, pendlen, 0);
+      waddnstr(receivewin, pending, pendlen);
+      wnoutrefresh(receivewin);
+    }
+    pendlen = 0;
+  } else {
+    fflush(stdout);
+  }
+  dirty = 0;
+  stat_time(ST_RENDER, start);
+}
+
+/* put everything gathered so far in the window, due or not */
+void
+render_sync(void) {
+  if (dirty)
+    draw();
+}
+
+/* milliseconds until the next frame is due, or -1 if there is nothing */
+int
+render_timeout(void) {
+  long long left;
+
+  if (!dirty)
+    return -1;
+  if (!render_rate)
+    return 0;
+  left = next_frame - now_usec();
+  return left > 0 ? (int)((left + 999) / 1000) : 0;
+}
+
+/*
+ * Draw what is waiting if a frame is due, or now if forced.  Returns 1 if
+ * anything was drawn, for the caller to doupdate().
+ */
+int
+render_flush(int force) {
+  long long now;
+
+  if (!dirty)
+    return 0;
+  now = now_usec();
+  if (!force && render_rate && now < next_frame)
+    return 0;
+  draw();
+  if (render_rate)
+    next_frame = now + 1000000 / render_rate;
+  return 1;
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
@@ -0,0 +1,559 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+ * Rooms.  The host (ktalk -m) keeps accepting user-to-user connections
+ * from the people it invited, each with its own auth context.  Members
+ * send their lines to the host with krb5_mk_priv as in a two party talk.
+ * The host picks a random room key and hands it to every member over its
+ * own channel, then seals each line once under that key, with the sender
+ * and a sequence number inside, and writes the same frame to everyone.
+ * Members whose ktalk predates rooms get the line with krb5_mk_priv.
+ *
+ * A new key, with a new epoch, goes out whenever someone joins or leaves,
+ * so only the people in the room can read what is said in it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include "ktalk.h"
+
+/* not offered to members; compression would cost a stream each */
+#define ROOM_NOCAPS	(CAP_FILE | CAP_LIVE | CAP_FAST | CAP_ZLIB | CAP_CHAN \
+			 | CAP_PING)
+
+typedef struct kmember {
+  kconn conn;
+  krb5_auth_context auth_context;
+  char *principal;		/* who they authenticated as */
+  int joined;			/* handshake is done */
+  int dead;			/* to be dropped at the end of this pass */
+} kmember;
+
+static kmember *members[ROOM_MAX];
+static int nmembers = 0;
+static char **invited;
+static int ninvited;
+
+/* the current room key, on both the host and the members */
+static krb5_keyblock roomkey;
+static krb5_ui_4 epoch = 0;
+static krb5_ui_4 roomseq = 0;	/* last line sealed (host) or seen (member) */
+
+/* buffers reused for every line */
+static char *plainbuf = NULL, *sealbuf = NULL;
+static size_t plainsize = 0, sealsize = 0;
+
+static void
+grow(char **buf, size_t *size, size_t want) {
+  if (*size >= want)
+    return;
+  *buf = realloc(*buf, want);
+  if (!*buf)
+    fail(errno, "allocating room buffer");
+  *size = want;
+}
+
+/* seal seq, sender and text under the room key, returning the frame body */
+static krb5_error_code
+room_seal(krb5_context context, const char *sender, const char *text,
+	  size_t len, size_t *outlen) {
+  krb5_enc_data enc;
+  krb5_data input;
+  size_t sendlen, plainlen, cipherlen;
+  krb5_error_code ret;
+
+  sendlen = strlen(sender) + 1;
+  plainlen = 4 + sendlen + len + 1;
+  grow(&plainbuf, &plainsize, plainlen);
+  put32((unsigned char *)plainbuf, ++roomseq);
+  memcpy(plainbuf + 4, sender, sendlen);
+  memcpy(plainbuf + 4 + sendlen, text, len);
+  plainbuf[plainlen - 1] = '\0';
+
+  ret = krb5_c_encrypt_length(context, roomkey.enctype, plainlen, &cipherlen);
+  if (ret)
+    return ret;
+  grow(&sealbuf, &sealsize, 4 + cipherlen);
+
+  put32((unsigned char *)sealbuf, epoch);
+  input.data = plainbuf;
+  input.length = plainlen;
+  memset(&enc, 0, sizeof(enc));
+  enc.ciphertext.data = sealbuf + 4;
+  enc.ciphertext.length = cipherlen;
+  ret = krb5_c_encrypt(context, &roomkey, KU_ROOM, NULL, &input, &enc);
+  if (ret)
+    return ret;
+  *outlen = 4 + enc.ciphertext.length;
+  return 0;
+}
+
+static void
+room_show(const char *sender, const char *text, size_t len) {
+  render_text(sender, strlen(sender));
+  render_text(": ", 2);
+  render_text(text, len);
+}
+
+/*
+ * Members: take a new room key from the host.  Sequence numbers start over
+ * with each key.
+ */
+void
+room_setkey(krb5_context context, krb5_data *msg) {
+  const unsigned char *p = (const unsigned char *)msg->data;
+
+  if (msg->length < 9) {
+    debug("ignoring a short room key");
+    return;
+  }
+  if (epoch)
+    krb5_free_keyblock_contents(context, &roomkey);
+  roomkey.enctype = get32(p + 4);
+  roomkey.length = msg->length - 8;
+  roomkey.contents = malloc(roomkey.length);
+  if (!roomkey.contents)
+    fail(errno, "allocating room key");
+  memcpy(roomkey.contents, p + 8, roomkey.length);
+  epoch = get32(p);
+  roomseq = 0;
+  debug("room key epoch is now %u", epoch);
+}
+
+/* members: open and show a line the host sealed under the room key */
+void
+room_receive(krb5_context context, kframe *frame) {
+  krb5_enc_data enc;
+  krb5_data out;
+  krb5_ui_4 seq;
+  char *sender, *text, *end;
+  int ret;
+
+  if (!epoch || frame->len < 4) {
+    debug("room line with no room key");
+    return;
+  }
+  if (get32((unsigned char *)frame->data) != epoch) {
+    debug("room line under an old key");
+    return;
+  }
+
+  memset(&enc, 0, sizeof(enc));
+  enc.enctype = roomkey.enctype;
+  enc.ciphertext.data = frame->data + 4;
+  enc.ciphertext.length = frame->len - 4;
+  grow(&plainbuf, &plainsize, frame->len);
+  out.data = plainbuf;
+  out.length = frame->len;
+  ret = krb5_c_decrypt(context, &roomkey, KU_ROOM, NULL, &enc, &out);
+  if (ret)
+    fail(ret, "krb5_c_decrypt");
+
+  end = out.data + out.length;
+  if (out.length < 6 || !memchr(out.data + 4, '\0', out.length - 4)) {
+    debug("malformed room line");
+    return;
+  }
+  seq = get32((unsigned char *)out.data);
+  if (seq <= roomseq) {
+    debug("dropping replayed room line %u", seq);
+    return;
+  }
+  roomseq = seq;
+  sender = out.data + 4;
+  text = sender + strlen(sender) + 1;
+  room_show(sender, text, strnlen(text, end - text));
+}
+
+/* host: the same frame to every member that has the key, mk_priv to others */
+static void
+room_fanout(krb5_context context, const char *sender, const char *text,
+	    size_t len) {
+  char *legacy = NULL;
+  size_t seallen, legacylen = 0;
+  kmember *m;
+  int i, ret;
+
+  ret = room_seal(context, sender, text, len, &seallen);
+  if (ret)
+    fail(ret, "krb5_c_encrypt");
+
+  for (i = 0; i < nmembers; i++) {
+    m = members[i];
+    if (!m->joined || m->dead)
+      continue;
+    if (m->conn.caps & CAP_ROOM) {
+      ret = conn_send(&m->conn, FRAME_ROOM, 0, sealbuf, seallen);
+    } else {
+      if (!legacy) {
+	legacylen = strlen(sender) + 2 + len;
+	legacy = malloc(legacylen + 1);
+	if (!legacy)
+	  fail(errno, "allocating room line");
+	snprintf(legacy, legacylen + 1, "%s: %.*s", sender, (int)len, text);
+      }
+      ret = send_sealed(&m->conn, FRAME_DATA,
+			legacy, legacylen + 1);
+    }
+    if (ret < 0) {
+      if (errno == ENOBUFS)
+	notice("dropping %s, who is not keeping up", m->principal);
+      m->dead = 1;
+    }
+  }
+  free(legacy);
+}
+
+/* host: say something to the room as ourselves */
+static void
+room_announce(krb5_context context, const char *me, const char *format, ...) {
+  va_list ap;
+  char buf[1024];
+
+  va_start(ap, format);
+  vsnprintf(buf, sizeof(buf), format, ap);
+  va_end(ap);
+
+  notice("%s", buf);
+  strncat(buf, "\n", sizeof(buf) - strlen(buf) - 1);
+  room_fanout(context, me, buf, strlen(buf));
+}
+
+/* host: pick a new room key and hand it to everyone who understands rooms */
+static void
+room_rekey(krb5_context context, krb5_enctype enctype) {
+  unsigned char *buf;
+  size_t len;
+  kmember *m;
+  int i, ret;
+
+  if (epoch)
+    krb5_free_keyblock_contents(context, &roomkey);
+  ret = krb5_c_make_random_key(context, enctype, &roomkey);
+  if (ret)
+    fail(ret, "krb5_c_make_random_key");
+  epoch++;
+  roomseq = 0;
+
+  len = 8 + roomkey.length;
+  buf = malloc(len);
+  if (!buf)
+    fail(errno, "allocating room key");
+  put32(buf, epoch);
+  put32(buf + 4, roomkey.enctype);
+  memcpy(buf + 8, roomkey.contents, roomkey.length);
+
+  for (i = 0; i < nmembers; i++) {
+    m = members[i];
+    if (!m->joined || m->dead || !(m->conn.caps & CAP_ROOM))
+      continue;
+    if (send_sealed(&m->conn, FRAME_ROOM_KEY,
+		    (char *)buf, len) < 0)
+      m->dead = 1;
+  }
+  memset(buf, 0, len);
+  free(buf);
+  debug("room key epoch is now %u", epoch);
+}
+
+static int
+is_invited(krb5_context context, const char *principal) {
+  krb5_principal princ;
+  char *name;
+  int i, match = 0;
+
+  for (i = 0; i < ninvited && !match; i++) {
+    if (krb5_parse_name(context, invited[i], &princ))
+      continue;
+    if (!krb5_unparse_name(context, princ, &name)) {
+      match = !strcmp(name, principal);
+      free(name);
+    }
+    krb5_free_principal(context, princ);
+  }
+  return match;
+}
+
+static void
+member_accept(krb5_context context, krb5_creds *tgt, int servsock) {
+  kmember *m;
+  int fd, ret;
+
+  fd = accept(servsock, NULL, NULL);
+  if (fd < 0) {
+    if (errno != EINTR)
+      notice("accepting connection: %s", strerror(errno));
+    return;
+  }
+  if (nmembers == ROOM_MAX) {
+    notice("the room is full, turned away a connection");
+    close(fd);
+    return;
+  }
+
+  m = calloc(1, sizeof(*m));
+  if (!m)
+    fail(errno, "allocating room member");
+  conn_init(&m->conn, fd, &transport_tcp);
+  members[nmembers++] = m;
+  if (conn_nonblock(&m->conn) < 0 || set_nodelay(fd) < 0) {
+    m->dead = 1;
+    return;
+  }
+  ev_set(fd, EV_READ, m);
+
+  if (auth_con_setup(context, &m->auth_context, &m->conn) < 0) {
+    m->dead = 1;
+    return;
+  }
+  ret = krb5_auth_con_setuseruserkey(context, m->auth_context,
+				     &tgt->keyblock);
+  if (ret)
+    fail(ret, "krb5_auth_con_setuseruserkey");
+  sec_krb5_attach(&m->conn, context, m->auth_context);
+
+  /* the ticket is small enough to go out without waiting */
+  if (conn_send_ascii(&m->conn, tgt->ticket.data, tgt->ticket.length,
+		      local_caps & ~ROOM_NOCAPS) < 0)
+    m->dead = 1;
+}
+
+static void
+member_join(krb5_context context, krb5_creds *tgt, const char *me,
+	    kmember *m, kframe *frame) {
+  char buf[2048];
+  int i, n, ret;
+
+  m->conn.caps = frame->caps & local_caps & ~ROOM_NOCAPS;
+  ret = read_apreq(context, &m->auth_context, frame, &m->principal);
+  if (ret) {
+    notice("turned away a connection: %s", error_message(ret));
+    m->principal = NULL;
+    m->dead = 1;
+    return;
+  }
+  conn_agree(&m->conn);
+
+  if (!is_invited(context, m->principal)) {
+    notice("turned away %s, who was not invited", m->principal);
+    send_sealed(&m->conn, FRAME_DATA,
+		"You are not invited to this room.\n",
+		strlen("You are not invited to this room.\n") + 1);
+    m->dead = 1;
+    return;
+  }
+
+  snprintf(buf, sizeof(buf), "You are in %s's room", me);
+  for (i = 0, n = 0; i < nmembers; i++) {
+    if (members[i]->joined && !members[i]->dead) {
+      strncat(buf, n++ ? ", " : " with ", sizeof(buf) - strlen(buf) - 1);
+      strncat(buf, members[i]->principal, sizeof(buf) - strlen(buf) - 1);
+    }
+  }
+  strncat(buf, ".\n\n", sizeof(buf) - strlen(buf) - 1);
+  if (send_sealed(&m->conn, FRAME_DATA, buf,
+		  strlen(buf) + 1) < 0) {
+    m->dead = 1;
+    return;
+  }
+
+  m->joined = 1;
+  room_rekey(context, tgt->keyblock.enctype);
+  room_announce(context, me, "%s joined", m->principal);
+}
+
+static void
+member_frame(krb5_context context, const char *me, kmember *m,
+	     kframe *frame) {
+  krb5_data msg;
+  unsigned char id[4];
+  int ret;
+
+  if (frame->type > FRAME_FILE_CANCEL) {
+    debug("ignoring frame of type %d from %s", frame->type, m->principal);
+    return;
+  }
+
+  ret = open_sealed(&m->conn, frame, &msg);
+  if (ret) {
+    notice("dropping %s: %s", m->principal, error_message(ret));
+    m->dead = 1;
+    return;
+  }
+
+  if (frame->type == FRAME_DATA) {
+    room_show(m->principal, msg.data, strnlen(msg.data, msg.length));
+    room_fanout(context, m->principal, msg.data,
+		strnlen(msg.data, msg.length));
+  } else if (frame->type == FRAME_FILE_BEGIN && msg.length >= 4) {
+    /* rooms do not carry files */
+    memcpy(id, msg.data, 4);
+    if (send_sealed(&m->conn, FRAME_FILE_CANCEL,
+		    (char *)id, sizeof(id)) < 0)
+      m->dead = 1;
+  }
+  done_sealed(&m->conn, frame, &msg);
+}
+
+static void
+member_input(krb5_context context, krb5_creds *tgt, const char *me,
+	     kmember *m) {
+  kframe frame;
+  int ret;
+
+  ret = conn_fill(&m->conn);
+  if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+    return;
+  if (ret <= 0) {
+    m->dead = 1;
+    return;
+  }
+  while (!m->dead && (ret = conn_frame(&m->conn, &frame)) > 0) {
+    if (!m->joined)
+      member_join(context, tgt, me, m, &frame);
+    else
+      member_frame(context, me, m, &frame);
+  }
+  if (ret < 0)
+    m->dead = 1;
+}
+
+static void
+member_free(krb5_context context, kmember *m) {
+  ev_set(m->conn.fd, 0, NULL);
+  close(m->conn.fd);
+  conn_free(&m->conn);
+  if (m->auth_context)
+    krb5_auth_con_free(context, m->auth_context);
+  free(m->principal);
+  free(m);
+}
+
+/* drop the members that went away, and rekey if anyone had joined */
+static void
+reap_members(krb5_context context, krb5_creds *tgt, const char *me) {
+  kmember *m;
+  int i, left;
+
+  do {
+    left = 0;
+    for (i = nmembers - 1; i >= 0; i--) {
+      m = members[i];
+      if (!m->dead)
+	continue;
+      members[i] = members[--nmembers];
+      if (m->joined) {
+	room_rekey(context, tgt->keyblock.enctype);
+	room_announce(context, me, "%s left", m->principal);
+	left++;
+      }
+      member_free(context, m);
+    }
+    /* telling the others may have found more of them gone */
+  } while (left);
+}
+
+void
+room_host(krb5_context context, krb5_ccache ccache, char **users,
+	  int nusers, const knotifier *nf, const char *nfarg, const char *me) {
+  krb5_creds *tgt;
+  char startupmsg[2048], *text;
+  kev evs[16];
+  kmember *m;
+  int servsock, i, n, ret, len;
+
+  invited = users;
+  ninvited = nusers;
+  tgt = get_tgt_creds(context, ccache);
+
+  servsock = tcp_listen(users, nusers, nf, nfarg);
+  snprintf(startupmsg, sizeof(startupmsg),
+	   "Room open, waiting for the people you invited.\n\n");
+  setup_screen(startupmsg);
+  room_rekey(context, tgt->keyblock.enctype);
+
+  ev_init();
+  ev_set(servsock, EV_READ, NULL);
+  ev_set(fileno(stdin), EV_READ, NULL);
+
+  for (;;) {
+    for (i = 0; i < nmembers; i++) {
+      m = members[i];
+      ev_set(m->conn.fd, conn_pending(&m->conn) ? EV_READ | EV_WRITE : EV_READ,
+	     m);
+    }
+
+    n = ev_wait(evs, 16, notify_pending() ?
+		ev_sooner(200, render_timeout()) : render_timeout());
+    if (n < 0) {
+      if (errno != EINTR)
+	fail(errno, "waiting for data");
+      if (need_resize && use_curses)
+	resize_windows();
+      n = 0;
+    }
+    for (i = 0; i < n; i++) {
+      m = evs[i].data;
+      if (m) {
+	if (m->dead)
+	  continue;
+	if ((evs[i].events & EV_WRITE) && conn_flush(&m->conn) < 0)
+	  m->dead = 1;
+	if (evs[i].events & EV_READ)
+	  member_input(context, tgt, me, m);
+      } else if (evs[i].fd == servsock) {
+	member_accept(context, tgt, servsock);
+      } else if (evs[i].fd == fileno(stdin)) {
+	while ((ret = get_input(&text, &len)) != INPUT_NONE) {
+	  if (ret == INPUT_EOF) {
+	    ev_set(fileno(stdin), 0, NULL);
+	    break;
+	  } else if (ret == INPUT_FILE)
+	    notice("files cannot be sent to a room");
+	  else if (ret == INPUT_LINE) {
+	    log_record(LOG_SENT, text, len);
+	    room_fanout(context, me, text, len);
+	  }
+	}
+      }
+    }
+    reap_members(context, tgt, me);
+    if ((ret = notify_finished()) > 0)
+      notice("%d of the people you invited could not be told where to "
+	     "connect; they can use: %s", ret, notify_command());
+
+    stat_poll();
+    render_flush(0);
+    if (use_curses)
+      paint();
+  }
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
@@ -0,0 +1,494 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+ * Scrollback.  Every line that goes through the receive window, and every
+ * line we send, is kept in one arena allocated at startup (-s kbytes).
+ * Lines are records laid end to end; when the arena is full the oldest
+ * are dropped to make room, so a session that runs for days uses no more
+ * memory than one that runs for a minute.
+ *
+ * PageUp and PageDown move through it, with the window frozen while
+ * scrolled back (what arrives meanwhile is still taken in and kept here).
+ * "/" searches back through it as you type, "n" finds the next match, and
+ * Escape, "q" or any other key returns to the conversation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ktalk.h"
+
+#define SCROLL_LINEMAX	1024	/* longer lines are kept in pieces */
+#define SCROLL_CONT	0x80	/* record is part of a line that goes on */
+
+typedef struct srec {
+  unsigned int prev;		/* offset of the record before, if kept */
+  unsigned int seq;
+  unsigned short len;
+  unsigned char kind, pad;
+} srec;
+
+#define RECSIZE(len)	((sizeof(srec) + (len) + 3) & ~(size_t)3)
+
+int scroll_kbytes = 1024;
+
+static char *arena = NULL;
+static size_t asize = 0;
+static size_t head, tail, wrapat;	/* oldest record, free space, end of data */
+static int wrapped;			/* live data runs from head to wrapat, then from 0 */
+static size_t newest;
+static int count = 0;
+static unsigned int first_seq = 0, next_seq = 0;
+
+/* the line being added to, before it is finished */
+static char openbuf[SCROLL_LINEMAX];
+static size_t openlen = 0;
+static int openkind = SCROLL_RECV;
+
+/* what the window shows while scrolled back */
+static int scrolling = 0;
+static size_t view;
+static unsigned int viewseq;
+
+/* the search, if one is running or was just done */
+static char query[64];
+static int querylen = 0, searching = 0, found = 0;
+static size_t match_rec, match_pos;
+static unsigned int match_seq;
+static size_t search_from;		/* view when the search started */
+static unsigned int search_fromseq;
+
+#define REC(off)	((srec *)(arena + (off)))
+#define TEXT(r)		((char *)(r) + sizeof(srec))
+
+void
+scroll_init(void) {
+  asize = (size_t)scroll_kbytes * 1024;
+  if (!asize)
+    return;
+  arena = malloc(asize);
+  if (!arena)
+    fail(errno, "allocating scrollback");
+  head = tail = 0;
+  wrapped = 0;
+}
+
+static void
+evict(void) {
+  head += RECSIZE(REC(head)->len);
+  count--;
+  first_seq++;
+  if (wrapped && head == wrapat) {
+    head = 0;
+    wrapped = 0;
+  }
+}
+
+/* find need contiguous bytes, dropping old records until they are free */
+static size_t
+alloc(size_t need) {
+  size_t off;
+
+  for (;;) {
+    if (!count) {
+      head = tail = 0;
+      wrapped = 0;
+    }
+    if (!wrapped) {
+      if (tail + need <= asize)
+	break;
+      wrapat = tail;
+      tail = 0;
+      wrapped = 1;
+      continue;
+    }
+    if (tail + need <= head)
+      break;
+    evict();
+  }
+  off = tail;
+  tail += need;
+  return off;
+}
+
+static void
+commit(int kind, const char *text, size_t len) {
+  size_t off;
+  srec *r;
+
+  if (RECSIZE(len) > asize)
+    return;
+  off = alloc(RECSIZE(len));
+  r = REC(off);
+  r->prev = newest;
+  r->seq = next_seq++;
+  r->len = len;
+  r->kind = kind;
+  memcpy(TEXT(r), text, len);
+  newest = off;
+  count++;
+}
+
+/* the record before off, or -1 */
+static long
+older(size_t off) {
+  if (!count || off == head)
+    return -1;
+  return REC(off)->prev;
+}
+
+/* the record after off, or -1 */
+static long
+newer(size_t off) {
+  if (!count || off == newest)
+    return -1;
+  off += RECSIZE(REC(off)->len);
+  if (wrapped && off == wrapat)
+    off = 0;
+  return off;
+}
+
+static void
+close_line(int cont) {
+  if (!openlen && cont)
+    return;
+  commit(openkind | (cont ? SCROLL_CONT : 0), openbuf, openlen);
+  openlen = 0;
+}
+
+/* keep text of one kind, a line to a record */
+void
+scroll_add(int kind, const char *text, size_t len) {
+  size_t i;
+
+  if (!arena)
+    return;
+  if (kind != openkind) {
+    close_line(1);
+    openkind = kind;
+  }
+  for (i = 0; i < len; i++) {
+    if (text[i] == '\n') {
+      close_line(0);
+    } else if (text[i] != '\r') {
+      if (openlen == sizeof(openbuf))
+	close_line(1);
+      openbuf[openlen++] = text[i];
+    }
+  }
+}
+
+/* rub out the last character of the line being received */
+void
+scroll_erase(void) {
+  if (openkind == SCROLL_RECV && openlen)
+    openlen--;
+}
+
+int
+scroll_active(void) {
+  return scrolling;
+}
+
+/* the view may have been dropped from the arena since it was set */
+static void
+check_view(void) {
+  if ((int)(viewseq - first_seq) < 0) {
+    view = head;
+    viewseq = first_seq;
+  }
+}
+
+static void
+set_view(size_t off) {
+  view = off;
+  viewseq = REC(off)->seq;
+}
+
+static void
+draw_rec(srec *r) {
+  size_t off = (char *)r - arena;
+  int kind = r->kind & ~SCROLL_CONT;
+  attr_t attr = kind == SCROLL_NOTICE ? A_STANDOUT :
+      kind == SCROLL_SENT ? A_BOLD : A_NORMAL;
+
+  wattrset(receivewin, attr);
+  if (found && off == match_rec && r->seq == match_seq) {
+    waddnstr(receivewin, TEXT(r), match_pos);
+    wattrset(receivewin, attr | A_UNDERLINE | A_REVERSE);
+    waddnstr(receivewin, TEXT(r) + match_pos, querylen);
+    wattrset(receivewin, attr);
+    waddnstr(receivewin, TEXT(r) + match_pos + querylen,
+	     r->len - match_pos - querylen);
+  } else {
+    waddnstr(receivewin, TEXT(r), r->len);
+  }
+  wattrset(receivewin, A_NORMAL);
+}
+
+static void
+draw_status_line(void) {
+  char buf[128];
+
+  if (!scrolling) {
+    set_status(STATUS_SCROLL, NULL);
+    return;
+  }
+  if (searching || querylen)
+    snprintf(buf, sizeof(buf), "search: %.*s%s", querylen, query,
+	     querylen && !found ? " (not found)" : "");
+  else
+    snprintf(buf, sizeof(buf), "scrolled back %u lines",
+	     next_seq - 1 - viewseq);
+  set_status(STATUS_SCROLL, buf);
+}
+
+/* the lines up to and including the one at view, filling the window */
+static void
+draw_view(void) {
+  int height = getmaxy(receivewin), i;
+  long off, start;
+
+  check_view();
+  start = view;
+  for (i = 1; i < height && (off = older(start)) >= 0; i++)
+    start = off;
+  werase(receivewin);
+  wmove(receivewin, 0, 0);
+  for (off = start;; off = newer(off)) {
+    draw_rec(REC(off));
+    if (off == (long)view)
+      break;
+    if (!(REC(off)->kind & SCROLL_CONT))
+      waddch(receivewin, '\n');
+  }
+  wnoutrefresh(receivewin);
+  draw_status_line();
+}
+
+/*
+ * Put the receive window back as it was: the end of the conversation,
+ * without what we sent, which is in the send window.
+ */
+void
+scroll_repaint(void) {
+  int height, i;
+  long off, start;
+
+  if (!arena)
+    return;
+  if (scrolling) {
+    draw_view();
+    return;
+  }
+  height = getmaxy(receivewin);
+  werase(receivewin);
+  wmove(receivewin, 0, 0);
+  if (count) {
+    start = newest;
+    for (i = 1; i < height && (off = older(start)) >= 0;) {
+      start = off;
+      if ((REC(off)->kind & ~SCROLL_CONT) != SCROLL_SENT)
+	i++;
+    }
+    for (off = start; off >= 0; off = newer(off)) {
+      if ((REC(off)->kind & ~SCROLL_CONT) == SCROLL_SENT)
+	continue;
+      draw_rec(REC(off));
+      if (!(REC(off)->kind & SCROLL_CONT))
+	waddch(receivewin, '\n');
+    }
+  }
+  if (openkind != SCROLL_SENT)
+    waddnstr(receivewin, openbuf, openlen);
+  wnoutrefresh(receivewin);
+}
+
+static void
+leave(void) {
+  scrolling = searching = found = 0;
+  querylen = 0;
+  draw_status_line();
+  scroll_repaint();
+}
+
+/* move the view by n records, back if n is negative */
+static void
+move_view(int n) {
+  long off;
+
+  check_view();
+  for (; n < 0 && (off = older(view)) >= 0; n++)
+    set_view(off);
+  for (; n > 0 && (off = newer(view)) >= 0; n--)
+    set_view(off);
+}
+
+/* look for the query in the record at off, from the end back */
+static int
+match_in(size_t off, size_t before) {
+  srec *r = REC(off);
+  size_t i;
+
+  if (!querylen || r->len < (size_t)querylen)
+    return 0;
+  i = r->len - querylen + 1;
+  if (i > before)
+    i = before;
+  while (i-- > 0) {
+    if (!strncasecmp(TEXT(r) + i, query, querylen)) {
+      match_rec = off;
+      match_pos = i;
+      match_seq = r->seq;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Search back from record off for the query, in place in the arena.  At
+ * off itself only matches starting before the given position count.
+ */
+static void
+search(size_t off, size_t before) {
+  long o = off;
+
+  found = 0;
+  while (o >= 0) {
+    if (match_in(o, before)) {
+      found = 1;
+      set_view(o);
+      break;
+    }
+    o = older(o);
+    before = (size_t)-1;
+  }
+  draw_view();
+}
+
+static void
+search_key(int c) {
+  if (c == 27 || c == 'G' - '@') {
+    /* give up and go back to where we were */
+    searching = found = 0;
+    querylen = 0;
+    view = search_from;
+    viewseq = search_fromseq;
+    check_view();
+    draw_view();
+  } else if (c == 10 || c == 13) {
+    searching = 0;
+    draw_status_line();
+  } else if (c == 8 || c == 127 || c == KEY_BACKSPACE) {
+    if (querylen)
+      querylen--;
+    view = search_from;
+    viewseq = search_fromseq;
+    check_view();
+    search(view, (size_t)-1);
+  } else if (c >= 32 && c < 127 && querylen < (int)sizeof(query)) {
+    query[querylen++] = c;
+    /* a longer query can only match where the shorter one did, or older */
+    check_view();
+    search(found ? match_rec : view, found ? match_pos + 1 : (size_t)-1);
+  }
+}
+
+/*
+ * Take a key if it is for the scrollback.  Returns 0 for keys that should
+ * be typed as usual, which also ends any scrolling back.
+ */
+int
+scroll_key(int c) {
+  int page;
+
+  if (!arena)
+    return 0;
+  if (!scrolling) {
+    if (c != KEY_PPAGE || !count)
+      return 0;
+    close_line(1);
+    scrolling = 1;
+    set_view(newest);
+  }
+
+  if (searching) {
+    search_key(c);
+    return 1;
+  }
+
+  page = getmaxy(receivewin) - 1;
+  if (page < 1)
+    page = 1;
+  switch (c) {
+  case KEY_PPAGE:
+    move_view(-page);
+    break;
+  case KEY_UP:
+    move_view(-1);
+    break;
+  case KEY_NPAGE:
+  case KEY_DOWN:
+    check_view();
+    if (view == newest) {
+      leave();
+      return 1;
+    }
+    move_view(c == KEY_NPAGE ? page : 1);
+    break;
+  case KEY_HOME:
+    check_view();
+    set_view(head);
+    break;
+  case '/':
+    searching = 1;
+    found = 0;
+    querylen = 0;
+    check_view();
+    search_from = view;
+    search_fromseq = viewseq;
+    break;
+  case 'n':
+    check_view();
+    if (querylen)
+      search(found ? match_rec : view, found ? match_pos : (size_t)-1);
+    break;
+  case 27:
+  case 'q':
+  case KEY_END:
+    leave();
+    return 1;
+  default:
+    leave();
+    return 0;
+  }
+  draw_view();
+  return 1;
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
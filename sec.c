@@ -0,0 +1,549 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+ * Security backends.  A connection's backend seals what goes out and
+ * opens what comes in; the rest of ktalk only calls send_sealed(),
+ * open_sealed() and done_sealed().
+ *
+ * The real one is krb5 user to user: the handshake, then krb5_mk_priv or
+ * the fast path for every frame.  A null backend that does nothing at all
+ * can be built in with --enable-null-cipher for measuring everything else;
+ * ktalk itself never selects it.  The same nothing, under another name,
+ * is what a front end uses with the daemon, which seals for it; that one
+ * will only go over a unix socket to a daemon running as us.
+ *
+ * When compression is agreed, zip.c sits in front of whichever it is.
+ */
+
+#define _GNU_SOURCE		/* struct ucred */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "ktalk.h"
+
+typedef struct ksec_uu {
+  krb5_context context;
+  krb5_auth_context auth_context;
+  kfast *fast;			/* the fast path, once agreed */
+} ksec_uu;
+
+#ifdef KTALK_TRACE
+/* the sequence numbers, for the trace; only looked up when tracing */
+static krb5_int32
+localseq(ksec_uu *st) {
+  krb5_int32 seq = -1;
+
+  krb5_auth_con_getlocalseqnumber(st->context, st->auth_context, &seq);
+  return seq;
+}
+
+static krb5_int32
+remoteseq(ksec_uu *st) {
+  krb5_int32 seq = -1;
+
+  krb5_auth_con_getremoteseqnumber(st->context, st->auth_context, &seq);
+  return seq;
+}
+#endif
+
+/* an auth context that keeps sequence numbers, with no addresses yet */
+void
+auth_con_new(krb5_context context, krb5_auth_context * auth_context) {
+  int ret;
+
+  /* initialize the auth_context */
+  ret = krb5_auth_con_init(context, auth_context);
+  if (ret)
+    fail(ret, "krb5_auth-con_init");
+
+  ret =
+      krb5_auth_con_setflags(context, *auth_context,
+			     KRB5_AUTH_CONTEXT_DO_SEQUENCE);
+  if (ret)
+    fail(ret, "krb5_auth_con_setflags");
+}
+
+/*
+ * Give auth_context the addresses of conn's two ends.  Returns -1 with
+ * errno set if the transport cannot say what they are.
+ */
+int
+auth_con_addrs(krb5_context context, krb5_auth_context auth_context,
+	       kconn *conn) {
+  krb5_address local_address, foreign_address;
+  int ret;
+
+  memset(&local_address, 0, sizeof(local_address));
+  memset(&foreign_address, 0, sizeof(foreign_address));
+  if (conn->transport->addresses(conn->fd, &local_address,
+				 &foreign_address) < 0)
+    return -1;
+  ret =
+      krb5_auth_con_setaddrs(context, auth_context, &local_address,
+			     &foreign_address);
+  if (ret)
+    fail(ret, "krb5_auth_con_setaddrs");
+  free(local_address.contents);
+  free(foreign_address.contents);
+  return 0;
+}
+
+/* both at once, for a connection that is already there */
+int
+auth_con_setup(krb5_context context, krb5_auth_context * auth_context,
+	       kconn *conn) {
+  auth_con_new(context, auth_context);
+  return auth_con_addrs(context, *auth_context, conn);
+}
+
+/* get the krbtgt/REALM@REALM for our own realm out of the cache */
+krb5_creds *
+get_tgt_creds(krb5_context context, krb5_ccache ccache) {
+  krb5_creds in_creds, *out_creds;
+  int ret;
+
+  memset(&in_creds, 0, sizeof(in_creds));
+  ret = krb5_cc_get_principal(context, ccache, &in_creds.client);
+  if (ret)
+    fail(ret, "krb5_cc_get_principal");
+
+  ret = krb5_build_principal_ext(context, &in_creds.server,
+				 krb5_princ_realm(context,
+						  in_creds.client)->length,
+				 krb5_princ_realm(context,
+						  in_creds.client)->data,
+				 6, "krbtgt",
+				 krb5_princ_realm(context,
+						  in_creds.client)->length,
+				 krb5_princ_realm(context,
+						  in_creds.client)->data,
+				 0);
+  if (ret)
+    fail(ret, "krb5_build_principal_ext");
+
+  ret = krb5_get_credentials(context, KRB5_GC_CACHED, ccache,
+			     &in_creds, &out_creds);
+  if (ret)
+    fail(ret, "krb5_get_credentials");
+
+  krb5_free_cred_contents(context, &in_creds);
+  return out_creds;
+}
+
+/*
+ * Check the mk_req data a client sent in frame and return the principal it
+ * authenticates as.  The auth context must already have the user-user key.
+ */
+krb5_error_code
+read_apreq(krb5_context context, krb5_auth_context * auth_context,
+	   kframe *frame, char **principal) {
+  krb5_ticket *inticket = NULL;
+  krb5_data msg;
+  long long start;
+  int ret;
+
+  msg.data = frame->data;
+  msg.length = frame->len;
+  start = now_usec();
+  ret = krb5_rd_req(context, auth_context, &msg, NULL, NULL, NULL, &inticket);
+  stat_time(ST_RDREQ, start);
+  debug("read message with rd_req, return was %i", ret);
+  if (ret)
+    return ret;
+
+  ret = krb5_unparse_name(context, inticket->enc_part2->client, principal);
+  krb5_free_ticket(context, inticket);
+  return ret;
+}
+
+static int
+uu_seal(kconn *conn, int type, const char *data, size_t len) {
+  ksec_uu *st = conn->secstate;
+  krb5_data msg, encmsg;
+  int ret;
+
+  if (st->fast)
+    return fast_send(st->context, st->fast, conn, type, data, len);
+
+  /* refuse before sealing, so a dropped message never uses up a number */
+  if (conn_full(conn, len + SEAL_SLOP)) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  msg.data = (char *)data;
+  msg.length = len;
+  ret = krb5_mk_priv(st->context, st->auth_context, &msg, &encmsg, NULL);
+  if (ret)
+    fail(ret, "krb5_mk_priv");
+  TRACE(TR_MKPRIV, type, len, localseq(st));
+  ret = conn_send(conn, type, 0, encmsg.data, encmsg.length);
+  free(encmsg.data);
+  return ret;
+}
+
+static krb5_error_code
+uu_open(kconn *conn, kframe *frame, krb5_data *msg) {
+  ksec_uu *st = conn->secstate;
+  krb5_data encmsg;
+  krb5_error_code ret;
+
+  if (frame->flags & FRAME_F_FAST) {
+    if (!st->fast)
+      return EPROTO;
+    return fast_open(st->context, st->fast, frame, msg);
+  }
+
+  encmsg.data = frame->data;
+  encmsg.length = frame->len;
+  ret = krb5_rd_priv(st->context, st->auth_context, &encmsg, msg, NULL);
+  TRACE(TR_RDPRIV, frame->type, frame->len, remoteseq(st));
+  return ret;
+}
+
+static void
+uu_done(kconn *conn, kframe *frame, krb5_data *msg) {
+  ksec_uu *st = conn->secstate;
+
+  /* fast path messages are opened in place in the read buffer */
+  if (!(frame->flags & FRAME_F_FAST))
+    krb5_free_data_contents(st->context, msg);
+}
+
+static void
+uu_release(kconn *conn) {
+  ksec_uu *st = conn->secstate;
+
+  if (st->fast)
+    fast_free(st->context, st->fast);
+  free(st);
+}
+
+static const ksecops sec_uu = {
+  "krb5", uu_seal, uu_open, uu_done, uu_release
+};
+
+/* seal conn's frames with auth_context, which stays the caller's */
+void
+sec_krb5_attach(kconn *conn, krb5_context context,
+		krb5_auth_context auth_context) {
+  ksec_uu *st;
+
+  st = calloc(1, sizeof(*st));
+  if (!st)
+    fail(errno, "allocating security state");
+  st->context = context;
+  st->auth_context = auth_context;
+  conn->sec = &sec_uu;
+  conn->secstate = st;
+}
+
+/* switch an attached connection to the fast path */
+void
+sec_krb5_fast(kconn *conn, int initiator) {
+  ksec_uu *st = conn->secstate;
+
+  st->fast = fast_start(st->context, st->auth_context, initiator);
+  if (!st->fast) {
+    /* its fast frames will not open, and the session ends on the first */
+    debug("no session subkey, so no fast path");
+    return;
+  }
+  if (conn->caps & CAP_CHAN)
+    conn->pool = pool_start(st->fast);
+}
+
+/* the fast path of a krb5 connection and its context, or NULL */
+kfast *
+sec_krb5_kfast(kconn *conn, krb5_context *context) {
+  ksec_uu *st = conn->secstate;
+
+  if (conn->sec != &sec_uu || !st->fast)
+    return NULL;
+  *context = st->context;
+  return st->fast;
+}
+
+/* settle the framing, and the fast path if we both want it */
+static void
+uu_agree(kconn *conn, int initiator) {
+  conn_agree(conn);
+  if (conn->caps & CAP_FAST)
+    sec_krb5_fast(conn, initiator);
+}
+
+/*
+ * The part of the handshake that needs no peer: the auth context, and for
+ * the server the TGT to send and the key to check the answer with.  This
+ * runs while the connection is being made, so it touches nothing but p.
+ */
+void
+sec_krb5_prepare(kprep *p) {
+  int ret;
+
+  auth_con_new(p->context, &p->auth_context);
+  if (!p->server)
+    return;
+  p->tgt = get_tgt_creds(p->context, p->ccache);
+  ret =
+      krb5_auth_con_setuseruserkey(p->context, p->auth_context,
+				   &p->tgt->keyblock);
+  if (ret)
+    fail(ret, "krb5_auth_con_setuseruserkey");
+}
+
+/*
+ * The server's half of the handshake: send our TGT for the peer to get a
+ * user to user ticket with, and check the AP-REQ they answer with.
+ * Anything the user should know is added to startupmsg.
+ */
+void
+sec_krb5_server(kconn *conn, kprep *p, const char *peer, char *startupmsg) {
+  krb5_context context = p->context;
+  krb5_principal clprinc;
+  char *fprincipal, *clprincstr;
+  kframe frame;
+  int ret;
+
+  /* send over the user_user ticket, offering our capabilities */
+  ret =
+      conn_send_ascii(conn, p->tgt->ticket.data, p->tgt->ticket.length,
+		      local_caps & ~CAP_ROOM);
+  if (ret < 0)
+    fail(errno, "sending user-user ticket");
+  krb5_free_creds(context, p->tgt);
+  p->tgt = NULL;
+
+  if (auth_con_addrs(context, p->auth_context, conn) < 0)
+    fail(errno, "getting socket addresses");
+
+  /* read the mk_req data sent by the client */
+  ret = conn_readframe(conn, &frame);
+  if (ret == 0)
+    bye("connection closed");
+  if (ret < 0)
+    fail(errno, "reading ticket from client");
+  debug("read message, length was %i", (int)frame.len);
+  conn->caps = frame.caps & local_caps;
+  ret = read_apreq(context, &p->auth_context, &frame, &fprincipal);
+  if (ret)
+    fail(ret, "krb5_rd_req");
+  strcat(startupmsg, "Foreign party authenticates as ");
+  strcat(startupmsg, fprincipal);
+  strcat(startupmsg, "\n\n");
+
+  /* this is a little wrong, the argv[1] may have @ATHENA.MIT.EDU *//***** need to fix *****/
+  ret = krb5_parse_name(context, peer, &clprinc);
+  if (ret)
+    fail(ret, "krb5_parse_name");
+  ret = krb5_unparse_name(context, clprinc, &clprincstr);
+  if (ret)
+    fail(ret, "krb5_unparse_name");
+  if (strcasecmp(fprincipal, clprincstr)) {
+    strcat(startupmsg,
+	   "WARNING! This is not the principal you specified on the\n");
+    strcat(startupmsg,
+	   "command line.  An encrypted session will be established anyway\n");
+    strcat(startupmsg,
+	   "make sure you really want to talk to this person.\n\n");
+  }
+  free(fprincipal);
+  free(clprincstr);
+  krb5_free_principal(context, clprinc);
+
+  sec_krb5_attach(conn, context, p->auth_context);
+  uu_agree(conn, 0);
+}
+
+/* the client's half: get a ticket to the peer with their TGT and send it */
+void
+sec_krb5_client(kconn *conn, kprep *p, const char *peer) {
+  krb5_context context = p->context;
+  krb5_data tkt_data, out_ticket;
+  krb5_creds *new_creds;
+  kframe frame;
+  int ret;
+
+  if (auth_con_addrs(context, p->auth_context, conn) < 0)
+    fail(errno, "getting socket addresses");
+
+  /* read the ticket sent by the server */
+  ret = conn_readframe(conn, &frame);
+  if (ret == 0)
+    bye("connection closed");
+  if (ret < 0)
+    fail(errno, "reading ticket from server");
+  debug("got the ticket, length was %i", (int)frame.len);
+  tkt_data.data = frame.data;
+  tkt_data.length = frame.len;
+  conn->caps = frame.caps & local_caps;
+
+  /* get user_user ticket, from our cache if we have talked before */
+  new_creds = get_uu_creds(context, p->ccache, peer, &tkt_data);
+  debug("Got the user_user ticket!");
+
+  /* do the mk_req and send the ticket to the server */
+  ret =
+      krb5_mk_req_extended(context, &p->auth_context,
+			   AP_OPTS_USE_SESSION_KEY | AP_OPTS_MUTUAL_REQUIRED
+			   | AP_OPTS_USE_SUBKEY,
+			   NULL, new_creds, &out_ticket);
+  if (ret)
+    fail(ret, "krb5_mk_req_extended");
+  krb5_free_creds(context, new_creds);
+
+  /* answer with the capabilities we share with the server */
+  ret = conn_send_ascii(conn, out_ticket.data, out_ticket.length, conn->caps);
+  if (ret < 0)
+    fail(errno, "sending ticket to server");
+  debug("sent mk req message, return was %i", ret);
+  krb5_free_data_contents(context, &out_ticket);
+
+  sec_krb5_attach(conn, context, p->auth_context);
+  uu_agree(conn, 1);
+}
+
+static int
+null_seal(kconn *conn, int type, const char *data, size_t len) {
+  return conn_send(conn, type, 0, data, len);
+}
+
+static krb5_error_code
+null_open(kconn *conn, kframe *frame, krb5_data *msg) {
+  msg->data = frame->data;
+  msg->length = frame->len;
+  return 0;
+}
+
+static void
+null_done(kconn *conn, kframe *frame, krb5_data *msg) {
+}
+
+static void
+null_release(kconn *conn) {
+}
+
+static const ksecops sec_local = {
+  "local", null_seal, null_open, null_done, null_release
+};
+
+/*
+ * A front end's frames to and from the daemon: they never leave this
+ * host, and only we can reach the socket, so the daemon does the sealing.
+ * Anything else would put chat on the wire in the clear, so it is refused.
+ */
+void
+sec_local_attach(kconn *conn) {
+  struct sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+#ifdef SO_PEERCRED
+  struct ucred cred;
+#endif
+
+  if (getsockname(conn->fd, (struct sockaddr *)&ss, &len) < 0)
+    fail(errno, "checking the daemon's socket");
+  if (ss.ss_family != AF_UNIX) {
+    fprintf(stderr, "not sending unsealed frames over the network\n");
+    exit(1);
+  }
+#ifdef SO_PEERCRED
+  len = sizeof(cred);
+  if (getsockopt(conn->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+    fail(errno, "checking the daemon's socket");
+  if (cred.uid != getuid()) {
+    fprintf(stderr, "the daemon is not running as you, not using it\n");
+    exit(1);
+  }
+#endif
+  conn->sec = &sec_local;
+  conn->secstate = NULL;
+}
+
+#ifdef KTALK_NULL_CIPHER
+static const ksecops sec_null = {
+  "null", null_seal, null_open, null_done, null_release
+};
+
+/* send conn's frames in the clear; for benchmarks only */
+void
+sec_null_attach(kconn *conn) {
+  conn->sec = &sec_null;
+  conn->secstate = NULL;
+}
+#endif
+
+int
+send_sealed(kconn *conn, int type, const char *data, size_t len) {
+  long long start = now_usec();
+  int ret;
+
+#ifdef HAVE_LIBZ
+  if (conn->zip)
+    ret = zip_seal(conn, type, data, len);
+  else
+#endif
+    ret = conn->sec->seal(conn, type, data, len);
+  /* the pool only queues bulk frames here, and times them as it seals */
+  if (!conn->pool || frame_chan(conn, type) != CHAN_BULK) {
+    stat_time(ST_SEAL, start);
+    TRACE(TR_SEAL, type, len, now_usec() - start);
+  }
+  return ret;
+}
+
+/* msg is good until done_sealed(), and no longer than frame is */
+krb5_error_code
+open_sealed(kconn *conn, kframe *frame, krb5_data *msg) {
+  long long start = now_usec();
+  krb5_error_code ret;
+
+#ifdef HAVE_LIBZ
+  if (conn->zip)
+    ret = zip_open(conn, frame, msg);
+  else
+#endif
+    ret = conn->sec->open(conn, frame, msg);
+  stat_time(ST_OPEN, start);
+  TRACE(TR_OPEN, frame->type, frame->len, now_usec() - start);
+  return ret;
+}
+
+void
+done_sealed(kconn *conn, kframe *frame, krb5_data *msg) {
+#ifdef HAVE_LIBZ
+  if (conn->zip) {
+    zip_done(conn, frame, msg);
+    return;
+  }
+#endif
+  conn->sec->done(conn, frame, msg);
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
@@ -0,0 +1,183 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+
+/*
+ * Counters for where the time goes: the krb5 setup, the KDC, checking
+ * the AP-REQ, sealing and opening each frame, the socket, and the screen,
+ * how long after starting the session was ready and the first message
+ * went by, and how long lines sent as datagrams took to be acknowledged.
+ * Each keeps a count, a total, a maximum and a histogram in powers of two
+ * (microseconds for times, bytes for sizes), so all a sample costs is a
+ * clock read and a few adds.
+ *
+ * SIGUSR1 asks for a dump, which the event loop writes as one line of
+ * JSON to the -S file, or stderr; with -S it is written at exit too.
+ * With -v ktalk keeps a short summary in the separator line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include "ktalk.h"
+
+#define STAT_BUCKETS	32
+
+typedef struct kstat {
+  const char *name;
+  unsigned long count;
+  long long sum, max;
+  unsigned long hist[STAT_BUCKETS];	/* bucket i holds [2^(i-1), 2^i) */
+} kstat;
+
+static kstat stats[ST_COUNT] = {
+  { "init_us" }, { "tgs_us" }, { "rd_req_us" }, { "seal_us" },
+  { "open_us" }, { "read_bytes" }, { "write_bytes" }, { "render_us" },
+  { "paint_us" }, { "ready_us" }, { "first_msg_us" }, { "line_ack_us" }
+};
+
+const char *stat_file = NULL;	/* -S */
+static volatile sig_atomic_t dump_due = 0;
+static long long last_show = 0;
+
+void
+stat_add(int id, long long v) {
+  kstat *s = &stats[id];
+  int b = 0;
+
+  if (v < 0)
+    v = 0;
+  s->count++;
+  s->sum += v;
+  if (v > s->max)
+    s->max = v;
+  while (b < STAT_BUCKETS - 1 && v >> b)
+    b++;
+  s->hist[b]++;
+}
+
+/* the time since start, which came from now_usec() */
+void
+stat_time(int id, long long start) {
+  stat_add(id, now_usec() - start);
+}
+
+/* the total of everything id has counted */
+long long
+stat_sum(int id) {
+  return stats[id].sum;
+}
+
+/* the least bucket bound that q of the samples are under */
+static long long
+quantile(kstat *s, double q) {
+  unsigned long want, seen = 0;
+  int b;
+
+  if (!s->count)
+    return 0;
+  want = (unsigned long)(s->count * q);
+  for (b = 0; b < STAT_BUCKETS; b++) {
+    seen += s->hist[b];
+    if (seen > want)
+      break;
+  }
+  return b ? 1LL << b : 0;
+}
+
+static void
+on_usr1(int sig) {
+  dump_due = 1;
+}
+
+void
+stat_init(void) {
+  struct sigaction sigact;
+
+  sigemptyset(&sigact.sa_mask);
+  sigact.sa_flags = SA_RESTART;
+  sigact.sa_handler = on_usr1;
+  sigaction(SIGUSR1, &sigact, NULL);
+  if (stat_file)
+    atexit(stat_dump);
+}
+
+/* everything, as one line of JSON */
+void
+stat_dump(void) {
+  FILE *f = stderr;
+  kstat *s;
+  int i, b, top;
+
+  if (stat_file && !(f = fopen(stat_file, "a")))
+    return;
+  fprintf(f, "{ \"time\": %ld", (long)time(NULL));
+  for (i = 0; i < ST_COUNT; i++) {
+    s = &stats[i];
+    if (!s->count)
+      continue;
+    fprintf(f, ", \"%s\": { \"n\": %lu, \"sum\": %lld, \"max\": %lld, "
+	    "\"p50\": %lld, \"p99\": %lld, \"hist\": [", s->name, s->count,
+	    s->sum, s->max, quantile(s, 0.5), quantile(s, 0.99));
+    for (top = STAT_BUCKETS - 1; top > 0 && !s->hist[top]; top--)
+      ;
+    for (b = 0; b <= top; b++)
+      fprintf(f, "%s%lu", b ? ", " : "", s->hist[b]);
+    fprintf(f, "] }");
+  }
+  fprintf(f, " }\n");
+  if (f != stderr)
+    fclose(f);
+  else
+    fflush(f);
+}
+
+/* called from the event loops, to dump when asked to */
+void
+stat_poll(void) {
+  if (dump_due) {
+    dump_due = 0;
+    stat_dump();
+  }
+}
+
+/* a few medians for the separator line, no more than once a second */
+int
+stat_summary(char *buf, size_t len) {
+  long long now;
+
+  now = now_usec();
+  if (now - last_show < 1000000)
+    return 0;
+  last_show = now;
+  snprintf(buf, len, "seal %lldus open %lldus paint %lldus",
+	   quantile(&stats[ST_SEAL], 0.5), quantile(&stats[ST_OPEN], 0.5),
+	   quantile(&stats[ST_PAINT], 0.5));
+  return 1;
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
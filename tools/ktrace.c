@@ -0,0 +1,108 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+
+/*
+ * Print a trace written by ktalk -X, one event a line: the time since the
+ * first event and since the one before, both in microseconds, the event
+ * and its numbers.  See trace.c for the format.
+ *
+ *   ktrace [-n] file
+ *
+ * -n leaves out the wait events, which are most of them when idle.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include "ktalk.h"
+
+static void
+usage(const char *whoami) {
+  fprintf(stderr, "usage: %s [-n] file\n", whoami);
+  exit(1);
+}
+
+int
+main(int argc, char **argv) {
+  char magic[8], **names, name[64];
+  unsigned int nnames, nevents, i, k;
+  long long first = 0, prev = 0;
+  int opt, nowait = 0, c;
+  ktrace_ev e;
+  FILE *f;
+  extern int optind;
+
+  while ((opt = getopt(argc, argv, "n")) != -1) {
+    switch (opt) {
+    case 'n':
+      nowait = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind != 1)
+    usage(argv[0]);
+
+  f = fopen(argv[optind], "r");
+  if (!f) {
+    perror(argv[optind]);
+    exit(1);
+  }
+  if (fread(magic, 1, 8, f) != 8 || memcmp(magic, "KTRACE1\n", 8)
+      || fread(&nnames, sizeof(nnames), 1, f) != 1 || nnames > 1024) {
+    fprintf(stderr, "%s: not a ktalk trace\n", argv[optind]);
+    exit(1);
+  }
+  names = calloc(nnames, sizeof(*names));
+  for (i = 0; i < nnames; i++) {
+    for (k = 0; (c = getc(f)) > 0 && k < sizeof(name) - 1; k++)
+      name[k] = c;
+    name[k] = '\0';
+    names[i] = strdup(name);
+  }
+  if (fread(&nevents, sizeof(nevents), 1, f) != 1) {
+    fprintf(stderr, "%s: truncated\n", argv[optind]);
+    exit(1);
+  }
+
+  for (i = 0; i < nevents && fread(&e, sizeof(e), 1, f) == 1; i++) {
+    if (!i)
+      first = prev = e.ns;
+    if (nowait && e.id == TR_WAIT)
+      continue;
+    printf("%12.3f %+10.3f  %-8s %d %lld %lld\n", (e.ns - first) / 1e3,
+	   (e.ns - prev) / 1e3,
+	   e.id >= 0 && (unsigned int)e.id < nnames ? names[e.id] : "?",
+	   e.a, e.b, e.c);
+    prev = e.ns;
+  }
+  fclose(f);
+  return 0;
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
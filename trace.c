@@ -0,0 +1,109 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+
+/*
+ * A trace of what the session does, for when debug() would change the
+ * timing being looked at.  Built with --enable-trace, -X file turns it
+ * on: each TRACE() then puts a fixed size event (the time in ns, an event
+ * id and three numbers) in a ring in memory, with no formatting and no
+ * i/o, and the ring is written to file at exit.  tools/ktrace prints it.
+ * Built without it, TRACE() is nothing at all, arguments included.
+ *
+ * The file is "KTRACE1\n", the number of event names and the names, each
+ * ending in a NUL, then the number of events and the events oldest first,
+ * as ktrace_ev in this machine's byte order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "ktalk.h"
+
+#ifdef KTALK_TRACE
+
+#define TRACE_EVENTS	65536		/* a power of two */
+
+ktrace_ev *trace_ring = NULL;
+static unsigned long trace_next = 0;
+static const char *trace_path;
+
+static const char *trace_names[TR_COUNT] = {
+  "read", "write", "wait", "seal", "open", "mk_priv", "rd_priv", "key",
+  "render", "paint", "xfer"
+};
+
+void
+trace_event(int id, long a, long long b, long long c) {
+  struct timespec ts;
+  ktrace_ev *e;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  e = &trace_ring[trace_next++ & (TRACE_EVENTS - 1)];
+  e->ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  e->id = id;
+  e->a = a;
+  e->b = b;
+  e->c = c;
+}
+
+static void
+trace_write(void) {
+  unsigned long first, n, i;
+  unsigned int k;
+  FILE *f;
+
+  f = fopen(trace_path, "w");
+  if (!f)
+    return;
+  fwrite("KTRACE1\n", 1, 8, f);
+  k = TR_COUNT;
+  fwrite(&k, sizeof(k), 1, f);
+  for (i = 0; i < TR_COUNT; i++)
+    fwrite(trace_names[i], 1, strlen(trace_names[i]) + 1, f);
+
+  n = trace_next < TRACE_EVENTS ? trace_next : TRACE_EVENTS;
+  first = trace_next - n;
+  k = n;
+  fwrite(&k, sizeof(k), 1, f);
+  for (i = first; i < trace_next; i++)
+    fwrite(&trace_ring[i & (TRACE_EVENTS - 1)], sizeof(ktrace_ev), 1, f);
+  fclose(f);
+}
+
+/* start tracing, to be written to path at exit */
+void
+trace_start(const char *path) {
+  trace_ring = calloc(TRACE_EVENTS, sizeof(ktrace_ev));
+  if (!trace_ring)
+    fail(errno, "allocating trace");
+  trace_path = path;
+  atexit(trace_write);
+}
+#endif /* KTALK_TRACE */
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
@@ -0,0 +1,401 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+ * File transfer.  A file goes over as a FILE_BEGIN frame carrying an id,
+ * the size and the name, a run of FILE_DATA chunks and a FILE_END, each
+ * sealed through send_sealed() like chat text.  One chunk is read and sent
+ * at a time, and the receiver writes each one straight to disk, so neither
+ * side ever holds more than a chunk of the file in memory, or a ring of
+ * them with the pool.  All but the cancel go on the bulk channel, so they
+ * stay in order with each other while chat goes past them.  A frame there
+ * is no room for is kept and sent again the next time round.
+ *
+ * With the fast path, bulk frames are sealed and opened with
+ * krb5_k_encrypt_iov on the pool's worker threads (see pool.c), and only
+ * numbered, sent and handled in order on the main thread; without it they
+ * go through krb5_mk_priv one at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "ktalk.h"
+
+typedef struct kxfer {
+  int fd;
+  int started;			/* FILE_BEGIN has gone out */
+  int discard;			/* drop data until FILE_END */
+  int ending;			/* FILE_END, status ending - 1, still to go */
+  int held;			/* bytes of chunk read but not yet sent */
+  krb5_ui_4 id;
+  char name[256];
+  char path[1024];
+  off_t size, done;
+  struct timeval start, shown;
+} kxfer;
+
+char *recv_dir = NULL;
+
+static kxfer out = { -1 }, in = { -1 };
+static krb5_ui_4 next_id = 1;
+static krb5_ui_4 cancel_id;
+static int cancel_pending = 0;
+static char chunk[XFER_CHUNK];
+
+static double
+elapsed(struct timeval *since) {
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - since->tv_sec) + (now.tv_usec - since->tv_usec) / 1e6;
+}
+
+/* show how far along a transfer is, at most ten times a second */
+static void
+progress(kxfer *x, const char *verb) {
+  char buf[512];
+  double secs;
+
+  if (!use_curses || elapsed(&x->shown) < 0.1)
+    return;
+  gettimeofday(&x->shown, NULL);
+  secs = elapsed(&x->start);
+  snprintf(buf, sizeof(buf), "%s %s: %ldK of %ldK (%d%%) %.0f KB/s",
+	   verb, x->name, (long)(x->done / 1024), (long)(x->size / 1024),
+	   x->size ? (int)(x->done * 100 / x->size) : 100,
+	   secs > 0 ? x->done / 1024.0 / secs : 0.0);
+  set_status(STATUS_XFER, buf);
+}
+
+static void
+clean_name(char *name) {
+  char *p;
+
+  p = strrchr(name, '/');
+  if (p)
+    memmove(name, p + 1, strlen(p + 1) + 1);
+  for (p = name; *p; p++) {
+    if (!isprint((unsigned char)*p))
+      *p = '_';
+  }
+  if (!*name || !strcmp(name, ".") || !strcmp(name, ".."))
+    strcpy(name, "ktalk-file");
+}
+
+static int
+open_unique(const char *dir, const char *name, char *path, size_t pathlen) {
+  int fd, i;
+
+  for (i = 0; i < 100; i++) {
+    if (i == 0)
+      snprintf(path, pathlen, "%s/%s", dir, name);
+    else
+      snprintf(path, pathlen, "%s/%s.%d", dir, name, i);
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0 || errno != EEXIST)
+      return fd;
+  }
+  return -1;
+}
+
+static void
+send_end(kconn *conn, int status) {
+  unsigned char buf[5];
+
+  put32(buf, out.id);
+  buf[4] = status;
+  if (send_sealed(conn, FRAME_FILE_END, (char *)buf, sizeof(buf)) < 0) {
+    if (errno != ENOBUFS)
+      fail(errno, "sending file data to party");
+    out.ending = status + 1;
+    return;
+  }
+  close(out.fd);
+  out.fd = -1;
+  out.ending = 0;
+  set_status(STATUS_XFER, NULL);
+}
+
+static void
+send_cancel(kconn *conn, krb5_ui_4 id) {
+  unsigned char buf[4];
+
+  put32(buf, id);
+  cancel_id = id;
+  cancel_pending = 0;
+  if (send_sealed(conn, FRAME_FILE_CANCEL, (char *)buf, sizeof(buf)) < 0) {
+    if (errno != ENOBUFS)
+      fail(errno, "sending file data to party");
+    cancel_pending = 1;
+  }
+}
+
+/* queue up a file to send; it goes out as the socket has room for it */
+int
+xfer_start(kconn *conn, const char *path) {
+  struct stat st;
+  const char *p;
+  int fd;
+
+  if (!(conn->caps & CAP_FILE)) {
+    notice("the other party's ktalk cannot receive files");
+    return -1;
+  }
+  if (out.fd >= 0) {
+    notice("still sending %s", out.name);
+    return -1;
+  }
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    notice("%s: %s", path, strerror(errno));
+    return -1;
+  }
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    notice("%s: not a regular file", path);
+    close(fd);
+    return -1;
+  }
+
+  p = strrchr(path, '/');
+  snprintf(out.name, sizeof(out.name), "%s", p ? p + 1 : path);
+  out.fd = fd;
+  out.id = next_id++;
+  out.size = st.st_size;
+  out.done = 0;
+  out.started = 0;
+  out.ending = 0;
+  out.held = 0;
+  notice("sending %s (%ld bytes)", out.name, (long)out.size);
+  return 0;
+}
+
+/* 1 while there is anything still to send */
+int
+xfer_sending(void) {
+  return out.fd >= 0 || cancel_pending;
+}
+
+/* send the next piece of the outgoing file */
+void
+xfer_send_next(kconn *conn) {
+  unsigned char hdr[12];
+  char buf[sizeof(hdr) + sizeof(out.name)];
+  double secs;
+  int n;
+
+  if (cancel_pending)
+    send_cancel(conn, cancel_id);
+  if (out.fd < 0)
+    return;
+  if (out.ending) {
+    send_end(conn, out.ending - 1);
+    return;
+  }
+
+  if (!out.started) {
+    put32(hdr, out.id);
+    put32(hdr + 4, (krb5_ui_4)((unsigned long long)out.size >> 32));
+    put32(hdr + 8, (krb5_ui_4)out.size);
+    memcpy(buf, hdr, sizeof(hdr));
+    n = strlen(out.name);
+    memcpy(buf + sizeof(hdr), out.name, n);
+    if (send_sealed(conn, FRAME_FILE_BEGIN, buf, sizeof(hdr) + n) < 0) {
+      if (errno != ENOBUFS)
+	fail(errno, "sending file data to party");
+      return;
+    }
+    out.started = 1;
+    gettimeofday(&out.start, NULL);
+    out.shown = out.start;
+    return;
+  }
+
+  n = out.held ? out.held : read(out.fd, chunk, sizeof(chunk));
+  if (n < 0) {
+    if (errno == EINTR)
+      return;
+    notice("reading %s: %s", out.name, strerror(errno));
+    send_end(conn, 1);
+    return;
+  }
+  if (n == 0) {
+    secs = elapsed(&out.start);
+    notice("sent %s, %ld bytes in %.1f seconds", out.name, (long)out.done,
+	   secs);
+    send_end(conn, 0);
+    return;
+  }
+
+  TRACE(TR_XFER, out.id, out.done, n);
+  if (send_sealed(conn, FRAME_FILE_DATA, chunk, n) < 0) {
+    if (errno != ENOBUFS)
+      fail(errno, "sending file data to party");
+    out.held = n;
+    return;
+  }
+  out.held = 0;
+  out.done += n;
+  progress(&out, "sending");
+}
+
+static void
+receive_begin(kconn *conn, krb5_data *msg) {
+  const unsigned char *p = (const unsigned char *)msg->data;
+  size_t namelen;
+
+  if (msg->length < 12) {
+    notice("ignoring a malformed file offer");
+    return;
+  }
+  if (in.fd >= 0) {
+    notice("%s was cut short", in.path);
+    close(in.fd);
+  }
+
+  in.fd = -1;
+  in.discard = 0;
+  in.id = get32(p);
+  in.size = ((off_t)get32(p + 4) << 32) | get32(p + 8);
+  in.done = 0;
+  namelen = msg->length - 12;
+  if (namelen >= sizeof(in.name))
+    namelen = sizeof(in.name) - 1;
+  memcpy(in.name, msg->data + 12, namelen);
+  in.name[namelen] = '\0';
+  clean_name(in.name);
+
+  if (!recv_dir) {
+    notice("refused %s (%ld bytes); run ktalk with -r <dir> to accept files",
+	   in.name, (long)in.size);
+    in.discard = 1;
+    send_cancel(conn, in.id);
+    return;
+  }
+
+  in.fd = open_unique(recv_dir, in.name, in.path, sizeof(in.path));
+  if (in.fd < 0) {
+    notice("could not save %s: %s", in.name, strerror(errno));
+    in.discard = 1;
+    send_cancel(conn, in.id);
+    return;
+  }
+  notice("receiving %s (%ld bytes) into %s", in.name, (long)in.size,
+	 in.path);
+  gettimeofday(&in.start, NULL);
+  in.shown = in.start;
+}
+
+static void
+receive_data(kconn *conn, krb5_data *msg) {
+  char *p = msg->data;
+  size_t left = msg->length;
+  int n;
+
+  if (in.discard)
+    return;
+  if (in.fd < 0) {
+    debug("file data with no file open");
+    return;
+  }
+
+  while (left > 0) {
+    n = write(in.fd, p, left);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      notice("writing %s: %s", in.path, strerror(errno));
+      close(in.fd);
+      in.fd = -1;
+      in.discard = 1;
+      set_status(STATUS_XFER, NULL);
+      send_cancel(conn, in.id);
+      return;
+    }
+    p += n;
+    left -= n;
+  }
+  in.done += msg->length;
+  progress(&in, "receiving");
+}
+
+static void
+receive_end(krb5_data *msg) {
+  int status;
+
+  status = msg->length >= 5 ? msg->data[4] : 1;
+  if (in.fd >= 0) {
+    close(in.fd);
+    if (status)
+      notice("the other party gave up sending %s", in.name);
+    else if (in.done != in.size)
+      notice("received %s, but only %ld of %ld bytes", in.path,
+	     (long)in.done, (long)in.size);
+    else
+      notice("received %s, %ld bytes in %.1f seconds", in.path,
+	     (long)in.done, elapsed(&in.start));
+  }
+  in.fd = -1;
+  in.discard = 0;
+  set_status(STATUS_XFER, NULL);
+}
+
+static void
+receive_cancel(kconn *conn, krb5_data *msg) {
+  if (msg->length < 4 || out.fd < 0 || !out.started)
+    return;
+  if (get32((unsigned char *)msg->data) != out.id)
+    return;
+  notice("the other party did not accept %s", out.name);
+  send_end(conn, 1);
+}
+
+/* handle an unsealed file transfer frame from the peer */
+void
+xfer_receive(kconn *conn, int type, krb5_data *msg) {
+  switch (type) {
+  case FRAME_FILE_BEGIN:
+    receive_begin(conn, msg);
+    break;
+  case FRAME_FILE_DATA:
+    receive_data(conn, msg);
+    break;
+  case FRAME_FILE_END:
+    receive_end(msg);
+    break;
+  case FRAME_FILE_CANCEL:
+    receive_cancel(conn, msg);
+    break;
+  }
+}
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */
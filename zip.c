@@ -0,0 +1,233 @@
+/*
+Copyright © 1999 James Kretchmar
+
+All rights reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for any purpose and without fee is hereby granted, provided that
+the above copyright notice appear in all copies and that both that copyright
+notice and this permission notice appear in supporting documentation, and that
+the name of James Kretchmar not be used in advertising or publicity pertaining
+to distribution of the software without specific, written prior permission.
+
+JAMES KRETCHMAR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT
+SHALL JAMES KRETCHMAR BE LIABLE FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL
+DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+
+/*
+ * Compression, for when both ends ask for it with -z.  Every sealed
+ * message then starts with a byte saying whether what follows is as it
+ * was or deflated, so that byte is under the seal with the rest.  Each
+ * direction of each channel has one zlib stream for the whole session,
+ * flushed at the end of every frame, so a log pasted twice costs little
+ * the second time; channels have their own since their frames may pass
+ * each other on the way.  A stream is only set up once it is needed.
+ * Frames shorter than ZIP_MIN are not worth it and go as they are.
+ *
+ * It is off by default because how well a message compresses says
+ * something about what is in it: someone who can watch the lengths on
+ * the wire, and get you to send text of their choosing next to a secret,
+ * can learn the secret a piece at a time.
+ *
+ * Nothing inflates to more than FRAME_MAXLEN, since no sender ever
+ * deflates more than that into one frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ktalk.h"
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+
+#define ZIP_MIN		128	/* shorter frames go as they are */
+#define ZIP_RAW		0
+#define ZIP_DEFLATE	1
+
+struct kzip {
+  z_stream out[CHAN_COUNT], in[CHAN_COUNT];
+  unsigned int started;		/* which of them are set up */
+  char *sealbuf;		/* marker and frame, reused for every one */
+  size_t sealbufsize;
+  char *inbuf;			/* the last frame inflated */
+  krb5_data opened;		/* as the backend opened it, for done */
+  unsigned long long rawout, zipout, rawin, zipin;
+  long long usec;
+};
+
+kzip *
+zip_start(void) {
+  kzip *z;
+
+  z = calloc(1, sizeof(*z));
+  if (!z)
+    fail(errno, "allocating compression state");
+  z->inbuf = malloc(FRAME_MAXLEN + 1);
+  if (!z->inbuf)
+    fail(errno, "allocating compression buffer");
+  return z;
+}
+
+/* chan's stream for one direction, set up the first time */
+static z_stream *
+zstream(kzip *z, int chan, int out) {
+  unsigned int bit = 1 << (2 * chan + out);
+  z_stream *s = out ? &z->out[chan] : &z->in[chan];
+  int ret;
+
+  if (!(z->started & bit)) {
+    ret = out ? deflateInit(s, Z_DEFAULT_COMPRESSION) : inflateInit(s);
+    if (ret != Z_OK)
+      fail(ENOMEM, "starting compression");
+    z->started |= bit;
+  }
+  return s;
+}
+
+void
+zip_free(kzip *z) {
+  int i;
+
+  for (i = 0; i < CHAN_COUNT; i++) {
+    if (z->started & 1 << (2 * i + 1))
+      deflateEnd(&z->out[i]);
+    if (z->started & 1 << (2 * i))
+      inflateEnd(&z->in[i]);
+  }
+  free(z->sealbuf);
+  free(z->inbuf);
+  free(z);
+}
+
+int
+zip_seal(kconn *conn, int type, const char *data, size_t len) {
+  kzip *z = conn->zip;
+  z_stream *out = NULL;
+  size_t need;
+  long long start;
+  int ret;
+
+  /* what goes into the stream must reach the peer, so check for room first */
+  if (len >= ZIP_MIN)
+    out = zstream(z, frame_chan(conn, type), 1);
+  need = 1 + (out ? deflateBound(out, len) + 16 : len);
+  if (conn_full(conn, FRAME_HDRLEN + need + SEAL_SLOP)) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  if (need > z->sealbufsize) {
+    free(z->sealbuf);
+    z->sealbuf = malloc(need);
+    if (!z->sealbuf)
+      fail(errno, "allocating compression buffer");
+    z->sealbufsize = need;
+  }
+
+  if (!out) {
+    z->sealbuf[0] = ZIP_RAW;
+    memcpy(z->sealbuf + 1, data, len);
+    return conn->sec->seal(conn, type, z->sealbuf, 1 + len);
+  }
+
+  start = now_usec();
+  z->sealbuf[0] = ZIP_DEFLATE;
+  out->next_in = (Bytef *)data;
+  out->avail_in = len;
+  out->next_out = (Bytef *)z->sealbuf + 1;
+  out->avail_out = need - 1;
+  ret = deflate(out, Z_SYNC_FLUSH);
+  if (ret != Z_OK || out->avail_in || !out->avail_out)
+    fail(EIO, "compressing message");
+  need -= out->avail_out;
+  z->usec += now_usec() - start;
+  z->rawout += len;
+  z->zipout += need - 1;
+  return conn->sec->seal(conn, type, z->sealbuf, need);
+}
+
+krb5_error_code
+zip_open(kconn *conn, kframe *frame, krb5_data *msg) {
+  kzip *z = conn->zip;
+  z_stream *in;
+  krb5_error_code ret;
+  long long start;
+  size_t len;
+
+  ret = conn->sec->open(conn, frame, &z->opened);
+  if (ret)
+    return ret;
+  if (z->opened.length < 1) {
+    ret = EPROTO;
+    goto bad;
+  }
+
+  if (z->opened.data[0] == ZIP_RAW) {
+    msg->data = z->opened.data + 1;
+    msg->length = z->opened.length - 1;
+    return 0;
+  }
+  if (z->opened.data[0] != ZIP_DEFLATE) {
+    ret = EPROTO;
+    goto bad;
+  }
+
+  /* a frame that will not fit in FRAME_MAXLEN was never sent by a ktalk */
+  start = now_usec();
+  in = zstream(z, frame->chan, 0);
+  in->next_in = (Bytef *)z->opened.data + 1;
+  in->avail_in = z->opened.length - 1;
+  in->next_out = (Bytef *)z->inbuf;
+  in->avail_out = FRAME_MAXLEN + 1;
+  ret = inflate(in, Z_SYNC_FLUSH);
+  if (ret != Z_OK && ret != Z_BUF_ERROR) {
+    ret = EPROTO;
+    goto bad;
+  }
+  len = FRAME_MAXLEN + 1 - in->avail_out;
+  if (in->avail_in || len > FRAME_MAXLEN) {
+    ret = EMSGSIZE;
+    goto bad;
+  }
+  z->usec += now_usec() - start;
+  z->zipin += z->opened.length - 1;
+  z->rawin += len;
+  msg->data = z->inbuf;
+  msg->length = len;
+  return 0;
+
+bad:
+  conn->sec->done(conn, frame, &z->opened);
+  return ret;
+}
+
+void
+zip_done(kconn *conn, kframe *frame, krb5_data *msg) {
+  conn->sec->done(conn, frame, &conn->zip->opened);
+}
+
+/* how much it has saved, and what it cost; 0 if it has done nothing yet */
+int
+zip_stats(kzip *z, char *buf, size_t len) {
+  unsigned long long raw = z->rawout + z->rawin, zip = z->zipout + z->zipin;
+
+  if (!zip)
+    return 0;
+  snprintf(buf, len, "zlib %.1fx, %lld ms", (double)raw / zip,
+	   z->usec / 1000);
+  return 1;
+}
+#endif /* HAVE_LIBZ */
+
+/*
+ * Local Variables:
+ * mode:C
+ * c-basic-offset:2
+ * End:
+ */